@@ -1,5 +1,13 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "uw_curl.h"
 
@@ -10,6 +18,20 @@ UwTypeId UwTypeId_FileRequest = 0;
 typedef struct {
     _UwValue file;  // autocleaned UwValue is not suitable for manually managed data,
                     // using bare structure that starts with underscore
+
+    // size-aware scheduling
+    curl_off_t expected_size;  // -1 if unknown
+    bool elephant;             // holds one of elephant slots
+    bool deferred;             // rejected because elephant slots are full, queued again
+
+    // hedged requests write to a separate file that replaces the original one if the hedge wins
+    _UwValue filename;  // final file name
+    _UwValue path;      // the file actually written
+    bool renamed;       // the hedge has won and its file replaced the original one
+
+    _UwValue directory;  // where the file is written, null for current directory
+
+    _UwValue store_sink;  // null if not storing
 } FileRequestData;
 
 // this macro gets pointer to FileRequestData from UwValue
@@ -18,143 +40,1510 @@ typedef struct {
 
 // global parameters from argv
 __UWDECL_Null( proxy );
+__UWDECL_Null( hedge_proxy );
+__UWDECL_Null( trace_file );
+__UWDECL_Null( listen_path );
 __UWDECL_Bool( verbose, false );
+unsigned digest_algorithm = 0;
+unsigned preconnect = 0;
+
+// WARC writer, null if not archiving
+__UWDECL_Null( warc_writer );
+
+// content-addressed store, null if files are written directly
+__UWDECL_Null( store );
+
+// origin of the last preconnect
+__UWDECL_Null( last_origin );
+
+// CURL session and request template, destroyed explicitly before curl_global_cleanup
+__UWDECL_Null( session );
+__UWDECL_Null( request_template );
 
 
 // signal handling
 
-sig_atomic_t pending_sigint = 0;
+volatile sig_atomic_t pending_sigint = 0;
+
+void sigint_handler(int sig)
+/*
+ * The first interrupt lets running transfers finish, the second one aborts them.
+ * The session loop is woken up immediately.
+ */
+{
+    CurlCancelMode mode = pending_sigint? CURL_CANCEL_ABORT : CURL_CANCEL_DRAIN;
+    puts(pending_sigint? "\nAborting" : "\nInterrupted, finishing running transfers");
+    pending_sigint = 1;
+    if (session.type_id == UwTypeId_CurlSession) {
+        curl_session_cancel(&session, mode);
+    }
+}
+
+/****************************************************************
+ * Size-aware scheduling
+ *
+ * By default free slots are filled with URLs in command line order.
+ * With schedule=size URLs of known size are started shortest first,
+ * then URLs of unknown size, and large transfers (elephants) may hold
+ * at most elephant_slots slots while smaller work is pending.
+ *
+ * Sizes are learned from Content-Length when response headers arrive,
+ * or in advance with HEAD probes if probe=1. When a transfer turns out
+ * to be an elephant and elephant slots are full, the response is rejected
+ * and URL is queued again as elephant.
+ *
+ * Queues are accessed under the lock because continuations may run in worker threads.
+ */
+
+typedef struct {
+    _UwValue url;
+    curl_off_t size;  // -1 if unknown
+    unsigned seq;     // command line order, breaks ties
+
+} Job;
+
+typedef struct {
+    // each URL is pushed to each queue at most once, so queues never wrap
+    Job* jobs;
+    unsigned head;
+    unsigned tail;
+
+} JobFifo;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    bool enabled;
+    bool probe;
+    curl_off_t elephant_size;
+    unsigned elephant_slots;
+
+    JobFifo unprobed;
+    JobFifo unknown;
+    JobFifo elephants;
+    Job* mice;  // min-heap by size
+    unsigned num_mice;
+    unsigned capacity;  // of each queue
+
+    unsigned probes_running;
+    unsigned elephants_running;
+
+    // stats
+    unsigned started_mice;
+    unsigned started_unknown;
+    unsigned started_elephants;
+    unsigned probes;
+    unsigned probes_failed;
+    unsigned deferred;
+
+    // completion times are collected in both modes to compare them
+    uint64_t start_ns;
+    uint64_t last_completion_ns;
+    unsigned num_completed;
+    uint64_t completion_sum_ns;
+    unsigned num_small_completed;
+    uint64_t small_completion_sum_ns;
+
+} Scheduler;
+
+void create_request(UwValuePtr session, UwValuePtr url, curl_off_t expected_size, bool elephant);
+
+Scheduler scheduler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .elephant_size = 16 * 1024 * 1024,
+    .elephant_slots = 1
+};
+
+static void fifo_push(JobFifo* fifo, Job* job)
+{
+    fifo->jobs[fifo->tail++] = *job;
+}
+
+static bool fifo_pop(JobFifo* fifo, Job* job)
+{
+    if (fifo->head == fifo->tail) {
+        return false;
+    }
+    *job = fifo->jobs[fifo->head++];
+    return true;
+}
+
+static inline bool job_before(Job* a, Job* b)
+{
+    return a->size < b->size || (a->size == b->size && a->seq < b->seq);
+}
+
+static void mice_push(Job* job)
+{
+    Job* heap = scheduler.mice;
+    unsigned i = scheduler.num_mice++;
+    while (i) {
+        unsigned parent = (i - 1) / 2;
+        if (!job_before(job, &heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = *job;
+}
+
+static bool mice_pop(Job* job)
+{
+    if (scheduler.num_mice == 0) {
+        return false;
+    }
+    Job* heap = scheduler.mice;
+    *job = heap[0];
+    Job last = heap[--scheduler.num_mice];
+    unsigned n = scheduler.num_mice;
+    unsigned i = 0;
+    for (;;) {
+        unsigned child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && job_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!job_before(&heap[child], &last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return true;
+}
+
+static void queue_job(Job* job)
+/*
+ * Put job to the queue by its size. Must be called under the lock.
+ */
+{
+    if (job->size < 0) {
+        fifo_push(&scheduler.unknown, job);
+    } else if (job->size >= scheduler.elephant_size) {
+        fifo_push(&scheduler.elephants, job);
+    } else {
+        mice_push(job);
+    }
+}
+
+static bool small_work_pending()
+/*
+ * Must be called under the lock.
+ */
+{
+    return scheduler.num_mice
+        || scheduler.unknown.head != scheduler.unknown.tail
+        || scheduler.unprobed.head != scheduler.unprobed.tail
+        || scheduler.probes_running;
+}
+
+static bool claim_elephant_slot()
+/*
+ * Elephants may take all slots when there's nothing else to do.
+ * Must be called under the lock.
+ */
+{
+    if (scheduler.elephants_running >= scheduler.elephant_slots && small_work_pending()) {
+        return false;
+    }
+    scheduler.elephants_running++;
+    return true;
+}
+
+static void release_elephant_slot()
+{
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.elephants_running--;
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+bool scheduler_init(UwValuePtr urls)
+/*
+ * Move URLs to scheduler queues.
+ */
+{
+    unsigned n = uw_array_length(urls);
+    unsigned memsize = n * sizeof(Job);
+    scheduler.capacity = n;
+    scheduler.unprobed.jobs  = default_allocator.allocate(memsize, false);
+    scheduler.unknown.jobs   = default_allocator.allocate(memsize, false);
+    scheduler.elephants.jobs = default_allocator.allocate(memsize, false);
+    scheduler.mice           = default_allocator.allocate(memsize, false);
+    if (!scheduler.unprobed.jobs || !scheduler.unknown.jobs || !scheduler.elephants.jobs || !scheduler.mice) {
+        fprintf(stderr, "Cannot allocate scheduler queues\n");
+        return false;
+    }
+    // URLs are popped from the end, same order as in plain mode
+    for (unsigned i = 0; i < n; i++) {
+        Job job = {
+            .url  = uw_array_pop(urls),
+            .size = -1,
+            .seq  = i
+        };
+        if (uw_error(&job.url)) {
+            uw_print_status(stdout, &job.url);
+            uw_destroy(&job.url);
+            return false;
+        }
+        if (scheduler.probe) {
+            fifo_push(&scheduler.unprobed, &job);
+        } else {
+            fifo_push(&scheduler.unknown, &job);
+        }
+    }
+    return true;
+}
+
+static void fini_fifo(JobFifo* fifo)
+{
+    if (fifo->jobs) {
+        Job job;
+        while (fifo_pop(fifo, &job)) {
+            uw_destroy(&job.url);
+        }
+        default_allocator.release((void**) &fifo->jobs, scheduler.capacity * sizeof(Job));
+    }
+}
+
+void scheduler_fini()
+{
+    fini_fifo(&scheduler.unprobed);
+    fini_fifo(&scheduler.unknown);
+    fini_fifo(&scheduler.elephants);
+    if (scheduler.mice) {
+        Job job;
+        while (mice_pop(&job)) {
+            uw_destroy(&job.url);
+        }
+        default_allocator.release((void**) &scheduler.mice, scheduler.capacity * sizeof(Job));
+    }
+}
+
+static void probe_done(UwValuePtr request, CURLcode result, void* ctx)
+/*
+ * Continuation of HEAD probe, queue the job by its size.
+ */
+{
+    Job* job = ctx;
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    pthread_mutex_lock(&scheduler.lock);
+    if (result == CURLE_OK && req->status >= 200 && req->status <= 299) {
+        job->size = curl_request_content_length(request);
+    }
+    if (job->size < 0) {
+        scheduler.probes_failed++;
+    }
+    queue_job(job);
+    scheduler.probes_running--;
+    pthread_mutex_unlock(&scheduler.lock);
+
+    default_allocator.release((void**) &job, sizeof(Job));
+}
+
+static void start_probe(UwValuePtr session, Job* job)
+{
+    Job* ctx = default_allocator.allocate(sizeof(Job), false);
+    if (!ctx) {
+        goto unknown_size;
+    }
+    *ctx = *job;
+    UwValue request = curl_request_from_template(&request_template, UwTypeId_CurlRequest, &job->url);
+    if (uw_error(&request)) {
+        default_allocator.release((void**) &ctx, sizeof(Job));
+        goto unknown_size;
+    }
+    curl_easy_setopt(uw_curl_request_data_ptr(&request)->easy_handle, CURLOPT_NOBODY, 1L);
+    if (!curl_request_then(&request, probe_done, ctx)) {
+        curl_request_drop(&request, CURLE_OUT_OF_MEMORY);
+        default_allocator.release((void**) &ctx, sizeof(Job));
+        goto unknown_size;
+    }
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.probes++;
+    scheduler.probes_running++;
+    pthread_mutex_unlock(&scheduler.lock);
+    // if the request cannot be added, probe_done queues the job with unknown size
+    add_curl_request(session, &request);
+    return;
+
+unknown_size:
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.probes_failed++;
+    fifo_push(&scheduler.unknown, job);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+unsigned schedule_requests(UwValuePtr session, unsigned running, unsigned parallel)
+/*
+ * Fill free slots from scheduler queues.
+ * Return the number of running transfers including just started ones.
+ */
+{
+    while (running < parallel) {{
+        Job job;
+        bool elephant = false;
+        bool probe = false;
+
+        pthread_mutex_lock(&scheduler.lock);
+        if (mice_pop(&job)) {
+            scheduler.started_mice++;
+        } else if (fifo_pop(&scheduler.unprobed, &job)) {
+            probe = true;
+        } else if (fifo_pop(&scheduler.unknown, &job)) {
+            scheduler.started_unknown++;
+        } else if (scheduler.elephants.head != scheduler.elephants.tail && claim_elephant_slot()) {
+            fifo_pop(&scheduler.elephants, &job);
+            scheduler.started_elephants++;
+            elephant = true;
+        } else {
+            pthread_mutex_unlock(&scheduler.lock);
+            break;
+        }
+        pthread_mutex_unlock(&scheduler.lock);
+
+        if (probe) {
+            start_probe(session, &job);
+        } else {
+            create_request(session, &job.url, job.size, elephant);
+            uw_destroy(&job.url);
+        }
+        running++;
+    }}
+    return running;
+}
+
+static void request_done(UwValuePtr request, CURLcode result, void* ctx)
+/*
+ * Continuation of file requests, collects completion times
+ * and releases elephant slot.
+ */
+{
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(request);
+    FileRequestData* file_req = file_request_data_ptr(request);
+
+    uint64_t now = curl_trace_now();
+
+    pthread_mutex_lock(&scheduler.lock);
+    if (file_req->elephant) {
+        scheduler.elephants_running--;
+    }
+    if (result == CURLE_OK && !file_req->deferred && !curl_req->rejected) {
+        uint64_t completion_time = now - scheduler.start_ns;
+        scheduler.num_completed++;
+        scheduler.completion_sum_ns += completion_time;
+        scheduler.last_completion_ns = now;
+
+        curl_off_t size;
+        if (curl_easy_getinfo(curl_req->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &size) == CURLE_OK
+            && size < scheduler.elephant_size) {
+            scheduler.num_small_completed++;
+            scheduler.small_completion_sum_ns += completion_time;
+        }
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+static bool check_elephant(UwValuePtr self)
+/*
+ * Called when headers are received. Claim elephant slot for large transfer
+ * or defer it if slots are full.
+ */
+{
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(self);
+    FileRequestData* file_req = file_request_data_ptr(self);
+
+    if (!scheduler.enabled || file_req->elephant || curl_req->hedge) {
+        return true;
+    }
+    curl_off_t content_length = curl_request_content_length(self);
+    if (content_length < 0) {
+        // no Content-Length, use probed size
+        content_length = file_req->expected_size;
+    }
+    if (content_length < scheduler.elephant_size) {
+        return true;
+    }
+    bool accepted = true;
+    pthread_mutex_lock(&scheduler.lock);
+    if (claim_elephant_slot()) {
+        file_req->elephant = true;
+    } else {
+        Job job = {
+            .url  = uw_clone(&curl_req->url),
+            .size = content_length,
+            .seq  = 0
+        };
+        fifo_push(&scheduler.elephants, &job);
+        scheduler.deferred++;
+        file_req->deferred = true;
+        accepted = false;
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    return accepted;
+}
+
+void scheduler_print_stats(FILE* fp)
+{
+    if (scheduler.enabled) {
+        fprintf(fp, "Scheduler: started %u small, %u of unknown size, %u large; %u deferred\n",
+                scheduler.started_mice, scheduler.started_unknown,
+                scheduler.started_elephants, scheduler.deferred);
+        if (scheduler.probe) {
+            fprintf(fp, "Probes: %u sent, %u without size\n", scheduler.probes, scheduler.probes_failed);
+        }
+    }
+    if (scheduler.num_completed) {
+        fprintf(fp, "Completion time: mean %.3fs, last %.3fs",
+                scheduler.completion_sum_ns / 1e9 / scheduler.num_completed,
+                (scheduler.last_completion_ns - scheduler.start_ns) / 1e9);
+        if (scheduler.num_small_completed) {
+            fprintf(fp, ", mean of %u small %.3fs",
+                    scheduler.num_small_completed,
+                    scheduler.small_completion_sum_ns / 1e9 / scheduler.num_small_completed);
+        }
+        fputc('\n', fp);
+    }
+}
+
+static bool link_stored(UwValuePtr url)
+/*
+ * Link the name of previously stored URL to its content instead of downloading it.
+ */
+{
+    UwValue digest = UwNull();
+    UwValue name = UwNull();
+    if (!curl_store_lookup(&store, url, &digest, &name) || uw_strlen(&name) == 0) {
+        return false;
+    }
+    if (!curl_store_link(&store, &digest, &name)) {
+        return false;
+    }
+    UW_CSTRING_LOCAL(url_cstr, url);
+    UW_CSTRING_LOCAL(name_cstr, &name);
+    printf("Stored %s -> %s\n", url_cstr, name_cstr);
+    return true;
+}
+
+static bool append_store_sink(UwValuePtr request)
+/*
+ * Append store sink to the pipeline, its name is set when headers are received.
+ */
+{
+    if (uw_is_null(&store)) {
+        return true;
+    }
+    UwValue sink = curl_store_sink(&store);
+    if (uw_error(&sink) || !curl_request_append_stage(request, &sink)) {
+        return false;
+    }
+    file_request_data_ptr(request)->store_sink = uw_move(&sink);
+    return true;
+}
+
+void create_request(UwValuePtr session, UwValuePtr url, curl_off_t expected_size, bool elephant)
+/*
+ * Helper function to create Curl request of our custom FileRequest type
+ */
+{
+    if (!uw_is_null(&store) && link_stored(url)) {
+        if (elephant) {
+            release_elephant_slot();
+        }
+        return;
+    }
+
+    // proxy and verbosity come from template
+    UwValue request = curl_request_from_template(&request_template, UwTypeId_FileRequest, url);
+    if (uw_error(&request)) {
+        uw_print_status(stdout, &request);
+        if (elephant) {
+            release_elephant_slot();
+        }
+        return;
+    }
+
+    FileRequestData* file_req = file_request_data_ptr(&request);
+    file_req->expected_size = expected_size;
+    file_req->elephant = elephant;
+    curl_request_then(&request, request_done, nullptr);
+
+    UW_CSTRING_LOCAL(url_cstr, url);
+    printf("Requesting %s\n", url_cstr);
+
+    if (digest_algorithm) {
+        curl_request_enable_digest(&request, digest_algorithm);
+    }
+    if (!uw_is_null(&warc_writer)) {
+        UwValue sink = curl_warc_sink(&warc_writer);
+        if (uw_error(&sink) || !curl_request_append_stage(&request, &sink)) {
+            printf("Cannot archive %s\n", url_cstr);
+        }
+    }
+    if (!append_store_sink(&request)) {
+        printf("Cannot store %s\n", url_cstr);
+        // request_done releases elephant slot
+        curl_request_drop(&request, CURLE_OUT_OF_MEMORY);
+        return;
+    }
+    add_curl_request(session, &request);
+
+    // request is now held by Curl handle
+    // and will be destroyed in curl_perform
+}
+
+UwResult make_hedge(UwValuePtr request, void* ctx)
+/*
+ * Hedge function, duplicates stalled request, possibly through different proxy.
+ */
+{
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(request);
+
+    UwValue hedge = curl_request_from_template(&request_template, UwTypeId_FileRequest, &curl_req->url);
+    uw_return_if_error(&hedge);
+
+    if (uw_is_string(&hedge_proxy)) {
+        curl_request_set_proxy(&hedge, &hedge_proxy);
+    }
+    if (digest_algorithm) {
+        curl_request_enable_digest(&hedge, digest_algorithm);
+    }
+    if (!append_store_sink(&hedge)) {
+        curl_request_drop(&hedge, CURLE_OUT_OF_MEMORY);
+        return UwNull();
+    }
+    // the hedge is not scheduled, just counted when it wins
+    FileRequestData* file_req = file_request_data_ptr(&hedge);
+    file_req->expected_size = file_request_data_ptr(request)->expected_size;
+    file_req->directory = uw_clone(&file_request_data_ptr(request)->directory);
+    curl_request_then(&hedge, request_done, nullptr);
+
+    UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+    printf("Hedging %s\n", url_cstr);
+    return uw_move(&hedge);
+}
+
+void look_ahead(UwValuePtr session, UwValuePtr urls)
+/*
+ * Preconnect to the host of the next URL if it differs from the previous one.
+ */
+{
+    unsigned n = uw_array_length(urls);
+    if (preconnect == 0 || n == 0) {
+        return;
+    }
+    UwValue next_url = uw_array_item(urls, n - 1);  // URLs are popped from the end
+    UwValue origin = urlorigin(&next_url);
+    if (uw_error(&origin) || (uw_is_string(&last_origin) && uw_equal(&origin, &last_origin))) {
+        return;
+    }
+    curl_session_preconnect(session, &origin, &proxy, preconnect);
+    uw_destroy(&last_origin);
+    last_origin = uw_move(&origin);
+}
+
+static UwResult response_filename(CurlRequestData* curl_req)
+/*
+ * Get file name from response headers, they are parsed before headers_complete,
+ * or from URL.
+ */
+{
+    UwValue filename_info = curl_request_get_filename(curl_req);
+    UwValue full_name = uw_map_get(&filename_info, "filename");
+    UwValue filename = uw_basename(&full_name);
+    if (!uw_error(&filename) && uw_strlen(&filename) != 0) {
+        return uw_move(&filename);
+    }
+    UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+    CurlUrlView view;
+    curl_url_view(url_cstr, strlen(url_cstr), &view);
+    char basename[view.basename.length + 1];
+    unsigned length = curl_percent_decode(view.basename, basename, sizeof(basename));
+    for (unsigned i = 0; i < length; i++) {
+        if (basename[i] == '/') {
+            // decoded from %2F
+            basename[i] = '_';
+        }
+    }
+    return uw_create_string(basename[0]? basename : "index.html");
+}
+
+size_t write_data(void* data, size_t always_1, size_t size, UwValuePtr self)
+/*
+ * Overloaded method of Curl interface.
+ */
+{
+    if (size == 0) {
+        printf("%s is called with size=%zu\n", __func__, size);
+        return 0;
+    }
+
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(self);
+    FileRequestData* file_req = file_request_data_ptr(self);
+
+    if (uw_is_null(&file_req->file)) {
+
+        // the file is not created yet, do that
+
+        UwValue filename = response_filename(curl_req);
+        if (uw_error(&filename)) {
+            uw_print_status(stdout, &filename);
+            return 0;
+        }
+        if (uw_is_string(&file_req->directory)) {
+            UW_CSTRING_LOCAL(directory_cstr, &file_req->directory);
+            UW_CSTRING_LOCAL(basename_cstr, &filename);
+            char full_name[strlen(directory_cstr) + strlen(basename_cstr) + 2];
+            sprintf(full_name, "%s/%s", directory_cstr, basename_cstr);
+            uw_destroy(&filename);
+            filename = uw_create_string(full_name);
+            if (uw_error(&filename)) {
+                uw_print_status(stdout, &filename);
+                return 0;
+            }
+        }
+
+        file_req->filename = uw_clone(&filename);
+        file_req->path = uw_clone(&filename);
+        if (curl_req->hedge) {
+            // the original request may be writing to filename
+            UW_CSTRING_LOCAL(filename_cstr, &filename);
+            char hedge_name[strlen(filename_cstr) + sizeof(".hedge")];
+            strcpy(hedge_name, filename_cstr);
+            strcat(hedge_name, ".hedge");
+            uw_destroy(&file_req->path);
+            file_req->path = uw_create_string(hedge_name);
+            if (uw_error(&file_req->path)) {
+                uw_print_status(stdout, &file_req->path);
+                return 0;
+            }
+        }
+        file_req->file = uw_file_open(&file_req->path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (uw_error(&file_req->file)) {
+            uw_print_status(stdout, &file_req->file);
+            return 0;
+        }
+        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+        UW_CSTRING_LOCAL(filename_cstr, &file_req->path);
+        printf("Downloading %s -> %s\n", url_cstr, filename_cstr);
+    }
+
+    // write data to file
+
+    unsigned bytes_written;
+    UwValue status = uw_file_write(&file_req->file, data, size, &bytes_written);
+    if (uw_error(&status)) {
+        uw_print_status(stdout, &status);
+        return 0;
+    }
+    return bytes_written;
+}
+
+bool headers_complete(UwValuePtr self)
+/*
+ * Overloaded method of Curl interface.
+ * Reject unsuccessful responses before their body is transferred.
+ */
+{
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(self);
+
+    if(curl_req->status != 200) {
+        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+        printf("FAILED: %u %s\n", curl_req->status, url_cstr);
+        return false;
+    }
+    if (!check_elephant(self)) {
+        return false;
+    }
+    FileRequestData* file_req = file_request_data_ptr(self);
+    if (!uw_is_null(&file_req->store_sink)) {
+        // the content goes to the store and the name is linked when complete,
+        // so hedges use the final name too
+        UwValue filename = response_filename(curl_req);
+        if (uw_error(&filename)) {
+            uw_print_status(stdout, &filename);
+            return false;
+        }
+        curl_store_sink_set_name(&file_req->store_sink, &filename);
+
+        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+        UW_CSTRING_LOCAL(filename_cstr, &filename);
+        printf("Downloading %s -> %s (store)\n", url_cstr, filename_cstr);
+    }
+    return true;
+}
+
+void request_complete(UwValuePtr self)
+/*
+ * Overloaded method of Curl interface.
+ */
+{
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(self);
+    FileRequestData* file_req = file_request_data_ptr(self);
+
+    if (uw_is_null(&file_req->file) && uw_is_null(&file_req->store_sink)) {
+        // nothing was written to file
+        return;
+    }
+
+    if (!uw_is_null(&file_req->file)) {
+        uw_file_close(&file_req->file);
+
+        if (curl_req->hedge) {
+            // the hedge has won
+            UW_CSTRING_LOCAL(path_cstr, &file_req->path);
+            UW_CSTRING_LOCAL(filename_cstr, &file_req->filename);
+            if (rename(path_cstr, filename_cstr) == -1) {
+                perror(filename_cstr);
+            } else {
+                file_req->renamed = true;
+            }
+        }
+    }
+
+    CurlContentEncoding encoding = curl_request_content_encoding(self);
+    if (encoding != CURL_ENCODING_IDENTITY) {
+        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+        printf("Kept %s encoding: %s\n", curl_content_encoding_name(encoding), url_cstr);
+    }
+
+    if (digest_algorithm) {
+        UwValue hex = curl_digest_hex(curl_req->digest, digest_algorithm);
+        if (uw_is_string(&hex)) {
+            UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
+            UW_CSTRING_LOCAL(hex_cstr, &hex);
+            printf("%s %s\n", hex_cstr, url_cstr);
+        }
+    }
+}
+
+void fini_file_request(UwValuePtr self)
+/*
+ * Overloaded method of Struct interface.
+ */
+{
+    FileRequestData* req = file_request_data_ptr(self);
+
+    uw_destroy(&req->file);
+
+    if (uw_curl_request_data_ptr(self)->hedge && !req->renamed && uw_is_string(&req->path)) {
+        // the hedge has lost, failed or was cancelled, remove its partial file
+        UW_CSTRING_LOCAL(path_cstr, &req->path);
+        unlink(path_cstr);
+    }
+    uw_destroy(&req->filename);
+    uw_destroy(&req->path);
+    uw_destroy(&req->directory);
+    uw_destroy(&req->store_sink);
+
+    // call super method
+    uw_ancestor_of(UwTypeId_FileRequest)->fini(self);
+}
+
+/****************************************************************
+ * Load generator mode
+ *
+ * Requests are issued on schedule at fixed rate regardless of responses (open loop).
+ * Latency is measured from the intended send time, so stalls of the server
+ * or the client are not hidden (no coordinated omission).
+ * Each thread runs its own session with its share of the rate.
+ */
+
+typedef struct {
+    pthread_t thread;
+    double rate;           // requests per second for this thread
+    uint64_t duration_ns;
+    CurlSessionConfig session_config;
+    char** urls;
+    unsigned num_urls;
+    char* proxy;  // nullptr if none, each thread creates own UW string
+
+    CurlHistogram* histogram;  // latency in microseconds
+    uint64_t requests;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t non_2xx;
+    uint64_t bytes;
+    unsigned outstanding;
+
+} LoadThread;
+
+typedef struct {
+    LoadThread* thread;
+    uint64_t intended_ns;
+
+} LoadSlot;
+
+static void load_request_done(UwValuePtr request, CURLcode result, void* ctx)
+{
+    LoadSlot* slot = ctx;
+    LoadThread* lt = slot->thread;
+
+    curl_histogram_record(lt->histogram, (curl_trace_now() - slot->intended_ns) / 1000);
+    lt->outstanding--;
+    if (result != CURLE_OK) {
+        lt->errors++;
+    } else {
+        lt->completed++;
+        unsigned status = uw_curl_request_data_ptr(request)->status;
+        if (status < 200 || status > 299) {
+            lt->non_2xx++;
+        }
+    }
+    default_allocator.release((void**) &slot, sizeof(LoadSlot));
+}
+
+static bool issue_load_request(LoadThread* lt, UwValuePtr session, UwValuePtr tmpl,
+                               UwValuePtr sink, UwValuePtr url, uint64_t intended_ns)
+{
+    UwValue request = curl_request_from_template(tmpl, UwTypeId_CurlRequest, url);
+    if (uw_error(&request)) {
+        return false;
+    }
+    LoadSlot* slot = nullptr;
+    if (!curl_request_append_stage(&request, sink)) {
+        goto drop;
+    }
+    slot = default_allocator.allocate(sizeof(LoadSlot), false);
+    if (!slot) {
+        goto drop;
+    }
+    slot->thread = lt;
+    slot->intended_ns = intended_ns;
+    if (!curl_request_then(&request, load_request_done, slot)) {
+        default_allocator.release((void**) &slot, sizeof(LoadSlot));
+        goto drop;
+    }
+    lt->requests++;
+    lt->outstanding++;
+
+    // if the request cannot be added, load_request_done counts the error and releases the slot
+    add_curl_request(session, &request);
+    return true;
+
+drop:
+    curl_request_drop(&request, CURLE_OUT_OF_MEMORY);
+    return false;
+}
+
+static void* load_thread(void* arg)
+{
+    LoadThread* lt = arg;
+
+    UwValue session = create_curl_session(&lt->session_config);
+    UwValue tmpl = curl_request_template();
+    UwValue sink = curl_null_sink();
+    UwValue urls = UwArray();
+    if (uw_error(&session) || uw_error(&tmpl) || uw_error(&sink) || uw_error(&urls)) {
+        return nullptr;
+    }
+    if (lt->proxy) {
+        UwValue thread_proxy = uw_create_string(lt->proxy);
+        if (uw_error(&thread_proxy)) {
+            return nullptr;
+        }
+        curl_template_set_proxy(&tmpl, &thread_proxy);
+    }
+    for (unsigned i = 0; i < lt->num_urls; i++) {{
+        UwValue url = uw_create_string(lt->urls[i]);
+        if (uw_error(&url) || !uw_array_append(&urls, &url)) {
+            return nullptr;
+        }
+    }}
+
+    uint64_t start = curl_trace_now();
+    uint64_t end = start + lt->duration_ns;
+    uint64_t drain_end = end + 10000000000ULL;  // wait for outstanding requests at most 10 seconds
+    uint64_t k = 0;
+    uint64_t next = start;
+
+    while (!pending_sigint) {
+        uint64_t now = curl_trace_now();
+
+        // issue requests scheduled by now
+        while (next <= now && next < end) {{
+            UwValue url = uw_array_item(&urls, k % lt->num_urls);
+            if (!issue_load_request(lt, &session, &tmpl, &sink, &url, next)) {
+                lt->errors++;
+            }
+            k++;
+            next = start + (uint64_t) (k * 1e9 / lt->rate);
+        }}
+        if (now >= end && (lt->outstanding == 0 || now >= drain_end)) {
+            break;
+        }
+
+        int timeout_ms = 100;
+        if (next < end) {
+            timeout_ms = (next > now)? (next - now) / 1000000 : 0;
+        }
+        int running_transfers;
+        if (!curl_perform_wait(&session, &running_transfers, timeout_ms)) {
+            break;
+        }
+        if (running_transfers == 0 && next < end) {
+            // nothing to wait on, sleep until the next request
+            now = curl_trace_now();
+            if (next > now) {
+                struct timespec ts = {
+                    .tv_sec  = (next - now) / 1000000000,
+                    .tv_nsec = (next - now) % 1000000000
+                };
+                nanosleep(&ts, nullptr);
+            }
+        }
+    }
+    lt->bytes = curl_null_sink_bytes(&sink);
+    return nullptr;
+}
+
+static void print_latency(char* label, double usec)
+{
+    if (usec < 1000.0) {
+        printf("%s%8.2fus", label, usec);
+    } else if (usec < 1000000.0) {
+        printf("%s%8.2fms", label, usec / 1000.0);
+    } else {
+        printf("%s%8.2fs ", label, usec / 1000000.0);
+    }
+}
+
+static void print_bytes(double bytes)
+{
+    if (bytes < 1024.0) {
+        printf("%.2fB", bytes);
+    } else if (bytes < 1024.0 * 1024.0) {
+        printf("%.2fKB", bytes / 1024.0);
+    } else if (bytes < 1024.0 * 1024.0 * 1024.0) {
+        printf("%.2fMB", bytes / (1024.0 * 1024.0));
+    } else {
+        printf("%.2fGB", bytes / (1024.0 * 1024.0 * 1024.0));
+    }
+}
+
+int run_load(char** urls, unsigned num_urls, char* proxy, CurlSessionConfig* session_config,
+             double rate, unsigned duration, unsigned num_threads)
+/*
+ * Run load threads and print wrk-style summary.
+ */
+{
+    LoadThread threads[num_threads];
+    memset(threads, 0, sizeof(threads));
+
+    // each thread runs its own session and creates its own values from C strings,
+    // UW types are read-only after constructors, so the allocator is the only
+    // UW state shared by threads; global values such as proxy must not be used
+    curl_alloc_serialize();
+
+    CurlHistogram* total = default_allocator.allocate(sizeof(CurlHistogram), false);
+    if (!total) {
+        return 1;
+    }
+    curl_histogram_reset(total);
+
+    printf("Running %us test @ %s\n", duration, urls[0]);
+    printf("  %u threads, target %.0f requests/sec\n", num_threads, rate);
+
+    uint64_t start = curl_trace_now();
+    unsigned num_started = 0;
+    for (unsigned i = 0; i < num_threads; i++) {
+        LoadThread* lt = &threads[i];
+        lt->rate = rate / num_threads;
+        lt->duration_ns = (uint64_t) duration * 1000000000ULL;
+        lt->session_config = *session_config;
+        lt->urls = urls;
+        lt->num_urls = num_urls;
+        lt->proxy = proxy;
+        lt->histogram = default_allocator.allocate(sizeof(CurlHistogram), false);
+        if (!lt->histogram) {
+            break;
+        }
+        curl_histogram_reset(lt->histogram);
+        if (pthread_create(&lt->thread, nullptr, load_thread, lt) != 0) {
+            perror("pthread_create");
+            default_allocator.release((void**) &lt->histogram, sizeof(CurlHistogram));
+            break;
+        }
+        num_started++;
+    }
+
+    uint64_t requests = 0, completed = 0, errors = 0, non_2xx = 0, bytes = 0;
+    for (unsigned i = 0; i < num_started; i++) {
+        LoadThread* lt = &threads[i];
+        pthread_join(lt->thread, nullptr);
+        curl_histogram_merge(total, lt->histogram);
+        requests  += lt->requests;
+        completed += lt->completed;
+        errors    += lt->errors;
+        non_2xx   += lt->non_2xx;
+        bytes     += lt->bytes;
+        default_allocator.release((void**) &lt->histogram, sizeof(CurlHistogram));
+    }
+    double elapsed = (curl_trace_now() - start) / 1e9;
+
+    printf("  Thread Stats%10s%10s%10s\n", "Avg", "Stdev", "Max");
+    print_latency("    Latency ", curl_histogram_mean(total));
+    print_latency("  ", curl_histogram_stddev(total));
+    print_latency("  ", (double) total->max);
+    printf("\n");
+
+    printf("  Latency Distribution (HdrHistogram - Recorded Latency)\n");
+    static double percentiles[] = { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 99.999, 100.0 };
+    for (unsigned i = 0; i < UW_LENGTH(percentiles); i++) {
+        printf(" %7.3f%%", percentiles[i]);
+        print_latency("", (double) curl_histogram_percentile(total, percentiles[i]));
+        printf("\n");
+    }
+
+    printf("  %llu requests in %.2fs, ", (unsigned long long) completed, elapsed);
+    print_bytes((double) bytes);
+    printf(" read\n");
+    if (errors) {
+        printf("  Errors: %llu\n", (unsigned long long) errors);
+    }
+    if (non_2xx) {
+        printf("  Non-2xx responses: %llu\n", (unsigned long long) non_2xx);
+    }
+    if (requests > completed + errors) {
+        printf("  Unfinished requests: %llu\n", (unsigned long long) (requests - completed - errors));
+    }
+    printf("Requests/sec: %10.2f\n", completed / elapsed);
+    printf("Transfer/sec: ");
+    print_bytes(bytes / elapsed);
+    printf("\n");
+
+    default_allocator.release((void**) &total, sizeof(CurlHistogram));
+    return 0;
+}
+
+/****************************************************************
+ * Daemon mode
+ *
+ * With listen=<path> fetch keeps one session, with its connection cache,
+ * DNS and TLS session caches, and accepts jobs over UNIX socket.
+ * All jobs are multiplexed onto the same loop.
+ *
+ * Line protocol, client sends:
+ *
+ *     job <id> [digest=sha256|xxh3]
+ *     <url>
+ *     ...
+ *     .
+ *
+ * URLs are started as soon as they are received. Server replies with a record per URL
+ * and a final record per job, in order of completion:
+ *
+ *     done <id> <http status> <bytes> <url> [<digest>]
+ *     fail <id> <http status> <curl error code> <url>
+ *     end <id> <number of URLs> <number of failed>
+ *     error <message>
+ *
+ * Files of a job are written to directory named by its id, which must not exist,
+ * so jobs do not overwrite files of each other.
+ *
+ * Records are queued and sent when the socket is writable, the loop never waits for clients.
+ * Clients that let more than CLIENT_MAX_OUTPUT bytes of records queue up are disconnected.
+ * Records of clients that disconnected are dropped, their jobs are finished anyway.
+ * Completions always run in the loop thread, workers are not used.
+ */
+
+#define MAX_CLIENTS       64
+#define CLIENT_LINE_SIZE  8192
+#define MAX_JOB_ID        64
+#define CLIENT_MAX_OUTPUT  (1024 * 1024)  // clients that do not read records are disconnected
+
+typedef struct {
+    int fd;               // -1 if slot is free
+    unsigned generation;  // incremented when slot is reused, jobs of previous clients don't write to it
+    char line[CLIENT_LINE_SIZE];
+    unsigned line_length;
+    struct DaemonJob* job;  // job being received, nullptr if none
+
+    // records not sent yet, flushed by the loop when the socket is writable
+    char* output;
+    unsigned output_size;
+    unsigned output_capacity;
+
+} DaemonClient;
+
+typedef struct DaemonJob {
+    unsigned client;
+    unsigned generation;
+    unsigned digest_algorithm;
+    unsigned num_failed;
+    CurlJoin* join;
+    char id[MAX_JOB_ID];
+
+} DaemonJob;
+
+DaemonClient clients[MAX_CLIENTS];
+
+static void close_client(DaemonClient* client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->generation++;
+
+    if (client->output) {
+        default_allocator.release((void**) &client->output, client->output_capacity);
+    }
+    client->output_size = 0;
+    client->output_capacity = 0;
 
-void sigint_handler(int sig)
-{
-    puts("\nInterrupted");
-    pending_sigint = 1;
+    if (client->job) {
+        // job being received is finished with URLs received so far
+        DaemonJob* job = client->job;
+        client->job = nullptr;
+        curl_join_seal(job->join);
+    }
 }
 
-void create_request(void* session, UwValuePtr url)
+static bool flush_client(DaemonClient* client)
 /*
- * Helper function to create Curl request of our custom FileRequest type
+ * Send queued records as much as the socket takes.
+ * Return false if the client is closed.
  */
 {
-    UwValue request = uw_create(UwTypeId_FileRequest);
-    if (uw_error(&request)) {
-        uw_print_status(stdout, &request);
-        return;
+    unsigned sent = 0;
+    while (sent < client->output_size) {
+        ssize_t n = send(client->fd, client->output + sent, client->output_size - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            close_client(client);
+            return false;
+        }
+        sent += n;
     }
+    if (sent) {
+        client->output_size -= sent;
+        memmove(client->output, client->output + sent, client->output_size);
+    }
+    return true;
+}
 
-    UW_CSTRING_LOCAL(url_cstr, url);
-    printf("Requesting %s\n", url_cstr);
-
-    curl_request_set_url(&request, url);
-    curl_request_set_proxy(&request, &proxy);
-    if (verbose.bool_value) {
-        curl_request_verbose(&request, true);
+static void send_record(unsigned slot, unsigned generation, char* fmt, ...)
+{
+    DaemonClient* client = &clients[slot];
+    if (client->fd == -1 || client->generation != generation) {
+        return;
     }
-    add_curl_request(session, &request);
+    char record[CLIENT_LINE_SIZE + 256];
+    va_list ap;
+    va_start(ap, fmt);
+    int length = vsnprintf(record, sizeof(record) - 1, fmt, ap);
+    va_end(ap);
+    if (length < 0) {
+        return;
+    }
+    if ((unsigned) length > sizeof(record) - 2) {
+        length = sizeof(record) - 2;
+    }
+    record[length++] = '\n';
 
-    // request is now held by Curl handle
-    // and will be destroyed in curl_perform
+    // records are sent from continuations in the loop thread, never wait for the socket
+    unsigned new_size = client->output_size + length;
+    if (new_size > CLIENT_MAX_OUTPUT) {
+        close_client(client);
+        return;
+    }
+    if (new_size > client->output_capacity) {
+        unsigned new_capacity = client->output_capacity? client->output_capacity : 4096;
+        while (new_capacity < new_size) {
+            new_capacity <<= 1;
+        }
+        if (!default_allocator.reallocate((void**) &client->output, client->output_capacity,
+                                          new_capacity, false, nullptr)) {
+            close_client(client);
+            return;
+        }
+        client->output_capacity = new_capacity;
+    }
+    memcpy(client->output + client->output_size, record, length);
+    client->output_size = new_size;
+    flush_client(client);
 }
 
-size_t write_data(void* data, size_t always_1, size_t size, UwValuePtr self)
-/*
- * Overloaded method of Curl interface.
- */
+static void job_request_done(UwValuePtr request, CURLcode result, void* ctx)
 {
-    if (size == 0) {
-        printf("%s is called with size=%zu\n", __func__, size);
-        return 0;
-    }
+    DaemonJob* job = ctx;
+    CurlRequestData* curl_req = uw_curl_request_data_ptr(request);
 
-    CurlRequestData* curl_req = uw_curl_request_data_ptr(self);
-    FileRequestData* file_req = file_request_data_ptr(self);
+    UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
 
-    // get status from curl request
-    curl_update_status(self);
+    if (result != CURLE_OK || curl_req->rejected) {
+        job->num_failed++;
+        send_record(job->client, job->generation, "fail %s %u %d %s",
+                    job->id, curl_req->status, (int) result, url_cstr);
+        return;
+    }
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(curl_req->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
 
-    if(curl_req->status != 200) {
-        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
-        printf("FAILED: %u %s\n", curl_req->status, url_cstr);
-        return 0;
+    if (job->digest_algorithm) {
+        UwValue hex = curl_digest_hex(curl_req->digest, job->digest_algorithm);
+        if (uw_is_string(&hex)) {
+            UW_CSTRING_LOCAL(hex_cstr, &hex);
+            send_record(job->client, job->generation, "done %s %u %lld %s %s",
+                        job->id, curl_req->status, (long long) bytes, url_cstr, hex_cstr);
+            return;
+        }
     }
-    if (uw_is_null(&file_req->file)) {
+    send_record(job->client, job->generation, "done %s %u %lld %s",
+                job->id, curl_req->status, (long long) bytes, url_cstr);
+}
 
-        // the file is not created yet, do that
+static void job_done(unsigned num_requests, unsigned num_failed, void* ctx)
+{
+    DaemonJob* job = ctx;
+    send_record(job->client, job->generation, "end %s %u %u", job->id, num_requests, job->num_failed);
+    default_allocator.release((void**) &job, sizeof(DaemonJob));
+}
 
-        // get file name from response headers
-        curl_request_parse_headers(curl_req);
-        UwValue filename_info = curl_request_get_filename(curl_req);
-        UwValue full_name = uw_map_get(&filename_info, "filename");
-        UwValue filename = uw_basename(&full_name);
-        if (uw_error(&filename) || uw_strlen(&filename) == 0) {
-            // get file name from URL
-            UwValue parts = uw_string_split_chr(&curl_req->url, '?', 1);
-            UwValue url = uw_array_item(&parts, 0);
-            uw_destroy(&filename);
-            filename = uw_basename(&url);
-            if (uw_error(&filename)) {
-                uw_print_status(stdout, &filename);
-                return 0;
-            }
-            if (uw_strlen(&filename) == 0) {
-                uw_string_append(&filename, "index.html");
-            }
-        }
+static void start_job(unsigned slot, char* args)
+{
+    DaemonClient* client = &clients[slot];
 
-        file_req->file = uw_file_open(&filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
-        if (uw_error(&file_req->file)) {
-            uw_print_status(stdout, &file_req->file);
-            return 0;
+    char* id = strtok(args, " ");
+    if (!id || strlen(id) >= MAX_JOB_ID || id[0] == '.' || strchr(id, '/')) {
+        // the id is used as directory name
+        send_record(slot, client->generation, "error bad job id");
+        return;
+    }
+    if (mkdir(id, 0755) == -1) {
+        send_record(slot, client->generation, "error cannot create directory %s: %s", id, strerror(errno));
+        return;
+    }
+    DaemonJob* job = default_allocator.allocate(sizeof(DaemonJob), true);
+    if (!job) {
+        rmdir(id);
+        send_record(slot, client->generation, "error out of memory");
+        return;
+    }
+    job->join = curl_join_create(job_done, job);
+    if (!job->join) {
+        rmdir(id);
+        default_allocator.release((void**) &job, sizeof(DaemonJob));
+        send_record(slot, client->generation, "error out of memory");
+        return;
+    }
+    job->client = slot;
+    job->generation = client->generation;
+    strcpy(job->id, id);
+
+    for (char* option = strtok(nullptr, " "); option; option = strtok(nullptr, " ")) {
+        if (strcmp(option, "digest=sha256") == 0) {
+            job->digest_algorithm = CURL_DIGEST_SHA256;
+        } else if (strcmp(option, "digest=xxh3") == 0) {
+            job->digest_algorithm = CURL_DIGEST_XXH3;
         }
-        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
-        UW_CSTRING_LOCAL(filename_cstr, &filename);
-        printf("Downloading %s -> %s\n", url_cstr, filename_cstr);
     }
+    client->job = job;
+}
 
-    // write data to file
+static void add_job_url(unsigned slot, char* url)
+{
+    DaemonJob* job = clients[slot].job;
 
-    unsigned bytes_written;
-    UwValue status = uw_file_write(&file_req->file, data, size, &bytes_written);
-    if (uw_error(&status)) {
-        uw_print_status(stdout, &status);
-        return 0;
+    UwValue url_value = uw_create_string(url);
+    if (uw_error(&url_value)) {
+        send_record(slot, job->generation, "fail %s 0 %d %s", job->id, (int) CURLE_OUT_OF_MEMORY, url);
+        return;
     }
-    return bytes_written;
+    UwValue request = curl_request_from_template(&request_template, UwTypeId_FileRequest, &url_value);
+    if (uw_error(&request)) {
+        send_record(slot, job->generation, "fail %s 0 %d %s", job->id, (int) CURLE_OUT_OF_MEMORY, url);
+        return;
+    }
+    file_request_data_ptr(&request)->directory = uw_create_string(job->id);
+    if (job->digest_algorithm) {
+        curl_request_enable_digest(&request, job->digest_algorithm);
+    }
+    // own continuation goes first, so the end record follows all URL records
+    if (uw_error(&file_request_data_ptr(&request)->directory)
+        || !curl_request_then(&request, job_request_done, job)) {
+        send_record(slot, job->generation, "fail %s 0 %d %s", job->id, (int) CURLE_OUT_OF_MEMORY, url);
+        curl_request_drop(&request, CURLE_OUT_OF_MEMORY);
+        return;
+    }
+    if (!curl_join_add(job->join, &request)) {
+        // job_request_done sends fail record
+        curl_request_drop(&request, CURLE_OUT_OF_MEMORY);
+        return;
+    }
+    // if the request cannot be added, job_request_done sends fail record
+    // and the join counts the request as done
+    add_curl_request(&session, &request);
 }
 
-void request_complete(UwValuePtr self)
-/*
- * Overloaded method of Curl interface.
- */
+static void process_line(unsigned slot, char* line)
 {
-    CurlRequestData* curl_req = uw_curl_request_data_ptr(self);
-    FileRequestData* file_req = file_request_data_ptr(self);
+    DaemonClient* client = &clients[slot];
 
-    if(curl_req->status != 200) {
-        UW_CSTRING_LOCAL(url_cstr, &curl_req->url);
-        printf("FAILED: %u %s\n", curl_req->status, url_cstr);
+    if (client->job) {
+        if (strcmp(line, ".") == 0) {
+            curl_join_seal(client->job->join);
+            client->job = nullptr;
+        } else if (line[0]) {
+            add_job_url(slot, line);
+        }
+    } else if (strncmp(line, "job ", 4) == 0) {
+        start_job(slot, line + 4);
+    } else if (line[0]) {
+        send_record(slot, client->generation, "error expected job");
+    }
+}
+
+static void read_client(unsigned slot)
+{
+    DaemonClient* client = &clients[slot];
+
+    ssize_t n = read(client->fd, client->line + client->line_length,
+                     CLIENT_LINE_SIZE - client->line_length);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        close_client(client);
         return;
     }
+    client->line_length += n;
 
-    if (uw_is_null(&file_req->file)) {
-        // nothing was written to file
+    // process complete lines
+    char* start = client->line;
+    char* end = client->line + client->line_length;
+    for (;;) {
+        char* eol = memchr(start, '\n', end - start);
+        if (!eol) {
+            break;
+        }
+        *eol = 0;
+        if (eol > start && eol[-1] == '\r') {
+            eol[-1] = 0;
+        }
+        process_line(slot, start);
+        if (client->fd == -1) {
+            // closed while sending a record
+            return;
+        }
+        start = eol + 1;
+    }
+    client->line_length = end - start;
+    if (client->line_length == CLIENT_LINE_SIZE) {
+        send_record(slot, client->generation, "error line too long");
+        close_client(client);
         return;
     }
+    memmove(client->line, start, client->line_length);
+}
 
-    uw_file_close(&file_req->file);
+static void accept_client(int listen_fd)
+{
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd == -1) {
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd == -1) {
+            clients[i].fd = fd;
+            clients[i].line_length = 0;
+            clients[i].job = nullptr;
+            return;
+        }
+    }
+    char msg[] = "error too many clients\n";
+    send(fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL);
+    close(fd);
 }
 
-void fini_file_request(UwValuePtr self)
+bool run_daemon(UwValuePtr socket_path)
 /*
- * Overloaded method of Struct interface.
+ * Serve jobs until interrupted.
  */
 {
-    FileRequestData* req = file_request_data_ptr(self);
+    UW_CSTRING_LOCAL(path_cstr, socket_path);
 
-    uw_destroy(&req->file);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path_cstr) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path_cstr);
+        return false;
+    }
+    strcpy(addr.sun_path, path_cstr);
 
-    // call super method
-    uw_ancestor_of(UwTypeId_FileRequest)->fini(self);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return false;
+    }
+    unlink(path_cstr);
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(listen_fd, 64) == -1) {
+        perror(path_cstr);
+        close(listen_fd);
+        return false;
+    }
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    printf("Listening on %s\n", path_cstr);
+
+    struct curl_waitfd fds[MAX_CLIENTS + 1];
+    unsigned slots[MAX_CLIENTS + 1];
+    bool result = true;
+
+    while (!pending_sigint) {
+        fds[0] = (struct curl_waitfd) { .fd = listen_fd, .events = CURL_WAIT_POLLIN };
+        unsigned num_fds = 1;
+        for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd != -1) {
+                short events = CURL_WAIT_POLLIN;
+                if (clients[i].output_size) {
+                    events |= CURL_WAIT_POLLOUT;
+                }
+                slots[num_fds] = i;
+                fds[num_fds++] = (struct curl_waitfd) { .fd = clients[i].fd, .events = events };
+            }
+        }
+        int running_transfers;
+        if (!curl_perform_fds(&session, &running_transfers, 1000, fds, num_fds)) {
+            result = false;
+            break;
+        }
+        for (unsigned i = 1; i < num_fds; i++) {
+            DaemonClient* client = &clients[slots[i]];
+            if (client->fd != fds[i].fd) {
+                // closed while sending a record
+                continue;
+            }
+            if ((fds[i].revents & CURL_WAIT_POLLOUT) && !flush_client(client)) {
+                continue;
+            }
+            if (fds[i].revents & ~CURL_WAIT_POLLOUT) {
+                read_client(slots[i]);
+            }
+        }
+        if (fds[0].revents) {
+            accept_client(listen_fd);
+        }
+    }
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1 && flush_client(&clients[i])) {
+            // records that do not fit in the socket buffer are lost
+            close_client(&clients[i]);
+        }
+    }
+    close(listen_fd);
+    unlink(path_cstr);
+    return result;
 }
 
 int main(int argc, char* argv[])
@@ -164,6 +1553,13 @@ int main(int argc, char* argv[])
     init_allocator(&pet_allocator);
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
+    // allocation accounting must be enabled before creating any values
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "alloc=1") == 0) {
+            curl_alloc_accounting_enable();
+        }
+    }
+
     // create FileRequest subtype
 
     // static structure that holds the type
@@ -172,7 +1568,8 @@ int main(int argc, char* argv[])
     // custom Curl interface
     static UwInterface_Curl file_curl_interface = {
         .write_data = write_data,
-        .complete   = request_complete
+        .complete   = request_complete,
+        .headers_complete = headers_complete
     };
 
     // create subtype, this initializes file_request_type and returns type id
@@ -192,13 +1589,22 @@ int main(int argc, char* argv[])
 
     signal(SIGINT, sigint_handler);
 
-    // create session
-
-    void* session = create_curl_session();
-
     // parse command line arguments
+    CurlSessionConfig session_config = {};
     UwValue urls = UwArray();
     UwValue parallel = UwUnsigned(1);
+    UwValue workers = UwUnsigned(0);
+    double load_rate = 0;
+    unsigned load_duration = 10;
+    unsigned load_threads = 1;
+    bool elephant_slots_set = false;
+    CurlHedgeConfig hedge_config = {};
+    char* proxy_list = nullptr;
+    char* load_proxy = nullptr;
+    CurlProxyPolicy proxy_policy = CURL_PROXY_LEAST_LOADED;
+    UwValue store_root = UwNull();
+    CurlStoreLinkMode store_link_mode = CURL_STORE_HARDLINK;
+    CurlDecodeMode decode_mode = CURL_DECODE_INLINE;
     for (int i = 1; i < argc; i++) {{  // mind double curly brackets for nested scope
         // nested scope makes autocleaning working after each iteration
 
@@ -213,6 +1619,142 @@ int main(int argc, char* argv[])
 
         } else if (uw_startswith(&arg, "proxy=")) {
             proxy = uw_substr(&arg, strlen("proxy="), uw_strlen(&arg));
+            load_proxy = argv[i] + strlen("proxy=");  // load threads do not share UW values
+
+        } else if (uw_startswith(&arg, "warc=")) {
+            UwValue prefix = uw_substr(&arg, strlen("warc="), uw_strlen(&arg));
+            warc_writer = curl_warc_writer(&prefix, CURL_WARC_GZIP, 0);
+            if (uw_error(&warc_writer)) {
+                uw_print_status(stdout, &warc_writer);
+                goto out;
+            }
+
+        } else if (uw_startswith(&arg, "store=")) {
+            store_root = uw_substr(&arg, strlen("store="), uw_strlen(&arg));
+
+        } else if (uw_startswith(&arg, "store_link=")) {
+            UwValue v = uw_substr(&arg, strlen("store_link="), uw_strlen(&arg));
+            if (uw_equal(&v, "reflink")) {
+                store_link_mode = CURL_STORE_REFLINK;
+            }
+
+        } else if (uw_startswith(&arg, "decode=")) {
+            // files are written by write_data, so they are either decoded by CURL or kept encoded
+            UwValue v = uw_substr(&arg, strlen("decode="), uw_strlen(&arg));
+            if (uw_equal(&v, "none")) {
+                decode_mode = CURL_DECODE_NONE;
+            }
+
+        } else if (uw_startswith(&arg, "digest=")) {
+            UwValue v = uw_substr(&arg, strlen("digest="), uw_strlen(&arg));
+            if (uw_equal(&v, "sha256")) {
+                digest_algorithm = CURL_DIGEST_SHA256;
+            } else if (uw_equal(&v, "xxh3")) {
+                digest_algorithm = CURL_DIGEST_XXH3;
+            }
+
+        } else if (uw_startswith(&arg, "http2=")) {
+            UwValue v = uw_substr(&arg, strlen("http2="), uw_strlen(&arg));
+            session_config.http2 = uw_equal(&v, "1");
+
+        } else if (uw_startswith(&arg, "max_host_connections=")) {
+            UwValue s = uw_substr(&arg, strlen("max_host_connections="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n)) {
+                session_config.max_host_connections = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "trace=")) {
+            trace_file = uw_substr(&arg, strlen("trace="), uw_strlen(&arg));
+            curl_trace_enable(true);
+
+        } else if (uw_startswith(&arg, "preconnect=")) {
+            UwValue s = uw_substr(&arg, strlen("preconnect="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                preconnect = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "workers=")) {
+            UwValue s = uw_substr(&arg, strlen("workers="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n)) {
+                workers = n;
+            }
+
+        } else if (uw_startswith(&arg, "rate=")) {
+            UwValue s = uw_substr(&arg, strlen("rate="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                load_rate = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "duration=")) {
+            UwValue s = uw_substr(&arg, strlen("duration="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                load_duration = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "threads=")) {
+            UwValue s = uw_substr(&arg, strlen("threads="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                load_threads = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "schedule=")) {
+            UwValue v = uw_substr(&arg, strlen("schedule="), uw_strlen(&arg));
+            scheduler.enabled = uw_equal(&v, "size");
+
+        } else if (uw_startswith(&arg, "probe=")) {
+            UwValue v = uw_substr(&arg, strlen("probe="), uw_strlen(&arg));
+            scheduler.probe = uw_equal(&v, "1");
+
+        } else if (uw_startswith(&arg, "elephant_size=")) {
+            UwValue s = uw_substr(&arg, strlen("elephant_size="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                scheduler.elephant_size = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "elephant_slots=")) {
+            UwValue s = uw_substr(&arg, strlen("elephant_slots="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                scheduler.elephant_slots = n.signed_value;
+                elephant_slots_set = true;
+            }
+
+        } else if (uw_startswith(&arg, "listen=")) {
+            listen_path = uw_substr(&arg, strlen("listen="), uw_strlen(&arg));
+
+        } else if (uw_startswith(&arg, "proxies=")) {
+            // comma separated list, split when session is created
+            proxy_list = argv[i] + strlen("proxies=");
+
+        } else if (uw_startswith(&arg, "proxy_policy=")) {
+            UwValue v = uw_substr(&arg, strlen("proxy_policy="), uw_strlen(&arg));
+            if (uw_equal(&v, "fastest")) {
+                proxy_policy = CURL_PROXY_FASTEST;
+            }
+
+        } else if (uw_startswith(&arg, "hedge=")) {
+            UwValue s = uw_substr(&arg, strlen("hedge="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0 && n.signed_value < 100) {
+                hedge_config.ttfb_percentile = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "hedge_speed=")) {
+            UwValue s = uw_substr(&arg, strlen("hedge_speed="), uw_strlen(&arg));
+            UwValue n = uw_string_to_int(&s);
+            if (uw_is_int(&n) && n.signed_value > 0) {
+                hedge_config.min_speed = n.signed_value;
+            }
+
+        } else if (uw_startswith(&arg, "hedge_proxy=")) {
+            hedge_proxy = uw_substr(&arg, strlen("hedge_proxy="), uw_strlen(&arg));
 
         } else if (uw_startswith(&arg, "parallel=")) {
             UwValue s = uw_substr(&arg, strlen("parallel="), uw_strlen(&arg));
@@ -222,31 +1764,135 @@ int main(int argc, char* argv[])
             }
         }
     }}
-    if (uw_array_length(&urls) == 0) {
-        printf("Usage: fetch [verbose=1|0] [proxy=<proxy>] [parallel=<n>] url1 url2 ...\n");
+    if (uw_array_length(&urls) == 0 && !uw_is_string(&listen_path)) {
+        printf("Usage: fetch [verbose=1|0] [proxy=<proxy>] [parallel=<n>] [http2=1|0] [max_host_connections=<n>] [digest=sha256|xxh3] [workers=<n>] [trace=<file.json>] [alloc=1] [preconnect=<n>] [warc=<prefix>] [schedule=size [probe=1|0] [elephant_size=<bytes>] [elephant_slots=<n>]] [hedge=<percentile>] [hedge_speed=<bytes/sec>] [hedge_proxy=<proxy>] [proxies=<proxy1,proxy2,...>] [proxy_policy=least_loaded|fastest] [store=<dir> [store_link=hardlink|reflink]] [decode=inline|none] url1 url2 ...\n");
+        printf("       fetch listen=<socket path> [verbose=1|0] [proxy=<proxy>] [proxies=<proxy1,proxy2,...>] [http2=1|0] [max_host_connections=<n>]\n");
+        printf("       fetch rate=<requests/sec> [duration=<seconds>] [threads=<n>] [http2=1|0] [max_host_connections=<n>] [proxy=<proxy>] url1 url2 ...\n");
+        goto out;
+    }
+
+    if (load_rate > 0) {
+        // load generator mode, URLs are passed to threads as C strings
+        char* load_urls[argc];
+        unsigned num_load_urls = 0;
+        for (int i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "http://", 7) == 0 || strncmp(argv[i], "https://", 8) == 0) {
+                load_urls[num_load_urls++] = argv[i];
+            }
+        }
+        run_load(load_urls, num_load_urls, load_proxy, &session_config, load_rate, load_duration, load_threads);
+        goto out;
+    }
+
+    if (uw_is_string(&store_root)) {
+        // key the store by digest=<algorithm> if given, so content is hashed once
+        store = curl_store(&store_root, digest_algorithm? digest_algorithm : CURL_DIGEST_SHA256, store_link_mode);
+        if (uw_error(&store)) {
+            uw_print_status(stdout, &store);
+            goto out;
+        }
+    }
+
+    // create request template
+
+    request_template = curl_request_template();
+    if (uw_error(&request_template)) {
+        uw_print_status(stdout, &request_template);
+        goto out;
+    }
+    curl_template_set_proxy(&request_template, &proxy);
+    curl_template_set_decode_mode(&request_template, decode_mode);
+    if (verbose.bool_value) {
+        curl_template_verbose(&request_template, true);
+    }
+
+    // create session
+
+    session = create_curl_session(&session_config);
+    if (uw_error(&session)) {
+        uw_print_status(stdout, &session);
+        goto out;
+    }
+    if (proxy_list) {
+        // requests made from template without proxy get it from the pool
+        char list[strlen(proxy_list) + 1];
+        strcpy(list, proxy_list);
+        char* proxies[strlen(proxy_list) / 2 + 1];
+        unsigned num_proxies = 0;
+        for (char* p = strtok(list, ","); p; p = strtok(nullptr, ",")) {
+            proxies[num_proxies++] = p;
+        }
+        if (!curl_session_set_proxy_pool(&session, proxies, num_proxies, proxy_policy, 0, 0)) {
+            goto out;
+        }
+    }
+    if (hedge_config.ttfb_percentile > 0 || hedge_config.min_speed > 0) {
+        if (!curl_session_enable_hedging(&session, &hedge_config, make_hedge, nullptr)) {
+            goto out;
+        }
+    }
+    if (uw_is_string(&listen_path)) {
+        // completions write to client sockets, so they run in the loop thread
+        run_daemon(&listen_path);
+        if (verbose.bool_value) {
+            curl_session_print_stats(&session, stdout);
+        }
         goto out;
     }
+    if (workers.signed_value > 0) {
+        // complete requests in worker threads, pet_allocator is not known to be thread-safe
+        curl_alloc_serialize();
+        if (!curl_session_start_workers(&session, workers.signed_value, 256)) {
+            goto out;
+        }
+    }
 
     // fetch URLs
-    // prepare first request
-    {
+
+    scheduler.start_ns = curl_trace_now();
+    if (scheduler.enabled) {
+        if (!elephant_slots_set) {
+            // leave most slots to small transfers
+            scheduler.elephant_slots = (parallel.signed_value > 4)? parallel.signed_value / 4 : 1;
+        }
+        if (!scheduler_init(&urls)) {
+            goto out;
+        }
+        schedule_requests(&session, 0, parallel.signed_value);
+    } else {
+        // prepare first request
         UwValue url = uw_array_pop(&urls);
         if (uw_error(&url)) {
             uw_print_status(stdout, &url);
             goto out;
         }
-        create_request(session, &url);
+        create_request(&session, &url, -1, false);
+        look_ahead(&session, &urls);
     }
 
     // perform fetching
 
-    while(!pending_sigint) {
+    for (;;) {
         int running_transfers;
-        if (!curl_perform(session, &running_transfers)) {
+        if (!curl_perform(&session, &running_transfers)) {
             // failure
             break;
         }
+        if (curl_session_cancel_mode(&session) != CURL_CANCEL_NONE) {
+            // interrupted, do not start new requests
+            if (running_transfers == 0) {
+                break;
+            }
+            continue;
+        }
         unsigned i = running_transfers;
+        if (scheduler.enabled) {
+            if (schedule_requests(&session, running_transfers, parallel.signed_value) == 0) {
+                // nothing is running and nothing left to start
+                break;
+            }
+            continue;
+        }
         // add more requests
         for(; i < parallel.signed_value; i++) {{
             if (uw_array_length(&urls) == 0) {
@@ -257,7 +1903,8 @@ int main(int argc, char* argv[])
                 uw_print_status(stdout, &url);
                 break;
             }
-            create_request(session, &url);
+            create_request(&session, &url, -1, false);
+            look_ahead(&session, &urls);
         }}
         if (i == 0) {
             // no running transfers and no more URLs were added
@@ -265,13 +1912,49 @@ int main(int argc, char* argv[])
         }
     }
 
+    // wait for queued completions
+    curl_session_stop_workers(&session);
+
+    if (verbose.bool_value) {
+        curl_session_print_stats(&session, stdout);
+    }
+    if (verbose.bool_value || scheduler.enabled) {
+        scheduler_print_stats(stdout);
+    }
+    if (!uw_is_null(&store)) {
+        CurlStoreStats stats;
+        curl_store_stats(&store, &stats);
+        printf("Store: %llu objects stored (%llu bytes), %llu reused (%llu bytes), %llu names linked, %llu URLs found in index\n",
+               (unsigned long long) stats.objects_stored, (unsigned long long) stats.bytes_stored,
+               (unsigned long long) stats.objects_reused, (unsigned long long) stats.bytes_reused,
+               (unsigned long long) stats.names_linked, (unsigned long long) stats.index_hits);
+    }
+    if (uw_is_string(&trace_file)) {
+        UW_CSTRING_LOCAL(trace_file_cstr, &trace_file);
+        FILE* fp = fopen(trace_file_cstr, "w");
+        if (fp) {
+            curl_trace_dump(fp);
+            fclose(fp);
+        } else {
+            perror(trace_file_cstr);
+        }
+    }
+
 out:
 
-    delete_curl_session(session);
+    uw_destroy(&session);
+    uw_destroy(&request_template);
+    uw_destroy(&warc_writer);  // closes segment files
+    uw_destroy(&store);
 
     // global finalization
 
     uw_destroy(&proxy);  // can be allocated string
+    uw_destroy(&hedge_proxy);
+    uw_destroy(&trace_file);
+    uw_destroy(&listen_path);
+    uw_destroy(&last_origin);
+    scheduler_fini();
 
     curl_global_cleanup();
 
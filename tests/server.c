@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uw.h>
+
+#include "server.h"
+
+/*
+ * Same structure as the server of bench workload: a thread per connection,
+ * requests have no body, every complete header block gets a response.
+ */
+
+static TestRoute* server_routes;
+static unsigned server_num_routes;
+
+static TestRoute not_found = { .status = 404, .body = "not found" };
+
+static TestRoute* find_route(char* request)
+{
+    // request line is "METHOD /path HTTP/1.1"
+    char* path = strchr(request, ' ');
+    if (!path) {
+        return &not_found;
+    }
+    path++;
+    size_t length = strcspn(path, " ?\r\n");
+    for (unsigned i = 0; i < server_num_routes; i++) {
+        TestRoute* route = &server_routes[i];
+        if (strlen(route->path) == length && strncmp(route->path, path, length) == 0) {
+            return route;
+        }
+    }
+    return &not_found;
+}
+
+static bool send_all(int fd, char* data, size_t size)
+{
+    while (size) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void* serve_connection(void* arg)
+{
+    int fd = (int) (intptr_t) arg;
+    char buf[8192];
+    size_t length = 0;
+
+    for (;;) {
+        ssize_t n = recv(fd, buf + length, sizeof(buf) - length - 1, 0);
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+        buf[length] = 0;
+
+        char* end;
+        while ((end = strstr(buf, "\r\n\r\n"))) {
+            TestRoute* route = find_route(buf);
+            if (route->delay_ms) {
+                usleep(route->delay_ms * 1000);
+            }
+            size_t body_size = strlen(route->body);
+            char headers[1024];
+            int headers_size = snprintf(headers, sizeof(headers),
+                "HTTP/1.1 %u X\r\n"
+                "Content-Type: %s\r\n"
+                "Content-Length: %zu\r\n"
+                "%s"
+                "\r\n", route->status,
+                route->content_type? route->content_type : "text/html; charset=utf-8",
+                body_size, route->headers? route->headers : "");
+            if (!send_all(fd, headers, headers_size)) {
+                goto out;
+            }
+            size_t chunk_size = route->chunk_size? route->chunk_size : body_size;
+            for (size_t sent = 0; sent < body_size; sent += chunk_size) {
+                if (sent) {
+                    usleep(1000);
+                }
+                size_t n = (body_size - sent < chunk_size)? body_size - sent : chunk_size;
+                if (!send_all(fd, route->body + sent, n)) {
+                    goto out;
+                }
+            }
+            size_t consumed = end + 4 - buf;
+            memmove(buf, buf + consumed, length - consumed + 1);
+            length -= consumed;
+        }
+        if (length == sizeof(buf) - 1) {
+            break;
+        }
+    }
+out:
+    close(fd);
+    return nullptr;
+}
+
+static void* serve(void* arg)
+{
+    int listen_fd = (int) (intptr_t) arg;
+    for (;;) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // chunked bodies go in separate segments
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, serve_connection, (void*) (intptr_t) fd) == 0) {
+            pthread_detach(thread);
+        } else {
+            close(fd);
+        }
+    }
+    return nullptr;
+}
+
+int test_server_start(TestRoute* routes, unsigned num_routes)
+{
+    server_routes = routes;
+    server_num_routes = num_routes;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return 0;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0
+    };
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+        || listen(fd, 128) == -1
+        || getsockname(fd, (struct sockaddr*) &addr, &addr_len) == -1) {
+        perror("bind");
+        close(fd);
+        return 0;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, serve, (void*) (intptr_t) fd) != 0) {
+        perror("pthread_create");
+        close(fd);
+        return 0;
+    }
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * Local HTTP/1.1 server for tests, running in background threads.
+ */
+
+typedef struct {
+    char* path;         // request path, e.g. "/redirect"
+    unsigned status;
+    char* headers;      // extra header lines, each terminated with CRLF, can be nullptr
+    char* body;
+    unsigned delay_ms;  // wait before sending the response
+    char* content_type; // nullptr for "text/html; charset=utf-8"
+    unsigned chunk_size;  // if nonzero, the body is sent in pieces of this size, 1 ms apart
+} TestRoute;
+
+int test_server_start(TestRoute* routes, unsigned num_routes);
+/*
+ * Return port number, or 0 on error.
+ * Routes must be valid while the process runs. Unknown paths get 404.
+ */
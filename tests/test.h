@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Minimal test helpers.
+ *
+ * Each test file is a program that runs its checks and returns nonzero
+ * exit code if any failed, `make test` builds and runs all of them.
+ */
+
+static unsigned num_failed_checks = 0;
+
+#define CHECK(condition)  \
+    do {  \
+        if (!(condition)) {  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);  \
+            num_failed_checks++;  \
+        }  \
+    } while (0)
+
+#define TEST_RESULT()  \
+    (num_failed_checks? (fprintf(stderr, "%u checks failed\n", num_failed_checks), 1) : 0)
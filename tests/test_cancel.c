@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "uw_curl.h"
+#include "test.h"
+#include "server.h"
+
+/*
+ * Cancellation: continuations are called once for every cancelled request,
+ * whether it was running, added or submitted.
+ */
+
+static TestRoute routes[] = {
+    { .path = "/slow", .status = 200, .body = "slow", .delay_ms = 3000 }
+};
+
+typedef struct {
+    unsigned calls;
+    CURLcode result;
+    bool cancelled;
+} Outcome;
+
+static void request_done(UwValuePtr request, CURLcode result, void* ctx)
+{
+    Outcome* outcome = ctx;
+    outcome->calls++;
+    outcome->result = result;
+    outcome->cancelled = uw_curl_request_data_ptr(request)->cancelled;
+}
+
+static UwResult make_request(int port, Outcome* outcome)
+{
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/slow", port);
+
+    memset(outcome, 0, sizeof(Outcome));
+
+    UwValue url_value = uw_create_string(url);
+    if (uw_error(&url_value)) {
+        return uw_move(&url_value);
+    }
+    UwValue request = uw_create(UwTypeId_CurlRequest);
+    if (uw_error(&request)) {
+        return uw_move(&request);
+    }
+    curl_request_set_url(&request, &url_value);
+    curl_easy_setopt(uw_curl_request_data_ptr(&request)->easy_handle, CURLOPT_PROXY, "");
+    if (!curl_request_then(&request, request_done, outcome)) {
+        return UwOOM();
+    }
+    return uw_move(&request);
+}
+
+static bool run(UwValuePtr session)
+{
+    for (;;) {
+        int running;
+        if (!curl_perform(session, &running)) {
+            return false;
+        }
+        if (running == 0) {
+            return true;
+        }
+    }
+}
+
+static void test_cancel_running(int port)
+{
+    Outcome outcome;
+    UwValue session = create_curl_session(nullptr);
+    UwValue request = make_request(port, &outcome);
+    CHECK(!uw_error(&session) && !uw_error(&request));
+    CHECK(add_curl_request(&session, &request));
+
+    // let the transfer start, the server holds the response
+    int running;
+    CHECK(curl_perform(&session, &running));
+    CHECK(running == 1);
+
+    uint64_t start = curl_trace_now();
+    curl_request_cancel(&request);
+    CHECK(run(&session));
+    CHECK(curl_trace_now() - start < routes[0].delay_ms * 1000000ULL);
+    CHECK(outcome.calls == 1);
+    CHECK(outcome.result == CURLE_ABORTED_BY_CALLBACK);
+    CHECK(outcome.cancelled);
+}
+
+static void test_cancel_before_add(int port)
+{
+    Outcome outcome;
+    UwValue session = create_curl_session(nullptr);
+    UwValue request = make_request(port, &outcome);
+    CHECK(!uw_error(&session) && !uw_error(&request));
+
+    curl_request_cancel(&request);
+    CHECK(!add_curl_request(&session, &request));
+    CHECK(outcome.calls == 1);
+    CHECK(outcome.result == CURLE_ABORTED_BY_CALLBACK);
+    CHECK(outcome.cancelled);
+}
+
+static void test_add_to_cancelled_session(int port)
+{
+    Outcome outcome;
+    UwValue session = create_curl_session(nullptr);
+    UwValue request = make_request(port, &outcome);
+    CHECK(!uw_error(&session) && !uw_error(&request));
+
+    curl_session_cancel(&session, CURL_CANCEL_DRAIN);
+    CHECK(!add_curl_request(&session, &request));
+    CHECK(outcome.calls == 1);
+    CHECK(outcome.cancelled);
+
+    // dropped request is not finished again
+    CHECK(run(&session));
+    CHECK(outcome.calls == 1);
+}
+
+static void test_submit_to_cancelled_session(int port)
+{
+    Outcome outcome;
+    UwValue session = create_curl_session(nullptr);
+    UwValue request = make_request(port, &outcome);
+    CHECK(!uw_error(&session) && !uw_error(&request));
+
+    curl_session_cancel(&session, CURL_CANCEL_DRAIN);
+    CHECK(curl_submit(&session, &request));
+    CHECK(outcome.calls == 0);
+    CHECK(run(&session));
+    CHECK(outcome.calls == 1);
+    CHECK(outcome.cancelled);
+}
+
+int main(int argc, char* argv[])
+{
+    init_allocator(&pet_allocator);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    int port = test_server_start(routes, UW_LENGTH(routes));
+    if (!port) {
+        return 1;
+    }
+    test_cancel_running(port);
+    test_cancel_before_add(port);
+    test_add_to_cancelled_session(port);
+    test_submit_to_cancelled_session(port);
+
+    curl_global_cleanup();
+    return TEST_RESULT();
+}
@@ -0,0 +1,135 @@
+#include <string.h>
+
+#include "uw_curl.h"
+#include "test.h"
+
+/*
+ * Charset decoding: incremental decoding matches one-shot decoding
+ * wherever chunk boundaries split multibyte sequences.
+ */
+
+// 1, 2, 3 and 4 byte sequences, longer than SIMD block
+static char sample[] = "ascii \xC3\xA9t\xC3\xA9 \xD0\x96\xD0\xB8\xD0\xB2\xD0\xB8 "
+                       "\xE2\x82\xAC\xE6\x97\xA5\xE6\x9C\xAC \xF0\x9F\x98\x80\xF0\x90\x8D\x88 end";
+
+static UwResult decode_chunked(char* data, size_t size, size_t* splits, unsigned num_splits)
+{
+    CurlDecoder decoder;
+    if (!curl_decoder_init(&decoder, CURL_CHARSET_UTF8, 0)) {
+        return UwOOM();
+    }
+    size_t pos = 0;
+    for (unsigned i = 0; i <= num_splits; i++) {
+        size_t end = (i < num_splits)? splits[i] : size;
+        if (!curl_decoder_update(&decoder, (uint8_t*) data + pos, end - pos)) {
+            curl_decoder_fini(&decoder);
+            return UwOOM();
+        }
+        pos = end;
+    }
+    UwValue text = curl_decoder_finish(&decoder);
+    curl_decoder_fini(&decoder);
+    return uw_move(&text);
+}
+
+static void test_one_shot()
+{
+    UwValue text = curl_decode((uint8_t*) sample, strlen(sample), CURL_CHARSET_UTF8);
+    CHECK(uw_equal(&text, sample));
+    CHECK(uw_strlen(&text) == 25);
+
+    UwValue ascii = curl_decode((uint8_t*) "plain ascii text longer than a block", 36, CURL_CHARSET_UTF8);
+    CHECK(uw_equal(&ascii, "plain ascii text longer than a block"));
+}
+
+static void test_split_once()
+{
+    size_t size = strlen(sample);
+    unsigned num_failed = 0;
+    for (size_t split = 0; split <= size; split++) {{
+        UwValue text = decode_chunked(sample, size, &split, 1);
+        if (!uw_equal(&text, sample)) {
+            num_failed++;
+        }
+    }}
+    CHECK(num_failed == 0);
+}
+
+static void test_split_twice()
+{
+    // both boundaries inside the same 4-byte sequence
+    size_t size = strlen(sample);
+    unsigned num_failed = 0;
+    for (size_t first = 0; first <= size; first++) {
+        for (size_t second = first; second <= size && second <= first + 4; second++) {{
+            size_t splits[2] = { first, second };
+            UwValue text = decode_chunked(sample, size, splits, 2);
+            if (!uw_equal(&text, sample)) {
+                num_failed++;
+            }
+        }}
+    }
+    CHECK(num_failed == 0);
+}
+
+static void test_byte_by_byte()
+{
+    size_t size = strlen(sample);
+    size_t splits[sizeof(sample)];
+    for (size_t i = 0; i < size; i++) {
+        splits[i] = i + 1;
+    }
+    UwValue text = decode_chunked(sample, size, splits, size - 1);
+    CHECK(uw_equal(&text, sample));
+}
+
+static void test_malformed()
+{
+    // malformed bytes are replaced, one-shot and chunked alike
+    char input[] = "a\xFF" "b\xC3" "c\xE2\x82" "d\xED\xA0\x80" "e";
+    char expected[] = "a\xEF\xBF\xBD" "b\xEF\xBF\xBD" "c\xEF\xBF\xBD" "d\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD" "e";
+    size_t size = strlen(input);
+
+    UwValue text = curl_decode((uint8_t*) input, size, CURL_CHARSET_UTF8);
+    CHECK(uw_equal(&text, expected));
+
+    unsigned num_failed = 0;
+    for (size_t split = 0; split <= size; split++) {{
+        UwValue chunked = decode_chunked(input, size, &split, 1);
+        if (!uw_equal(&chunked, expected)) {
+            num_failed++;
+        }
+    }}
+    CHECK(num_failed == 0);
+}
+
+static void test_truncated()
+{
+    // incomplete sequence at the end of content
+    size_t split = 2;
+    UwValue text = decode_chunked("x\xF0\x9F\x98", 4, &split, 1);
+    CHECK(uw_equal(&text, "x\xEF\xBF\xBD"));
+}
+
+static void test_single_byte_charsets()
+{
+    UwValue latin1 = curl_decode((uint8_t*) "caf\xE9", 4, CURL_CHARSET_LATIN1);
+    CHECK(uw_equal(&latin1, "caf\xC3\xA9"));
+
+    UwValue cp1252 = curl_decode((uint8_t*) "\x80 \x93q\x94", 5, CURL_CHARSET_CP1252);
+    CHECK(uw_equal(&cp1252, "\xE2\x82\xAC \xE2\x80\x9Cq\xE2\x80\x9D"));
+}
+
+int main(int argc, char* argv[])
+{
+    init_allocator(&pet_allocator);
+
+    test_one_shot();
+    test_split_once();
+    test_split_twice();
+    test_byte_by_byte();
+    test_malformed();
+    test_truncated();
+    test_single_byte_charsets();
+    return TEST_RESULT();
+}
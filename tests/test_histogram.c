@@ -0,0 +1,101 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "uw_curl.h"
+#include "test.h"
+
+/*
+ * Histogram buckets and percentiles.
+ */
+
+static CurlHistogram histogram;
+static CurlHistogram other;
+
+static void test_empty()
+{
+    curl_histogram_reset(&histogram);
+    CHECK(curl_histogram_percentile(&histogram, 50.0) == 0);
+    CHECK(curl_histogram_mean(&histogram) == 0.0);
+    CHECK(curl_histogram_stddev(&histogram) == 0.0);
+}
+
+static void test_exact()
+{
+    // values below 2^SUB_BITS have own buckets
+    curl_histogram_reset(&histogram);
+    for (uint64_t i = 0; i < (1 << CURL_HISTOGRAM_SUB_BITS); i++) {
+        curl_histogram_record(&histogram, i);
+    }
+    CHECK(histogram.count == 128);
+    CHECK(histogram.min == 0);
+    CHECK(histogram.max == 127);
+    CHECK(curl_histogram_percentile(&histogram, 0.0) == 0);
+    CHECK(curl_histogram_percentile(&histogram, 50.0) == 63);
+    CHECK(curl_histogram_percentile(&histogram, 99.0) == 126);
+    CHECK(curl_histogram_percentile(&histogram, 100.0) == 127);
+}
+
+static void test_precision()
+{
+    // the value is reported as the highest one of its bucket, within relative bucket width
+    unsigned half_count = 1 << (CURL_HISTOGRAM_SUB_BITS - 1);
+    unsigned num_failed = 0;
+    for (unsigned shift = 0; shift < 64; shift++) {
+        for (uint64_t delta = 0; delta < 3; delta++) {
+            uint64_t value = (1ULL << shift) + delta * ((1ULL << shift) / 3);
+            curl_histogram_reset(&histogram);
+            curl_histogram_record(&histogram, value);
+            curl_histogram_record(&histogram, UINT64_MAX);
+            uint64_t reported = curl_histogram_percentile(&histogram, 50.0);
+            if (reported < value || reported - value > value / half_count) {
+                num_failed++;
+            }
+        }
+    }
+    CHECK(num_failed == 0);
+
+    // the last bucket
+    CHECK(curl_histogram_percentile(&histogram, 100.0) == UINT64_MAX);
+    CHECK(histogram.counts[CURL_HISTOGRAM_SIZE - 1] == 1);
+}
+
+static void test_percentile_clamped()
+{
+    // highest equivalent value of the bucket does not exceed max
+    curl_histogram_reset(&histogram);
+    curl_histogram_record(&histogram, 1000);
+    CHECK(curl_histogram_percentile(&histogram, 50.0) == 1000);
+    CHECK(curl_histogram_percentile(&histogram, 99.9) == 1000);
+}
+
+static void test_merge_and_moments()
+{
+    curl_histogram_reset(&histogram);
+    curl_histogram_reset(&other);
+    uint64_t values[] = { 2, 4, 4, 4, 5, 5, 7, 9 };
+    for (unsigned i = 0; i < 4; i++) {
+        curl_histogram_record(&histogram, values[i]);
+    }
+    for (unsigned i = 4; i < 8; i++) {
+        curl_histogram_record(&other, values[i]);
+    }
+    curl_histogram_merge(&histogram, &other);
+    CHECK(histogram.count == 8);
+    CHECK(histogram.min == 2);
+    CHECK(histogram.max == 9);
+    CHECK(histogram.counts[4] == 3);
+    CHECK(curl_histogram_percentile(&histogram, 50.0) == 4);
+    CHECK(curl_histogram_percentile(&histogram, 75.0) == 5);
+    CHECK(fabs(curl_histogram_mean(&histogram) - 5.0) < 1e-9);
+    CHECK(fabs(curl_histogram_stddev(&histogram) - 2.0) < 1e-9);
+}
+
+int main(int argc, char* argv[])
+{
+    test_empty();
+    test_exact();
+    test_precision();
+    test_percentile_clamped();
+    test_merge_and_moments();
+    return TEST_RESULT();
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "uw_curl.h"
+#include "test.h"
+#include "server.h"
+
+/*
+ * Link extraction stage.
+ */
+
+#define PAGE  \
+    "<html><body>\n"  \
+    "<a href=\"a.html\">quoted</a>\n"  \
+    "<A HREF='/b'>uppercase, single quotes</A>\n"  \
+    "<img src=c.png alt=x>\n"  \
+    "<a\nhref=\"http://example.com/d\">absolute</a>\n"  \
+    "<a data-href=\"no\" xsrc=\"no\" href=\"\">not links, empty</a>\n"  \
+    "<a href=\"e?q=1#top\">query</a>\n"  \
+    "<a href=last"
+
+static TestRoute routes[] = {
+    { .path = "/dir/page.html",    .status = 200, .body = PAGE },
+    { .path = "/dir/chunked.html", .status = 200, .body = PAGE, .chunk_size = 3 },
+    { .path = "/dir/plain.txt",    .status = 200, .body = PAGE, .content_type = "text/plain" },
+    { .path = "/redirect",         .status = 302, .headers = "Location: /dir/page.html\r\n", .body = "moved" }
+};
+
+static unsigned port;
+
+static char* expected_links[] = {
+    "/dir/a.html",
+    "/b",
+    "/dir/c.png",
+    "http://example.com/d",
+    "/dir/e?q=1#top",
+    "/dir/last"
+};
+
+static UwResult extract_links(char* path)
+{
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u%s", port, path);
+
+    UwValue session = create_curl_session(nullptr);
+    uw_return_if_error(&session);
+    UwValue request = uw_create(UwTypeId_CurlRequest);
+    uw_return_if_error(&request);
+    UwValue url_value = uw_create_string(url);
+    uw_return_if_error(&url_value);
+    UwValue stage = curl_link_extract_stage();
+    uw_return_if_error(&stage);
+
+    curl_request_set_url(&request, &url_value);
+    curl_easy_setopt(uw_curl_request_data_ptr(&request)->easy_handle, CURLOPT_PROXY, "");
+    if (!curl_request_append_stage(&request, &stage) || !add_curl_request(&session, &request)) {
+        return UwNull();
+    }
+    for (;;) {
+        int running;
+        if (!curl_perform(&session, &running)) {
+            return UwNull();
+        }
+        if (running == 0) {
+            break;
+        }
+    }
+    return curl_link_extract_stage_links(&stage);
+}
+
+static bool links_equal(UwValuePtr links, char** expected, unsigned num_expected)
+{
+    if (!uw_is_array(links) || uw_array_length(links) != num_expected) {
+        return false;
+    }
+    for (unsigned i = 0; i < num_expected; i++) {{
+        char url[256];
+        if (expected[i][0] == '/') {
+            snprintf(url, sizeof(url), "http://127.0.0.1:%u%s", port, expected[i]);
+        } else {
+            snprintf(url, sizeof(url), "%s", expected[i]);
+        }
+        UwValue link = uw_array_item(links, i);
+        if (!uw_equal(&link, url)) {
+            UW_CSTRING_LOCAL(link_cstr, &link);
+            fprintf(stderr, "link %u: expected %s, got %s\n", i, url, link_cstr);
+            return false;
+        }
+    }}
+    return true;
+}
+
+static void test_extract()
+{
+    UwValue links = extract_links("/dir/page.html");
+    CHECK(links_equal(&links, expected_links, UW_LENGTH(expected_links)));
+}
+
+static void test_chunked()
+{
+    // state is kept between chunks, attribute names and values are split
+    UwValue links = extract_links("/dir/chunked.html");
+    CHECK(links_equal(&links, expected_links, UW_LENGTH(expected_links)));
+}
+
+static void test_not_html()
+{
+    UwValue links = extract_links("/dir/plain.txt");
+    CHECK(links_equal(&links, nullptr, 0));
+}
+
+static void test_redirect()
+{
+    // links are resolved against the final URL
+    UwValue links = extract_links("/redirect");
+    CHECK(links_equal(&links, expected_links, UW_LENGTH(expected_links)));
+}
+
+int main(int argc, char* argv[])
+{
+    init_allocator(&pet_allocator);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    port = test_server_start(routes, UW_LENGTH(routes));
+    if (!port) {
+        return 1;
+    }
+    test_extract();
+    test_chunked();
+    test_not_html();
+    test_redirect();
+
+    curl_global_cleanup();
+    return TEST_RESULT();
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "uw_curl.h"
+#include "test.h"
+#include "server.h"
+
+/*
+ * Redirects: headers_complete is called once, for the final response.
+ */
+
+static TestRoute routes[] = {
+    { .path = "/redirect", .status = 302, .headers = "Location: /final\r\n", .body = "moved" },
+    { .path = "/chain",    .status = 301, .headers = "Location: /redirect\r\n", .body = "moved" },
+    { .path = "/final",    .status = 200, .body = "final" },
+    { .path = "/no-location", .status = 302, .body = "no location" }
+};
+
+/****************************************************************
+ * Request type that checks headers like fetch does
+ */
+
+typedef struct {
+    unsigned headers_calls;
+    unsigned checked_status;
+} CheckedRequestData;
+
+static UwTypeId UwTypeId_CheckedRequest = 0;
+
+#define checked_request_data_ptr(value)  ((CheckedRequestData*) _uw_get_data_ptr((value), UwTypeId_CheckedRequest))
+
+static size_t write_data(void* data, size_t always_1, size_t size, UwValuePtr self)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(self);
+    return curl_buffer_append(&req->content, data, size)? size : 0;
+}
+
+static void complete(UwValuePtr self)
+{
+}
+
+static bool headers_complete(UwValuePtr self)
+{
+    CheckedRequestData* checked = checked_request_data_ptr(self);
+    checked->headers_calls++;
+    checked->checked_status = uw_curl_request_data_ptr(self)->status;
+    return checked->checked_status == 200;
+}
+
+static UwInterface_Curl checked_curl_interface = {
+    .write_data = write_data,
+    .complete   = complete,
+    .headers_complete = headers_complete
+};
+
+static UwType checked_request_type;
+
+/****************************************************************
+ * Tests
+ */
+
+typedef struct {
+    bool done;
+    CURLcode result;
+    unsigned status;
+    unsigned headers_calls;
+    char effective_url[256];
+    char content[64];
+} Outcome;
+
+static void request_done(UwValuePtr request, CURLcode result, void* ctx)
+{
+    Outcome* outcome = ctx;
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    outcome->done = true;
+    outcome->result = result;
+    outcome->status = req->status;
+    outcome->headers_calls = checked_request_data_ptr(request)->headers_calls;
+
+    char* url = nullptr;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+    if (url) {
+        snprintf(outcome->effective_url, sizeof(outcome->effective_url), "%s", url);
+    }
+    uint8_t* data;
+    size_t size;
+    if (curl_request_content(request, &data, &size) && size < sizeof(outcome->content)) {
+        memcpy(outcome->content, data, size);
+        outcome->content[size] = 0;
+    }
+}
+
+static bool fetch(int port, char* path, bool follow, Outcome* outcome)
+{
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", port, path);
+
+    memset(outcome, 0, sizeof(Outcome));
+
+    UwValue session = create_curl_session(nullptr);
+    UwValue request = uw_create(UwTypeId_CheckedRequest);
+    UwValue url_value = uw_create_string(url);
+    if (uw_error(&session) || uw_error(&request) || uw_error(&url_value)) {
+        return false;
+    }
+    curl_request_set_url(&request, &url_value);
+    curl_easy_setopt(uw_curl_request_data_ptr(&request)->easy_handle, CURLOPT_PROXY, "");
+    if (!follow) {
+        curl_request_follow_location(&request, false);
+    }
+    if (!curl_request_then(&request, request_done, outcome) || !add_curl_request(&session, &request)) {
+        return false;
+    }
+    for (;;) {
+        int running;
+        if (!curl_perform(&session, &running)) {
+            return false;
+        }
+        if (running == 0) {
+            return true;
+        }
+    }
+}
+
+static void test_followed(int port)
+{
+    Outcome outcome;
+    CHECK(fetch(port, "/redirect", true, &outcome));
+    CHECK(outcome.done);
+    CHECK(outcome.result == CURLE_OK);
+    CHECK(outcome.status == 200);
+    CHECK(outcome.headers_calls == 1);
+    CHECK(strstr(outcome.effective_url, "/final") != nullptr);
+    CHECK(strcmp(outcome.content, "final") == 0);
+}
+
+static void test_chain(int port)
+{
+    Outcome outcome;
+    CHECK(fetch(port, "/chain", true, &outcome));
+    CHECK(outcome.result == CURLE_OK);
+    CHECK(outcome.status == 200);
+    CHECK(outcome.headers_calls == 1);
+    CHECK(strcmp(outcome.content, "final") == 0);
+}
+
+static void test_not_followed(int port)
+{
+    // the redirect is the final response and is rejected by headers_complete
+    Outcome outcome;
+    CHECK(fetch(port, "/redirect", false, &outcome));
+    CHECK(outcome.done);
+    CHECK(outcome.status == 302);
+    CHECK(outcome.headers_calls == 1);
+    CHECK(outcome.content[0] == 0);
+}
+
+static void test_no_location(int port)
+{
+    // CURL cannot follow 302 without Location, so it is final
+    Outcome outcome;
+    CHECK(fetch(port, "/no-location", true, &outcome));
+    CHECK(outcome.done);
+    CHECK(outcome.status == 302);
+    CHECK(outcome.headers_calls == 1);
+}
+
+int main(int argc, char* argv[])
+{
+    init_allocator(&pet_allocator);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    UwTypeId_CheckedRequest = uw_subtype(
+        &checked_request_type, "CheckedRequest",
+        UwTypeId_CurlRequest,
+        CheckedRequestData,
+        UwInterfaceId_Curl, &checked_curl_interface
+    );
+
+    int port = test_server_start(routes, UW_LENGTH(routes));
+    if (!port) {
+        return 1;
+    }
+    test_followed(port);
+    test_chain(port);
+    test_not_followed(port);
+    test_no_location(port);
+
+    curl_global_cleanup();
+    return TEST_RESULT();
+}
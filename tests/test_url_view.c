@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "uw_curl.h"
+#include "test.h"
+
+/*
+ * URL views and percent decoding.
+ */
+
+static bool slice_equal(CurlSlice slice, char* str)
+{
+    return slice.length == strlen(str) && memcmp(slice.ptr, str, slice.length) == 0;
+}
+
+static void view(char* url, CurlUrlView* result)
+{
+    curl_url_view(url, strlen(url), result);
+}
+
+static void test_full()
+{
+    CurlUrlView v;
+    view("https://user:pw@example.com:8080/a/b/file.txt?x=1&y=2#frag", &v);
+    CHECK(slice_equal(v.scheme, "https"));
+    CHECK(slice_equal(v.userinfo, "user:pw"));
+    CHECK(slice_equal(v.host, "example.com"));
+    CHECK(slice_equal(v.port, "8080"));
+    CHECK(slice_equal(v.path, "/a/b/file.txt"));
+    CHECK(slice_equal(v.basename, "file.txt"));
+    CHECK(slice_equal(v.query, "x=1&y=2"));
+    CHECK(slice_equal(v.fragment, "frag"));
+}
+
+static void test_missing_parts()
+{
+    CurlUrlView v;
+    view("http://example.com", &v);
+    CHECK(slice_equal(v.scheme, "http"));
+    CHECK(slice_equal(v.host, "example.com"));
+    CHECK(v.userinfo.length == 0);
+    CHECK(v.port.length == 0);
+    CHECK(v.path.length == 0);
+    CHECK(v.basename.length == 0);
+    CHECK(v.query.length == 0);
+    CHECK(v.fragment.length == 0);
+
+    view("http://example.com/dir/", &v);
+    CHECK(slice_equal(v.path, "/dir/"));
+    CHECK(v.basename.length == 0);
+
+    // query and fragment delimit the host too
+    view("http://example.com?q#f", &v);
+    CHECK(slice_equal(v.host, "example.com"));
+    CHECK(slice_equal(v.query, "q"));
+    CHECK(slice_equal(v.fragment, "f"));
+
+    // fragment may contain question mark
+    view("http://example.com/p#a?b", &v);
+    CHECK(v.query.length == 0);
+    CHECK(slice_equal(v.fragment, "a?b"));
+}
+
+static void test_authority()
+{
+    CurlUrlView v;
+
+    // IPv6 address keeps brackets, its colons are not port delimiters
+    view("http://[::1]:8080/x", &v);
+    CHECK(slice_equal(v.host, "[::1]"));
+    CHECK(slice_equal(v.port, "8080"));
+
+    view("http://[fe80::1]/x", &v);
+    CHECK(slice_equal(v.host, "[fe80::1]"));
+    CHECK(v.port.length == 0);
+
+    // userinfo ends with the last @
+    view("http://a@b:c@host/", &v);
+    CHECK(slice_equal(v.userinfo, "a@b:c"));
+    CHECK(slice_equal(v.host, "host"));
+    CHECK(v.port.length == 0);
+}
+
+static void test_relative()
+{
+    CurlUrlView v;
+    view("/path/to/name.html?q", &v);
+    CHECK(v.scheme.length == 0);
+    CHECK(v.host.length == 0);
+    CHECK(slice_equal(v.path, "/path/to/name.html"));
+    CHECK(slice_equal(v.basename, "name.html"));
+    CHECK(slice_equal(v.query, "q"));
+
+    view("name", &v);
+    CHECK(slice_equal(v.path, "name"));
+    CHECK(slice_equal(v.basename, "name"));
+
+    view("", &v);
+    CHECK(v.path.length == 0);
+}
+
+static void test_percent_decode()
+{
+    char dest[64];
+    CurlSlice src;
+
+    src = (CurlSlice) { .ptr = "a%20b%2Fc%2fd", .length = 13 };
+    CHECK(curl_percent_decode(src, dest, sizeof(dest)) == 7);
+    CHECK(strcmp(dest, "a b/c/d") == 0);
+
+    // malformed and truncated escapes are kept as is
+    src = (CurlSlice) { .ptr = "%zz%4", .length = 5 };
+    CHECK(curl_percent_decode(src, dest, sizeof(dest)) == 5);
+    CHECK(strcmp(dest, "%zz%4") == 0);
+
+    // escape beyond the slice is not decoded
+    src = (CurlSlice) { .ptr = "x%41", .length = 2 };
+    CHECK(curl_percent_decode(src, dest, sizeof(dest)) == 2);
+    CHECK(strcmp(dest, "x%") == 0);
+
+    // UTF-8 sequence
+    src = (CurlSlice) { .ptr = "%D0%96", .length = 6 };
+    CHECK(curl_percent_decode(src, dest, sizeof(dest)) == 2);
+    CHECK(strcmp(dest, "\xD0\x96") == 0);
+
+    // truncated to dest_size - 1
+    src = (CurlSlice) { .ptr = "abcdef", .length = 6 };
+    CHECK(curl_percent_decode(src, dest, 4) == 3);
+    CHECK(strcmp(dest, "abc") == 0);
+
+    CHECK(curl_percent_decode(src, dest, 0) == 0);
+}
+
+int main(int argc, char* argv[])
+{
+    test_full();
+    test_missing_parts();
+    test_authority();
+    test_relative();
+    test_percent_decode();
+    return TEST_RESULT();
+}
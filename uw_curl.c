@@ -1,8 +1,10 @@
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include <uw.h>
 
-#include "uw_curl.h"
+#include "uw_curl_internal.h"
 
 static char* default_http_headers[] = {
     "User-Agent: uw-curl (https://tilde.club/~petbrain/)",
@@ -28,29 +30,320 @@ static void fini_curl_request(UwValuePtr self)
     uw_destroy(&req->media_type_params);
     uw_destroy(&req->disposition_type);
     uw_destroy(&req->disposition_params);
-    uw_destroy(&req->content);
+    curl_buffer_fini(&req->content);
 
     if (req->headers) {
         curl_slist_free_all(req->headers);
         req->headers = nullptr;
     }
 
+    _curl_pipeline_destroy(req);
+    _curl_request_body_destroy(req);
+    _curl_free_continuations(req);
+
+    if (req->digest) {
+        curl_digest_fini(req->digest);
+        default_allocator.release((void**) &req->digest, sizeof(CurlDigest));
+    }
+
     if (req->easy_handle) {
         curl_easy_cleanup(req->easy_handle);
         req->easy_handle = nullptr;
     }
+    // the template holds shared header list, release it after the handle
+    uw_destroy(&req->request_template);
+
+    // request data is released by super method, stop accounting
+    if (_curl_alloc_request == req) {
+        _curl_alloc_request = nullptr;
+    }
 
     // call super method
 
     uw_ancestor_of(UwTypeId_CurlRequest)->fini(self);
 }
 
+static size_t pass_data(void* data, size_t always_1, size_t size, UwValuePtr self, CurlRequestData* req)
+/*
+ * Pass data through pipeline stages to write_data method of Curl interface
+ * and update digest with accepted data.
+ */
+{
+    if (req->digest && !_curl_request_check_digest_size(req, size)) {
+        return 0;
+    }
+    size_t result;
+    CurlStageResult stage_result = CURL_STAGE_CONTINUE;
+    if (req->pipeline) {
+        stage_result = _curl_pipeline_process(self, req->pipeline, data, size);
+    }
+    switch (stage_result) {
+        case CURL_STAGE_CONTINUE:
+            result = req->iface->write_data(data, always_1, size, self);
+            if (result == CURL_WRITEFUNC_PAUSE && req->pipeline) {
+                // all stages have processed the data
+                req->pipeline->resume_stage = req->pipeline->num_stages;
+            }
+            break;
+        case CURL_STAGE_CONSUMED:
+            result = size;
+            break;
+        case CURL_STAGE_PAUSE:
+            return CURL_WRITEFUNC_PAUSE;
+        default:
+            return 0;
+    }
+
+    if (req->digest && result == size) {
+        curl_digest_update(req->digest, data, size);
+    }
+    return result;
+}
+
+static void link_paused(CurlSessionData* session, CurlRequestData* req)
+{
+    req->prev_paused = nullptr;
+    req->next_paused = session->paused_head;
+    if (session->paused_head) {
+        session->paused_head->prev_paused = req;
+    }
+    session->paused_head = req;
+
+    session->stats.pauses++;
+    session->num_paused++;
+    if (session->num_paused > session->stats.max_paused) {
+        session->stats.max_paused = session->num_paused;
+    }
+}
+
+void _curl_unlink_paused(CurlSessionData* session, CurlRequestData* req)
+{
+    if (!req->paused && !req->upload_paused) {
+        return;
+    }
+    if (req->prev_paused) {
+        req->prev_paused->next_paused = req->next_paused;
+    } else {
+        session->paused_head = req->next_paused;
+    }
+    if (req->next_paused) {
+        req->next_paused->prev_paused = req->prev_paused;
+    }
+    req->prev_paused = nullptr;
+    req->next_paused = nullptr;
+    if (req->upload_paused) {
+        session->num_paused_uploads--;
+    }
+    req->paused = false;
+    req->upload_paused = false;
+    session->num_paused--;
+}
+
+void _curl_pause_upload(CurlRequestData* req)
+/*
+ * Called by read function when stream body has no data yet.
+ * The loop thread resumes the upload when the descriptor becomes readable.
+ */
+{
+    CurlSessionData* session = req->session;
+    if (req->upload_paused) {
+        return;
+    }
+    if (!req->paused) {
+        link_paused(session, req);
+    }
+    req->upload_paused = true;
+    session->num_paused_uploads++;
+}
+
+static size_t write_callback(void* data, size_t always_1, size_t size, UwValuePtr self)
+/*
+ * CURL write function
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(self);
+
+    if (req->rejected) {
+        return req->draining? size : 0;
+    }
+
+    uint64_t trace_start = CURL_TRACE_ON()? curl_trace_now() : 0;
+
+    _CURL_ALLOC_ENTER(req);
+
+    size_t result = pass_data(data, always_1, size, self, req);
+
+    if (req->memory_budget && result == size && !_curl_check_memory_budget(req)) {
+        result = 0;
+    }
+    if (result == CURL_WRITEFUNC_PAUSE && !req->paused && req->session) {
+        if (!req->upload_paused) {
+            link_paused(req->session, req);
+        }
+        req->paused = true;
+    }
+
+    _CURL_ALLOC_LEAVE();
+
+    if (trace_start) {
+        _curl_trace_span("write_data", trace_start, curl_trace_now(), req->trace_id, size);
+    }
+    return result;
+}
+
+static size_t reject_response(CurlRequestData* req, size_t size)
+/*
+ * Finish rejected response in a way that keeps the connection alive where possible.
+ */
+{
+    req->rejected = true;
+
+    long http_version = 0;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_HTTP_VERSION, &http_version);
+    if (http_version >= CURL_HTTP_VERSION_2_0) {
+        // abort resets the stream only
+        return 0;
+    }
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+    if (0 <= content_length && content_length <= CURL_DRAIN_LIMIT) {
+        // discard the body, this is cheaper than a new connection
+        req->draining = true;
+        return size;
+    }
+    return 0;
+}
+
+static bool is_followed_redirect(CurlRequestData* req)
+/*
+ * Check if CURL follows the response when redirects are enabled.
+ * CURLINFO_REDIRECT_URL cannot be used, it is not set until the response is done.
+ */
+{
+    switch (req->status) {
+        case 301:
+        case 302:
+        case 303:
+        case 307:
+        case 308:
+            break;
+        default:
+            return false;
+    }
+    struct curl_header* hdr;
+    return curl_easy_header(req->easy_handle, "Location", 0, CURLH_HEADER, -1, &hdr) == CURLHE_OK;
+}
+
+static size_t header_callback(char* buffer, size_t always_1, size_t size, UwValuePtr self)
+/*
+ * CURL header function.
+ * Call headers_complete method at the end of final header block.
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(self);
+
+    if (req->headers_checked) {
+        // trailers
+        return size;
+    }
+    if (size > 2 || (buffer[0] != '\r' && buffer[0] != '\n')) {
+        // not an empty line that ends header block
+        return size;
+    }
+    curl_update_status(self);
+    if (req->status < 200) {
+        // informational response, final one follows
+        return size;
+    }
+    if (req->follow_location && is_followed_redirect(req)) {
+        // the final response follows
+        return size;
+    }
+    req->headers_checked = true;
+
+    if (!req->iface->headers_complete) {
+        return size;
+    }
+    _CURL_ALLOC_ENTER(req);
+    curl_request_parse_headers(req);
+    bool accept = req->iface->headers_complete(self);
+    _CURL_ALLOC_LEAVE();
+
+    return accept? size : reject_response(req, size);
+}
+
+static struct curl_slist* default_headers = nullptr;
+static pthread_once_t default_headers_once = PTHREAD_ONCE_INIT;
+
+static void make_default_headers()
+{
+    for (size_t i = 0; i < UW_LENGTH(default_http_headers); i++) {
+        struct curl_slist* temp = curl_slist_append(default_headers, default_http_headers[i]);
+        if (!temp) {
+            fprintf(stderr, "Cannot make headers\n");
+            curl_slist_free_all(default_headers);
+            default_headers = nullptr;
+            return;
+        }
+        default_headers = temp;
+    }
+}
+
+struct curl_slist* _curl_default_headers()
+/*
+ * Return shared list of default headers.
+ * The list is made once and never modified, requests copy it before adding their own headers.
+ */
+{
+    pthread_once(&default_headers_once, make_default_headers);
+    return default_headers;
+}
+
+bool _curl_setup_easy_handle(CURL* easy_handle)
+/*
+ * Set options common for all requests.
+ */
+{
+    struct curl_slist* headers = _curl_default_headers();
+    if (!headers) {
+        return false;
+    }
+    curl_easy_setopt(easy_handle, CURLOPT_HTTPHEADER, headers);
+
+    // other essentials
+    // XXX make configurable
+    curl_easy_setopt(easy_handle, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, br, zstd");
+    curl_easy_setopt(easy_handle, CURLOPT_CAINFO, "/etc/ssl/certs/ca-certificates.crt");
+
+    curl_easy_setopt(easy_handle, CURLOPT_TIMEOUT, 1200L);
+    curl_easy_setopt(easy_handle, CURLOPT_CONNECTTIMEOUT, 60L);
+    curl_easy_setopt(easy_handle, CURLOPT_EXPECT_100_TIMEOUT_MS, 0L);
+
+    curl_easy_setopt(easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy_handle, CURLOPT_MAXREDIRS, 10L);
+    curl_easy_setopt(easy_handle, CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
+    curl_easy_setopt(easy_handle, CURLOPT_AUTOREFERER, 1L);
+
+    // callbacks, their data is set per request
+    curl_easy_setopt(easy_handle, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(easy_handle, CURLOPT_HEADERFUNCTION, header_callback);
+
+    // headers of proxy CONNECT responses are not needed
+    curl_easy_setopt(easy_handle, CURLOPT_SUPPRESS_CONNECT_HEADERS, 1L);
+    return true;
+}
+
+_Thread_local CurlTemplateData* _curl_stamping_template = nullptr;
+
 static UwResult init_curl_request(UwValuePtr self, void* ctor_args)
 /*
  * Basic UW interface method
- * Initialize request structure and create CURL easy handle
+ * Initialize request structure and create CURL easy handle,
+ * or duplicate the handle of template when stamped by curl_request_from_template.
  */
 {
+    uint64_t trace_start = CURL_TRACE_ON()? curl_trace_now() : 0;
+
     // call super method
 
     UwValue status = uw_ancestor_of(UwTypeId_CurlRequest)->init(self, ctor_args);
@@ -59,42 +352,46 @@ static UwResult init_curl_request(UwValuePtr self, void* ctor_args)
     // init request
 
     CurlRequestData* req = uw_curl_request_data_ptr(self);
+    CurlTemplateData* tmpl = _curl_stamping_template;
+
+    _CURL_ALLOC_ENTER(req);
 
     req->url     = UwString();
-    req->proxy   = UwString();
+    req->proxy   = tmpl? uw_clone(&tmpl->proxy) : UwString();
     req->media_type    = UwString();
     req->media_subtype = UwString();
     req->media_type_params = UwMap();
     //req->content_encoding_is_utf8 = false;
     req->status  = 0;
     req->real_url = uw_clone(&req->url);
+    curl_buffer_init(&req->content, 0);
+    req->decode_mode = tmpl? tmpl->decode_mode : CURL_DECODE_INLINE;
+    req->follow_location = tmpl? tmpl->follow_location : true;
 
-    req->easy_handle = curl_easy_init();
+    if (tmpl) {
+        req->easy_handle = curl_easy_duphandle(tmpl->easy_handle);
+    } else {
+        req->easy_handle = curl_easy_init();
+    }
     if (!req->easy_handle) {
         fprintf(stderr, "Cannot make CURL handle\n");
+        _CURL_ALLOC_LEAVE();
         fini_curl_request(self);
         return UwOOM();  // XXX use Curl error
     }
 
-    if (!curl_request_set_headers(self, default_http_headers, UW_LENGTH(default_http_headers))) {
-        fini_curl_request(self);
-        return UwOOM();
+    if (tmpl) {
+        // options are copied from template, its header list is shared
+        req->base_headers = tmpl->headers? tmpl->headers : _curl_default_headers();
+    } else {
+        if (!_curl_setup_easy_handle(req->easy_handle)) {
+            _CURL_ALLOC_LEAVE();
+            fini_curl_request(self);
+            return UwOOM();
+        }
+        req->base_headers = _curl_default_headers();
     }
 
-    // other essentials
-    // XXX make configurable
-    curl_easy_setopt(req->easy_handle, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, br, zstd");
-    curl_easy_setopt(req->easy_handle, CURLOPT_CAINFO, "/etc/ssl/certs/ca-certificates.crt");
-
-    curl_easy_setopt(req->easy_handle, CURLOPT_TIMEOUT, 1200L);
-    curl_easy_setopt(req->easy_handle, CURLOPT_CONNECTTIMEOUT, 60L);
-    curl_easy_setopt(req->easy_handle, CURLOPT_EXPECT_100_TIMEOUT_MS, 0L);
-
-    curl_easy_setopt(req->easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(req->easy_handle, CURLOPT_MAXREDIRS, 10L);
-    curl_easy_setopt(req->easy_handle, CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
-    curl_easy_setopt(req->easy_handle, CURLOPT_AUTOREFERER, 1L);
-
     // set self as private data for easy_handle
     UwValuePtr self_ptr = default_allocator.allocate(sizeof(_UwValue), false);
 
@@ -102,18 +399,19 @@ static UwResult init_curl_request(UwValuePtr self, void* ctor_args)
     *self_ptr = uw_clone(self);
     curl_easy_setopt(req->easy_handle, CURLOPT_PRIVATE, self_ptr);
 
-    // set write function
-    UwInterface_Curl* iface = uw_interface(self->type_id, Curl);
-    curl_easy_setopt(req->easy_handle, CURLOPT_WRITEFUNCTION, iface->write_data);
+    // set data for write and header functions
+    req->iface = uw_interface(self->type_id, Curl);
     curl_easy_setopt(req->easy_handle, CURLOPT_WRITEDATA, self_ptr);
+    curl_easy_setopt(req->easy_handle, CURLOPT_HEADERDATA, self_ptr);
+
+    // request body is set by curl_request_set_form and curl_request_set_body* functions
 
-    // python leftovers to do someday:
-    //
-    // if method == 'POST':
-    //     if form_data is not None:
-    //         post_data = urlencode(form_data)
-    //     c.setopt(c.POSTFIELDS, post_data)
+    _CURL_ALLOC_LEAVE();
 
+    if (trace_start) {
+        req->trace_id = _curl_trace_request_id();
+        _curl_trace_span("create", trace_start, curl_trace_now(), req->trace_id, 0);
+    }
     return UwOK();
 }
 
@@ -121,23 +419,19 @@ static size_t request_write_data(void* data, size_t always_1, size_t size, UwVal
 {
     CurlRequestData* req = uw_curl_request_data_ptr(self);
 
-    if (uw_is_null(&req->content)) {
+    if (!size) {
+        return 0;
+    }
+    if (req->content.size == 0) {
+        // first chunk
         curl_request_parse_headers(req);
 
-        curl_off_t content_length;
-        CURLcode res = curl_easy_getinfo(req->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
-        if (res != CURLE_OK || content_length < 0) {
-            content_length = 0;
-        }
-        req->content = uw_create_empty_string(content_length, 1);
-        if (uw_error(&req->content)) {
+        curl_off_t content_length = curl_request_content_length(self);
+        if (content_length > 0 && !curl_buffer_reserve(&req->content, content_length)) {
             return 0;
         }
     }
-    if (!size) {
-        return 0;
-    }
-    if (!uw_string_append_buffer(&req->content, (uint8_t*) data, size)) {
+    if (!curl_buffer_append(&req->content, data, size)) {
         return 0;
     }
     return size;
@@ -147,7 +441,7 @@ static void request_complete(UwValuePtr self)
 {
     CurlRequestData* req = uw_curl_request_data_ptr(self);
 
-    if (uw_is_null(&req->content)) {
+    if (req->content.size == 0) {
         curl_request_parse_headers(req);
     }
 }
@@ -158,8 +452,11 @@ void curl_request_set_url(UwValuePtr request, UwValuePtr url)
 
     UW_CSTRING_LOCAL(url_cstr, url);
     curl_easy_setopt(req->easy_handle, CURLOPT_URL, url_cstr);
+
+    _CURL_ALLOC_ENTER(req);
     uw_destroy(&req->url);
     req->url = uw_clone(url);
+    _CURL_ALLOC_LEAVE();
 }
 
 void curl_request_set_proxy(UwValuePtr request, UwValuePtr proxy)
@@ -199,10 +496,32 @@ void curl_request_set_resume(UwValuePtr request, size_t pos)
     curl_easy_setopt(req->easy_handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) pos);
 }
 
+bool _curl_copy_headers(struct curl_slist** dest, struct curl_slist* src)
+/*
+ * Append copies of src items to dest.
+ */
+{
+    for (; src; src = src->next) {
+        struct curl_slist* temp = curl_slist_append(*dest, src->data);
+        if (!temp) {
+            fprintf(stderr, "Cannot make headers\n");
+            return false;
+        }
+        *dest = temp;
+    }
+    return true;
+}
+
 bool curl_request_set_headers(UwValuePtr request, char* http_headers[], unsigned num_headers)
+/*
+ * Add headers to the request. Shared base list is copied on first call.
+ */
 {
     CurlRequestData* req = uw_curl_request_data_ptr(request);
 
+    if (!req->headers && !_curl_copy_headers(&req->headers, req->base_headers)) {
+        return false;
+    }
     for (size_t i = 0; i < num_headers; i++) {
         struct curl_slist* temp = curl_slist_append(req->headers, http_headers[i]);
         if (!temp) {
@@ -221,6 +540,130 @@ void curl_request_verbose(UwValuePtr request, bool verbose)
     curl_easy_setopt(req->easy_handle, CURLOPT_VERBOSE, (long) verbose);
 }
 
+void curl_request_follow_location(UwValuePtr request, bool follow)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    curl_easy_setopt(req->easy_handle, CURLOPT_FOLLOWLOCATION, (long) follow);
+    req->follow_location = follow;
+}
+
+void curl_request_set_decode_mode(UwValuePtr request, CurlDecodeMode mode)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    curl_easy_setopt(req->easy_handle, CURLOPT_HTTP_CONTENT_DECODING, (long) (mode == CURL_DECODE_INLINE));
+    req->decode_mode = mode;
+}
+
+void curl_request_resume(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    CurlSessionData* session = req->session;
+    if (!session) {
+        return;
+    }
+    atomic_store(&req->resume_requested, true);
+    atomic_store(&session->resume_pending, true);
+    if (!pthread_equal(pthread_self(), session->loop_thread)) {
+        curl_multi_wakeup(session->multi_handle);
+    }
+}
+
+static void resume_transfers(CurlSessionData* session)
+/*
+ * Resume paused transfers requested by curl_request_resume.
+ */
+{
+    CurlRequestData* req = session->paused_head;
+    while (req) {
+        // write callback may pause the transfer again and put it to the head
+        CurlRequestData* next = req->next_paused;
+        if (atomic_exchange(&req->resume_requested, false) && req->paused) {
+            session->stats.resumes++;
+            CURLcode err;
+            if (req->upload_paused) {
+                // stream body has no data yet, keep sending paused
+                req->paused = false;
+                err = curl_easy_pause(req->easy_handle, CURLPAUSE_SEND);
+            } else {
+                _curl_unlink_paused(session, req);
+                err = curl_easy_pause(req->easy_handle, CURLPAUSE_CONT);
+            }
+            if (err) {
+                fprintf(stderr, "ERROR: %s\n", curl_easy_strerror(err));
+            }
+        }
+        req = next;
+    }
+}
+
+static struct curl_waitfd* get_wait_fds(CurlSessionData* session,
+                                        struct curl_waitfd* extra_fds, unsigned num_extra_fds)
+/*
+ * Return caller's extra descriptors followed by stream bodies of paused uploads,
+ * or nullptr if out of memory.
+ */
+{
+    unsigned num_fds = num_extra_fds + session->num_paused_uploads;
+    if (num_fds > session->wait_fds_capacity) {
+        unsigned old_nbytes = session->wait_fds_capacity * sizeof(struct curl_waitfd);
+        unsigned new_nbytes = num_fds * sizeof(struct curl_waitfd);
+        if (session->wait_fds) {
+            if (!default_allocator.reallocate((void**) &session->wait_fds, old_nbytes, new_nbytes, false, nullptr)) {
+                return nullptr;
+            }
+        } else {
+            session->wait_fds = default_allocator.allocate(new_nbytes, false);
+            if (!session->wait_fds) {
+                return nullptr;
+            }
+        }
+        session->wait_fds_capacity = num_fds;
+    }
+    struct curl_waitfd* fd = session->wait_fds;
+    for (unsigned i = 0; i < num_extra_fds; i++) {
+        *fd++ = extra_fds[i];
+    }
+    for (CurlRequestData* req = session->paused_head; req; req = req->next_paused) {
+        if (req->upload_paused) {
+            *fd++ = (struct curl_waitfd) { .fd = req->body->fd, .events = CURL_WAIT_POLLIN };
+        }
+    }
+    return session->wait_fds;
+}
+
+static void resume_uploads(CurlSessionData* session)
+/*
+ * Resume uploads paused by read function when their stream bodies become readable.
+ * CURL does not report hangup on extra descriptors, so they are polled here again,
+ * otherwise EOF of an empty pipe would never resume the upload.
+ */
+{
+    CurlRequestData* req = session->paused_head;
+    while (req) {
+        CurlRequestData* next = req->next_paused;
+        if (req->upload_paused) {
+            struct pollfd pfd = { .fd = req->body->fd, .events = POLLIN };
+            if (poll(&pfd, 1, 0) > 0) {
+                session->stats.resumes++;
+                CURLcode err;
+                if (req->paused) {
+                    // keep receiving paused until the sink calls curl_request_resume
+                    req->upload_paused = false;
+                    session->num_paused_uploads--;
+                    err = curl_easy_pause(req->easy_handle, CURLPAUSE_RECV);
+                } else {
+                    _curl_unlink_paused(session, req);
+                    err = curl_easy_pause(req->easy_handle, CURLPAUSE_CONT);
+                }
+                if (err) {
+                    fprintf(stderr, "ERROR: %s\n", curl_easy_strerror(err));
+                }
+            }
+        }
+        req = next;
+    }
+}
+
 void curl_update_status(UwValuePtr request)
 {
     CurlRequestData* req = uw_curl_request_data_ptr(request);
@@ -234,6 +677,29 @@ void curl_update_status(UwValuePtr request)
     }
 }
 
+void curl_request_set_spill_threshold(UwValuePtr request, size_t threshold)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    curl_buffer_set_spill_threshold(&req->content, threshold);
+}
+
+bool curl_request_content(UwValuePtr request, uint8_t** data, size_t* size)
+{
+    return curl_buffer_view(&uw_curl_request_data_ptr(request)->content, data, size);
+}
+
+curl_off_t curl_request_content_length(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    curl_off_t content_length;
+    CURLcode err = curl_easy_getinfo(req->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+    if (err || content_length < 0) {
+        return -1;
+    }
+    return content_length;
+}
+
 unsigned UwInterfaceId_Curl = 0;
 
 static UwInterface_Curl curl_interface = {
@@ -267,48 +733,430 @@ static void init()
  * CURL sessions and runner
  */
 
-void* create_curl_session()
+static void fini_curl_session(UwValuePtr self)
+/*
+ * Basic UW interface method
+ */
 {
-    CURLM* multi_handle = curl_multi_init();
+    CurlSessionData* session = uw_curl_session_data_ptr(self);
+
+    _curl_stop_workers(session);
+    _curl_hedge_fini(session);
+    _curl_proxy_pool_fini(session);
+
+    if (session->multi_handle) {
+        CURLMcode err = curl_multi_cleanup(session->multi_handle);
+        if (err) {
+            fprintf(stderr, "ERROR %s: %s\n", __func__, curl_multi_strerror(err));
+        }
+        session->multi_handle = nullptr;
+    }
+    pthread_mutex_destroy(&session->submit_lock);
+
+    if (session->wait_fds) {
+        default_allocator.release((void**) &session->wait_fds,
+                                  session->wait_fds_capacity * sizeof(struct curl_waitfd));
+    }
+
+    // call super method
+
+    uw_ancestor_of(UwTypeId_CurlSession)->fini(self);
+}
+
+static UwResult init_curl_session(UwValuePtr self, void* ctor_args)
+/*
+ * Basic UW interface method
+ * Create CURL multi handle
+ */
+{
+    // call super method
+
+    UwValue status = uw_ancestor_of(UwTypeId_CurlSession)->init(self, ctor_args);
+    uw_return_if_error(&status);
+
+    CurlSessionData* session = uw_curl_session_data_ptr(self);
+
+    pthread_mutex_init(&session->submit_lock, nullptr);
+
+    session->multi_handle = curl_multi_init();
+    if (!session->multi_handle) {
+        fprintf(stderr, "Cannot make CURL multi handle\n");
+        fini_curl_session(self);
+        return UwOOM();  // XXX use Curl error
+    }
 
 #   ifdef CURLPIPE_MULTIPLEX
         // enables http/2
-        curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(session->multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 #   endif
 
-    return (void*) multi_handle;
+    return UwOK();
 }
 
-void delete_curl_session(void* session)
+UwTypeId UwTypeId_CurlSession = 0;
+
+static UwType curl_session_type;
+
+[[ gnu::constructor ]]
+static void init_session()
 {
-    CURLM* multi_handle = (CURLM*) session;
+    UwTypeId_CurlSession = uw_subtype(
+        &curl_session_type, "CurlSession",
+        UwTypeId_Struct,
+        CurlSessionData
+    );
+    curl_session_type.init = init_curl_session;
+    curl_session_type.fini = fini_curl_session;
+}
 
-    CURLMcode err = curl_multi_cleanup(multi_handle);
+static void set_multi_option(CURLM* multi_handle, CURLMoption option, long value, char* name)
+{
+    if (value == 0) {
+        // leave libcurl default
+        return;
+    }
+    CURLMcode err = curl_multi_setopt(multi_handle, option, value);
     if (err) {
-        fprintf(stderr, "ERROR %s: %s\n", __func__, curl_multi_strerror(err));
+        fprintf(stderr, "WARNING: cannot set %s: %s\n", name, curl_multi_strerror(err));
     }
 }
 
-bool add_curl_request(void* session, UwValuePtr request)
+UwResult create_curl_session(CurlSessionConfig* config)
 {
-    CURLM* multi_handle = (CURLM*) session;
-    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    UwValue result = uw_create(UwTypeId_CurlSession);
+    uw_return_if_error(&result);
+
+    if (!config) {
+        return uw_move(&result);
+    }
+
+    CurlSessionData* session = uw_curl_session_data_ptr(&result);
+
+    session->config = *config;
+
+    set_multi_option(session->multi_handle, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                     config->max_concurrent_streams, "max_concurrent_streams");
+    set_multi_option(session->multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS,
+                     config->max_host_connections, "max_host_connections");
+    set_multi_option(session->multi_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                     config->max_total_connections, "max_total_connections");
+    set_multi_option(session->multi_handle, CURLMOPT_MAXCONNECTS,
+                     config->max_connects, "max_connects");
+
+    return uw_move(&result);
+}
+
+bool _curl_add_easy_handle(CurlSessionData* session, CurlRequestData* req)
+/*
+ * If the request cannot be added, it is finished: continuations are called
+ * and private clone is released. The only exception is a request that
+ * is added already.
+ */
+{
+    uint64_t trace_start = CURL_TRACE_ON()? curl_trace_now() : 0;
+
+    if (session->config.http2) {
+        // prefer multiplexing over an existing HTTP/2 connection to opening a new one
+        curl_easy_setopt(req->easy_handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(req->easy_handle, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    if (session->proxy_pool && (!uw_is_string(&req->proxy) || uw_strlen(&req->proxy) == 0)) {
+        _curl_proxy_pool_assign(session, req);
+    }
+
+    if (atomic_load(&req->cancel_requested) || atomic_load(&session->cancel_mode) != CURL_CANCEL_NONE) {
+        // the session is stopped or the request was cancelled before adding
+        req->cancelled = true;
+        req->result = CURLE_ABORTED_BY_CALLBACK;
+        if (!req->preconnect) {
+            session->stats.requests_cancelled++;
+        }
+        _curl_proxy_pool_done(session, req, req->result);
+        _curl_drop_request(req, true);
+        return false;
+    }
 
-    CURLMcode err = curl_multi_add_handle(multi_handle, req->easy_handle);
+    CURLMcode err = curl_multi_add_handle(session->multi_handle, req->easy_handle);
     if (err) {
         fprintf(stderr, "ERROR: %s\n", curl_multi_strerror(err));
+        if (err == CURLM_ADDED_ALREADY) {
+            return false;
+        }
+        req->result = (err == CURLM_OUT_OF_MEMORY)? CURLE_OUT_OF_MEMORY : CURLE_FAILED_INIT;
+        _curl_proxy_pool_done(session, req, req->result);
+        _curl_drop_request(req, true);
         return false;
     } else {
+        if (req->preconnect) {
+            session->stats.preconnects++;
+        } else if (req->hedge) {
+            session->stats.hedges_issued++;
+        } else {
+            session->stats.requests_added++;
+        }
+        _curl_alloc_attach(session, req);
+
+        // new requests go to the head, so the list can be extended while it is scanned
+        req->added_ns = curl_trace_now();
+        req->prev_running = nullptr;
+        req->next_running = session->running_head;
+        if (session->running_head) {
+            session->running_head->prev_running = req;
+        }
+        session->running_head = req;
+
+        if (trace_start) {
+            if (!req->trace_id) {
+                req->trace_id = _curl_trace_request_id();
+            }
+            req->trace_start_ns = trace_start;
+            _curl_trace_span("add", trace_start, curl_trace_now(), req->trace_id, 0);
+        }
         return true;
     }
 }
 
-static void check_transfers(CURLM* multi_handle)
+bool add_curl_request(UwValuePtr session, UwValuePtr request)
+{
+    return _curl_add_easy_handle(uw_curl_session_data_ptr(session), uw_curl_request_data_ptr(request));
+}
+
+void curl_request_drop(UwValuePtr request, CURLcode result)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    req->result = result;
+    _curl_drop_request(req, true);
+}
+
+bool curl_session_preconnect(UwValuePtr session, UwValuePtr url, UwValuePtr proxy, unsigned num_connections)
+/*
+ * Connections made with CURLOPT_CONNECT_ONLY are never reused for other transfers,
+ * so HEAD requests are made instead. When they are done, connections remain
+ * in the session cache, with DNS, TCP and TLS handshakes completed.
+ *
+ * With HTTP/2 one connection is enough, streams are multiplexed.
+ * Connection cache (max_connects) must be large enough to keep preconnected ones.
+ */
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+
+    if (sess->config.http2 && num_connections > 1) {
+        num_connections = 1;
+    }
+    for (unsigned i = 0; i < num_connections; i++) {{
+        UwValue request = uw_create(UwTypeId_CurlRequest);
+        if (uw_error(&request)) {
+            return false;
+        }
+        CurlRequestData* req = uw_curl_request_data_ptr(&request);
+        req->preconnect = true;
+
+        curl_request_set_url(&request, url);
+        if (proxy) {
+            curl_request_set_proxy(&request, proxy);
+        }
+        curl_easy_setopt(req->easy_handle, CURLOPT_NOBODY, 1L);
+        curl_request_follow_location(&request, false);
+
+        if (!_curl_add_easy_handle(sess, req)) {
+            return false;
+        }
+    }}
+    return true;
+}
+
+void _curl_unlink_running(CurlSessionData* session, CurlRequestData* req)
+{
+    if (req->prev_running) {
+        req->prev_running->next_running = req->next_running;
+    } else {
+        session->running_head = req->next_running;
+    }
+    if (req->next_running) {
+        req->next_running->prev_running = req->prev_running;
+    }
+    req->prev_running = nullptr;
+    req->next_running = nullptr;
+}
+
+static void update_connection_stats(CurlSessionData* session, CURL* easy_handle)
+{
+    long num_connects = 0;
+    curl_easy_getinfo(easy_handle, CURLINFO_NUM_CONNECTS, &num_connects);
+
+    long http_version = 0;
+    curl_easy_getinfo(easy_handle, CURLINFO_HTTP_VERSION, &http_version);
+
+    if (num_connects) {
+        session->stats.new_connections += num_connects;
+    } else {
+        session->stats.reused_connections++;
+    }
+    if (http_version == CURL_HTTP_VERSION_2_0 || http_version == CURL_HTTP_VERSION_3) {
+        session->stats.http2_transfers++;
+        if (num_connects == 0) {
+            session->stats.multiplexed_streams++;
+        }
+    }
+}
+
+void _curl_complete_request(UwValuePtr request)
+/*
+ * Finalize digest, complete pipeline stages, decode deferred content,
+ * call complete method and continuations.
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    uint64_t trace_start = CURL_TRACE_ON()? curl_trace_now() : 0;
+
+    _CURL_ALLOC_ENTER(req);
+
+    if (req->digest) {
+        curl_digest_final(req->digest);
+    }
+    if (req->pipeline) {
+        _curl_pipeline_complete(request, req->pipeline);
+    }
+    if (req->decode_mode == CURL_DECODE_DEFERRED) {
+        // failure is reported, complete gets encoded content
+        curl_request_decode_encoding(request);
+    }
+    req->iface->complete(request);
+
+    if (trace_start) {
+        _curl_trace_span("complete", trace_start, curl_trace_now(), req->trace_id, 0);
+    }
+    _curl_run_continuations(request);
+
+    _CURL_ALLOC_LEAVE();
+}
+
+void _curl_release_request(UwValuePtr request)
+/*
+ * Destroy and release private clone of request made in init_curl_request.
+ */
+{
+    _CURL_ALLOC_ENTER(uw_curl_request_data_ptr(request));
+    uw_destroy(request);
+    _CURL_ALLOC_LEAVE();
+
+    default_allocator.release((void**) &request, sizeof(_UwValue));
+}
+
+void _curl_drop_request(CurlRequestData* req, bool run_continuations)
+/*
+ * Detach private clone of request from easy handle, call continuations
+ * if requested, and release the clone.
+ */
+{
+    UwValuePtr request = nullptr;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_PRIVATE, (char**) &request);
+    if (!request) {
+        // already done
+        return;
+    }
+    curl_easy_setopt(req->easy_handle, CURLOPT_PRIVATE, nullptr);
+
+    if (run_continuations) {
+        _CURL_ALLOC_ENTER(req);
+        _curl_run_continuations(request);
+        _CURL_ALLOC_LEAVE();
+    }
+    _curl_release_request(request);
+}
+
+void _curl_cancel_request(CurlSessionData* session, CurlRequestData* req)
+/*
+ * Cancel running request in the loop thread.
+ */
+{
+    // pending done message for the handle, if any, is discarded by libcurl
+    curl_multi_remove_handle(session->multi_handle, req->easy_handle);
+    _curl_unlink_running(session, req);
+    _curl_unlink_paused(session, req);
+
+    req->cancelled = true;
+    req->result = CURLE_ABORTED_BY_CALLBACK;
+    _curl_proxy_pool_done(session, req, req->result);
+
+    _curl_drop_request(req, true);
+}
+
+static void cancel_transfers(CurlSessionData* session, bool all)
+/*
+ * Cancel running requests flagged by curl_request_cancel, or all of them.
+ */
+{
+    if (!all) {
+        // hedges of cancelled requests and vice versa
+        for (CurlRequestData* req = session->running_head; req; req = req->next_running) {
+            if (req->hedge_peer && atomic_load(&req->cancel_requested)) {
+                atomic_store(&req->hedge_peer->cancel_requested, true);
+            }
+        }
+    }
+    // continuations may add requests, they go to the head and are not visited
+    CurlRequestData* req = session->running_head;
+    while (req) {
+        CurlRequestData* next = req->next_running;
+        if (all || atomic_exchange(&req->cancel_requested, false)) {
+            if (req->hedge_peer) {
+                req->hedge_peer->hedge_peer = nullptr;
+                req->hedge_peer = nullptr;
+            }
+            if (req->hedge) {
+                session->stats.hedges_cancelled++;
+            } else if (!req->preconnect) {
+                session->stats.requests_cancelled++;
+            }
+            _curl_cancel_request(session, req);
+        }
+        req = next;
+    }
+}
+
+void curl_session_cancel(UwValuePtr session, CurlCancelMode mode)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+
+    // atomics only, plus curl_multi_wakeup which writes to a socket pair or eventfd,
+    // so this is safe to call from signal handlers
+    int current = atomic_load(&sess->cancel_mode);
+    while (current < (int) mode && !atomic_compare_exchange_weak(&sess->cancel_mode, &current, (int) mode)) {
+    }
+    curl_multi_wakeup(sess->multi_handle);
+}
+
+CurlCancelMode curl_session_cancel_mode(UwValuePtr session)
+{
+    return atomic_load(&uw_curl_session_data_ptr(session)->cancel_mode);
+}
+
+void curl_request_cancel(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    atomic_store(&req->cancel_requested, true);
+
+    CurlSessionData* session = req->session;
+    if (!session) {
+        // not added yet
+        return;
+    }
+    atomic_store(&session->cancel_pending, true);
+    if (!pthread_equal(pthread_self(), session->loop_thread)) {
+        curl_multi_wakeup(session->multi_handle);
+    }
+}
+
+static void check_transfers(CurlSessionData* session)
 {
     for(;;) {
         // check transfers
         int msgs_left;
-        CURLMsg *m = curl_multi_info_read(multi_handle, &msgs_left);
+        CURLMsg *m = curl_multi_info_read(session->multi_handle, &msgs_left);
         if (!m) {
             break;
         }
@@ -322,11 +1170,47 @@ static void check_transfers(CURLM* multi_handle)
             fprintf(stderr, "FATAL: %s\n", curl_easy_strerror(err));
             exit(0);
         }
+        if (!request) {
+            // cancelled
+            continue;
+        }
         curl_easy_setopt(m->easy_handle, CURLOPT_PRIVATE, nullptr);
 
         CurlRequestData* req = uw_curl_request_data_ptr(request);
+        CURLcode result = m->data.result;
+        req->result = result;
+
+        update_connection_stats(session, req->easy_handle);
+
+        if (CURL_TRACE_ON() && req->trace_start_ns) {
+            _curl_trace_transfer_phases(req);
+        }
+
+        // m is not valid after removing handle
+        curl_multi_remove_handle(session->multi_handle, req->easy_handle);
+        _curl_unlink_running(session, req);
+        _curl_unlink_paused(session, req);
+        _curl_proxy_pool_done(session, req, result);
+
+        if (!req->preconnect && (req->hedge_peer || session->hedging)) {
+            // cancel the other request of hedged pair if this one succeeded
+            _curl_hedge_done(session, req, result == CURLE_OK && !req->rejected);
+        }
+
+        if (req->preconnect) {
+            // the connection is in the cache now, nothing to complete
+
+        } else if (req->rejected) {
+            session->stats.requests_rejected++;
+
+            // rejected response is not completed, but dependent flows should know about it
+            _CURL_ALLOC_ENTER(req);
+            _curl_run_continuations(request);
+            _CURL_ALLOC_LEAVE();
+
+        } else if(result == CURLE_OK) {
+            session->stats.requests_completed++;
 
-        if(m->data.result == CURLE_OK) {
             // get real URL
             char* url = nullptr;
             curl_easy_getinfo(req->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
@@ -338,38 +1222,157 @@ static void check_transfers(CURLM* multi_handle)
             curl_update_status(request);
 
             // complete request
-            uw_interface(request->type_id, Curl)->complete(request);
+            if (session->workers && _curl_queue_completion(session, request)) {
+                // request is now owned by worker
+                continue;
+            }
+            _curl_complete_request(request);
+        } else {
+            session->stats.requests_failed++;
+
+            _CURL_ALLOC_ENTER(req);
+            _curl_run_continuations(request);
+            _CURL_ALLOC_LEAVE();
         }
-        curl_multi_remove_handle(multi_handle, req->easy_handle);
-        uw_destroy(request);
-        default_allocator.release((void**) &request, sizeof(_UwValue));
+        _curl_release_request(request);
     }
 }
 
-bool curl_perform(void* session, int* running_transfers)
+bool curl_perform(UwValuePtr session, int* running_transfers)
+{
+    return curl_perform_wait(session, running_transfers, 1000);
+}
+
+bool curl_perform_wait(UwValuePtr session, int* running_transfers, int timeout_ms)
 {
-    CURLM* multi_handle = (CURLM*) session;
+    return curl_perform_fds(session, running_transfers, timeout_ms, nullptr, 0);
+}
+
+bool curl_perform_fds(UwValuePtr session, int* running_transfers, int timeout_ms,
+                      struct curl_waitfd* extra_fds, unsigned num_extra_fds)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
     CURLMcode err;
 
-    err = curl_multi_perform(multi_handle, running_transfers);
-    if (err) {
-        fprintf(stderr, "FATAL %s:%s:%d: %s\n", __FILE__, __func__, __LINE__, curl_multi_strerror(err));
-        return false;
+    sess->loop_thread = pthread_self();
+    _curl_add_submitted(sess);
+
+    if (atomic_exchange(&sess->resume_pending, false)) {
+        resume_transfers(sess);
     }
-    if (!*running_transfers) {
-        // handles for completed requests do not appear here,
-        // check them before exiting:
-        check_transfers(multi_handle);
-        return true;
+    if (atomic_load(&sess->cancel_mode) == CURL_CANCEL_ABORT) {
+        if (sess->running_head) {
+            cancel_transfers(sess, true);
+        }
+    } else if (atomic_exchange(&sess->cancel_pending, false)) {
+        cancel_transfers(sess, false);
     }
 
-    // wait for something to happen
-    err = curl_multi_wait(multi_handle, NULL, 0, 1000, NULL);
+    uint64_t trace_start = CURL_TRACE_ON()? curl_trace_now() : 0;
+
+    err = curl_multi_perform(sess->multi_handle, running_transfers);
     if (err) {
         fprintf(stderr, "FATAL %s:%s:%d: %s\n", __FILE__, __func__, __LINE__, curl_multi_strerror(err));
         return false;
     }
+    if (trace_start) {
+        uint64_t now = curl_trace_now();
+        _curl_trace_span("perform", trace_start, now, 0, *running_transfers);
+        trace_start = now;
+    }
+    if ((unsigned) *running_transfers > sess->stats.max_running) {
+        sess->stats.max_running = *running_transfers;
+    }
+    // uploads paused by read function wait for their stream bodies along with extra fds
+    struct curl_waitfd* wait_fds = extra_fds;
+    unsigned num_wait_fds = num_extra_fds;
+    if (sess->num_paused_uploads) {
+        wait_fds = get_wait_fds(sess, extra_fds, num_extra_fds);
+        if (wait_fds) {
+            num_wait_fds += sess->num_paused_uploads;
+        } else {
+            // out of memory, paused uploads are still polled after waiting
+            wait_fds = extra_fds;
+        }
+    }
+    if (*running_transfers || atomic_load(&sess->pending_completions) || num_wait_fds) {
+        // wait for something to happen, curl_multi_wakeup interrupts waiting
+        err = curl_multi_poll(sess->multi_handle, wait_fds, num_wait_fds, timeout_ms, NULL);
+        if (err) {
+            fprintf(stderr, "FATAL %s:%s:%d: %s\n", __FILE__, __func__, __LINE__, curl_multi_strerror(err));
+            return false;
+        }
+        if (trace_start) {
+            _curl_trace_span("wait", trace_start, curl_trace_now(), 0, 0);
+        }
+        if (wait_fds != extra_fds) {
+            for (unsigned i = 0; i < num_extra_fds; i++) {
+                extra_fds[i].revents = wait_fds[i].revents;
+            }
+        }
+    }
+    if (sess->num_paused_uploads) {
+        resume_uploads(sess);
+    }
+    // handles for completed requests do not appear in running transfers,
+    // check them anyway
+    check_transfers(sess);
 
-    check_transfers(multi_handle);
+    if (sess->hedging) {
+        _curl_hedge_scan(sess);
+    }
+
+    // workers put requests to the completed list before decrementing the counter,
+    // so when it's zero all of them are released here
+    unsigned pending_completions = atomic_load(&sess->pending_completions);
+    _curl_release_completed(sess);
+
+    // requests submitted by continuations and completions in progress
+    // mean there's more work to do
+    *running_transfers += _curl_add_submitted(sess) + pending_completions;
     return true;
 }
+
+void curl_session_print_stats(UwValuePtr session, FILE* fp)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+    CurlSessionStats* stats = &sess->stats;
+
+    fprintf(fp, "Requests: %llu added, %llu completed, %llu failed, %llu rejected, %llu cancelled, max %u running\n",
+            (unsigned long long) stats->requests_added,
+            (unsigned long long) stats->requests_completed,
+            (unsigned long long) stats->requests_failed,
+            (unsigned long long) stats->requests_rejected,
+            (unsigned long long) stats->requests_cancelled,
+            stats->max_running);
+    fprintf(fp, "Connections: %llu new, %llu reused, %llu preconnects\n",
+            (unsigned long long) stats->new_connections,
+            (unsigned long long) stats->reused_connections,
+            (unsigned long long) stats->preconnects);
+    if (stats->pauses) {
+        fprintf(fp, "Backpressure: %llu pauses, %llu resumes, max %u paused\n",
+                (unsigned long long) stats->pauses,
+                (unsigned long long) stats->resumes,
+                stats->max_paused);
+    }
+    CurlAllocStats alloc_stats;
+    curl_session_alloc_stats(session, &alloc_stats);
+    if (alloc_stats.allocations) {
+        curl_print_alloc_stats(&alloc_stats, "Memory", fp);
+    }
+    fprintf(fp, "HTTP/2+: %llu transfers, %llu multiplexed\n",
+            (unsigned long long) stats->http2_transfers,
+            (unsigned long long) stats->multiplexed_streams);
+    curl_session_print_proxy_stats(session, fp);
+    if (sess->hedging || stats->hedges_issued) {
+        fprintf(fp, "Hedges: %llu issued, %llu won, %llu cancelled\n",
+                (unsigned long long) stats->hedges_issued,
+                (unsigned long long) stats->hedges_won,
+                (unsigned long long) stats->hedges_cancelled);
+    }
+    if (sess->workers || stats->completions_queued) {
+        fprintf(fp, "Completions: %llu queued to workers, %llu inline\n",
+                (unsigned long long) stats->completions_queued,
+                (unsigned long long) stats->completions_inline);
+    }
+}
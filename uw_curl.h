@@ -1,5 +1,9 @@
 #pragma once
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include <curl/curl.h>
 #include <uw.h>
 
@@ -8,6 +12,11 @@ extern UwTypeId UwTypeId_CurlRequest;
  * type id for CURL request, returned by uw_subtype
  */
 
+extern UwTypeId UwTypeId_CurlSession;
+/*
+ * type id for CURL session, returned by uw_subtype
+ */
+
 extern unsigned UwInterfaceId_Curl;
 /*
  * CURL interface id for CurlRequest
@@ -19,12 +28,200 @@ typedef struct {
     size_t (*write_data)(void* data, size_t always_1, size_t size, UwValuePtr self);
     void   (*complete)  (UwValuePtr self);
 
+    // Optional, can be nullptr.
+    // Called when final response headers are received, before any body data.
+    // Status and parsed headers are available at this point.
+    // Return false to reject the response, see CURL_DRAIN_LIMIT.
+    bool   (*headers_complete)(UwValuePtr self);
+
 } UwInterface_Curl;
 
+#define CURL_DRAIN_LIMIT  (64 * 1024)
+/*
+ * Rejected HTTP/1.x response bodies up to this size are read and discarded
+ * to keep the connection alive. Larger bodies and bodies of unknown size abort the transfer.
+ * HTTP/2 transfers are always aborted, this resets the stream only.
+ */
+
+
+/*
+ * Pipeline stages.
+ *
+ * Stages are attached to request and receive chunks in order before write_data method.
+ * Chunks are passed by pointer, stages must not retain them.
+ * Stage instances hold per-request state and should not be shared between requests.
+ */
+
+typedef enum {
+    CURL_STAGE_CONTINUE = 0,  // pass data to the next stage
+    CURL_STAGE_CONSUMED,      // data is consumed, do not pass it further
+    CURL_STAGE_PAUSE,         // pause transfer, the same data will be delivered on resume,
+                              // see curl_request_resume
+    CURL_STAGE_ABORT          // abort transfer
+} CurlStageResult;
+
+extern unsigned UwInterfaceId_CurlStage;
+/*
+ * Pipeline stage interface id
+ */
+
+typedef struct {
+    CurlStageResult (*process) (UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size);
+    void            (*complete)(UwValuePtr self, UwValuePtr request);
+
+} UwInterface_CurlStage;
+
+#define CURL_MAX_STAGES  8
 
 typedef struct {
+    unsigned num_stages;
+    unsigned resume_stage;  // the stage that paused the transfer
+    struct {
+        _UwValue stage;
+        UwInterface_CurlStage* iface;
+    } stages[CURL_MAX_STAGES];
+
+} CurlPipeline;
+
+typedef enum {
+    // digest algorithms, can be combined as flags
+    CURL_DIGEST_XXH3   = 1,  // 64-bit XXH3
+    CURL_DIGEST_SHA256 = 2
+} CurlDigestAlgorithm;
+
+#define CURL_DIGEST_MAX_SIZE  32
+
+typedef struct {
+    unsigned algorithms;
+    void* xxh3_state;
+    void* sha256_ctx;
+    uint64_t size;  // number of bytes hashed
+
+    // digests, valid when finalized
+    uint8_t xxh3[8];
+    uint8_t sha256[32];
+    bool finalized;
+
+    // verification
+    unsigned expected_algorithm;
+    uint8_t expected[CURL_DIGEST_MAX_SIZE];
+    uint64_t expected_size;
+    bool has_expected_size;
+    bool mismatch;  // set when size or digest do not match expected values
+
+} CurlDigest;
+
+typedef enum {
+    CURL_METHOD_POST,
+    CURL_METHOD_PUT
+} CurlUploadMethod;
+
+// bodies up to this size are passed as POSTFIELDS, larger ones are streamed
+#define CURL_BODY_POSTFIELDS_LIMIT  (64 * 1024)
+
+typedef struct {
+    uint8_t* data;  // caller's buffer or mmap'd file, nullptr if read from fd
+    uint64_t size;  // not used if stream is set
+    uint64_t pos;
+    int fd;
+    bool mapped;
+    bool own_fd;
+    bool stream;    // size is unknown, fd is read sequentially until EOF
+
+} CurlRequestBody;
+
+
+/*
+ * Content buffer.
+ *
+ * Content is kept in memory until its size exceeds spill threshold,
+ * then it is moved to an unlinked temporary file.
+ * Either way, curl_buffer_view returns contiguous read-only data.
+ */
+
+#define CURL_BUFFER_SPILL_THRESHOLD  (16 * 1024 * 1024)
+
+// memory is allocated with unsigned sizes, larger thresholds are clamped to this
+#define CURL_BUFFER_MAX_SPILL_THRESHOLD  ((size_t) UINT_MAX)
+
+typedef struct {
+    uint8_t* data;           // memory storage, nullptr if spilled
+    size_t capacity;
+    size_t size;             // size of content
+    size_t spill_threshold;
+    int fd;                  // temporary file, -1 while content is in memory
+    void* view;              // mapping of temporary file made by curl_buffer_view
+    size_t view_size;
+
+} CurlBuffer;
+
+#define curl_buffer_spilled(buffer)  ((buffer)->fd >= 0)
+
+
+/*
+ * Content decoder.
+ *
+ * Converts content to UW string according to charset.
+ * Malformed UTF-8 sequences are replaced with U+FFFD.
+ */
+
+typedef enum {
+    CURL_CHARSET_UTF8 = 0,  // default, also used for US-ASCII
+    CURL_CHARSET_LATIN1,    // ISO-8859-1
+    CURL_CHARSET_CP1252     // windows-1252
+} CurlCharset;
+
+typedef struct {
+    CurlCharset charset;
+    uint8_t partial[4];     // incomplete UTF-8 sequence at the end of previous chunk
+    unsigned partial_size;
+    _UwValue text;
+
+} CurlDecoder;
+
+typedef struct {
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    int64_t  live_bytes;
+    int64_t  peak_bytes;
+
+} CurlAllocStats;
+
+typedef struct {
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t allocated_bytes;
+    _Atomic int64_t  live_bytes;
+    _Atomic int64_t  peak_bytes;
+
+} CurlAtomicAllocStats;
+
+typedef struct _CurlSessionData CurlSessionData;
+
+typedef void (*CurlContinuation)(UwValuePtr request, CURLcode result, void* ctx);
+/*
+ * Continuation is called when request is done, successfully or not.
+ * For successful requests it is called after complete method, in the same thread.
+ * The request is released after all continuations return, clone it to keep.
+ */
+
+typedef struct _CurlThen {
+    CurlContinuation func;
+    void* ctx;
+    struct _CurlThen* next;
+
+} CurlThen;
+
+typedef enum {
+    CURL_DECODE_INLINE = 0,  // CURL decodes content in the loop thread
+    CURL_DECODE_DEFERRED,    // content received by default handlers is decoded before complete
+    CURL_DECODE_NONE         // content is kept encoded, see curl_request_decode_encoding
+} CurlDecodeMode;
+
+typedef struct _CurlRequestData {
     CURL* easy_handle;
 
+    UwInterface_Curl* iface;  // cached interface of the request type
+
     _UwValue url;
     _UwValue proxy;
     _UwValue real_url;
@@ -39,20 +236,337 @@ typedef struct {
 
     // The content received by default handlers.
     // Always binary, regardless of content-type charset
-    _UwValue content;
+    CurlBuffer content;
 
+    // Content-Encoding handling, see curl_request_set_decode_mode
+    CurlDecodeMode decode_mode;
+    bool content_decoded;  // content is decoded by curl_request_decode_encoding
+
+    // Headers set by curl_request_set_headers, nullptr if base headers are used as is.
     struct curl_slist* headers;
+    struct curl_slist* base_headers;  // shared, default or from template, must not be modified
+
+    // template the request is stamped from, keeps base headers alive
+    _UwValue request_template;
+
+    // Request body, nullptr if not set.
+    CurlRequestBody* body;
+
+    // Pipeline stages, nullptr if none attached.
+    CurlPipeline* pipeline;
+
+    // Digest of content, nullptr unless enabled.
+    // Calculated from data accepted by write_data and finalized before complete is called.
+    CurlDigest* digest;
+
+    // Continuations, called in order of adding.
+    CurlThen* continuations;
+
+    // Next request in session's submit queue.
+    struct _CurlRequestData* next_submitted;
+
+    // Next request completed by workers and waiting to be released by the loop thread.
+    UwValuePtr next_completed;
 
     unsigned int status;
+    CURLcode result;  // transfer result, set when transfer is done
+
+    bool headers_checked;  // final header block is received
+    bool rejected;         // response is rejected by headers_complete method
+    bool draining;         // body of rejected response is being discarded
+    bool preconnect;       // request made by curl_session_preconnect
+    bool follow_location;  // redirects are followed, see curl_request_follow_location
+    bool hedge;            // duplicate made by hedge function
+    bool cancelled;        // cancelled by curl_request_cancel, curl_session_cancel,
+                           // or because the other request of hedged pair has won
+    bool hedge_lost;       // cancelled because the other request of hedged pair has won
+    _Atomic bool cancel_requested;  // set by curl_request_cancel
+    bool paused;           // write callback returned CURL_WRITEFUNC_PAUSE, loop thread only
+    bool upload_paused;    // read function returned CURL_READFUNC_PAUSE, stream body has no data yet
+    _Atomic bool resume_requested;  // set by curl_request_resume
+
+    // session the request was added to
+    CurlSessionData* session;
+
+    // running requests of the session, maintained by the loop thread
+    struct _CurlRequestData* prev_running;
+    struct _CurlRequestData* next_running;
+    uint64_t added_ns;  // when the request was added to multi handle
+
+    // paused requests of the session, either paused or upload_paused is set
+    struct _CurlRequestData* prev_paused;
+    struct _CurlRequestData* next_paused;
+
+    // proxy assigned from session pool, nullptr if none
+    struct CurlProxy* pool_proxy;
+
+    // hedging, see curl_session_enable_hedging
+    struct _CurlRequestData* hedge_peer;  // the other request of hedged pair
+    uint64_t speed_check_ns;
+    curl_off_t speed_check_bytes;
+
+    // allocation accounting, see curl_alloc_accounting_enable
+    CurlAllocStats alloc_stats;
+    uint64_t memory_budget;  // max live bytes, 0 if unlimited
+
+    // tracing
+    uint64_t trace_id;
+    uint64_t trace_start_ns;
 
 } CurlRequestData;
 
 #define uw_curl_request_data_ptr(value)  ((CurlRequestData*) _uw_get_data_ptr((value), UwTypeId_CurlRequest))
 
+/*
+ * Request templates.
+ *
+ * Template holds prebuilt easy handle with options and header list.
+ * Requests are stamped from it with curl_easy_duphandle and share the header list.
+ * The template becomes immutable once the first request is stamped.
+ */
+
+extern UwTypeId UwTypeId_CurlRequestTemplate;
+
+typedef struct {
+    CURL* easy_handle;
+    struct curl_slist* headers;  // nullptr if default headers are used
+    _UwValue proxy;
+    CurlDecodeMode decode_mode;
+    bool follow_location;
+    bool frozen;
+
+} CurlTemplateData;
+
+#define uw_curl_template_data_ptr(value)  ((CurlTemplateData*) _uw_get_data_ptr((value), UwTypeId_CurlRequestTemplate))
+
+UwResult curl_request_template();
+
+bool curl_template_set_proxy(UwValuePtr tmpl, UwValuePtr proxy);
+bool curl_template_set_cookie(UwValuePtr tmpl, UwValuePtr cookie);
+bool curl_template_set_headers(UwValuePtr tmpl, char* http_headers[], unsigned num_headers);
+/*
+ * Add headers to default ones.
+ */
+bool curl_template_verbose(UwValuePtr tmpl, bool verbose);
+bool curl_template_set_decode_mode(UwValuePtr tmpl, CurlDecodeMode mode);
+bool curl_template_follow_location(UwValuePtr tmpl, bool follow);
+CURL* curl_template_easy_handle(UwValuePtr tmpl);
+/*
+ * Return easy handle for setting other options, nullptr if template is immutable already.
+ */
+
+UwResult curl_request_from_template(UwValuePtr tmpl, UwTypeId type_id, UwValuePtr url);
+/*
+ * Create request of type_id, which must be CurlRequest or its subtype.
+ * Only URL is set, other options and headers come from template.
+ */
+
+typedef struct {
+    // Session configuration, zero values mean libcurl defaults.
+
+    long max_concurrent_streams;  // max streams per HTTP/2 connection
+    long max_host_connections;    // max connections to a single host
+    long max_total_connections;   // max simultaneously open connections
+    long max_connects;            // connection cache size
+
+    bool http2;  // prefer HTTP/2 and wait for multiplexing instead of opening new connections
+
+} CurlSessionConfig;
+
+typedef struct {
+    // Per-session counters, updated when transfers are done.
+
+    uint64_t requests_added;
+    uint64_t requests_completed;
+    uint64_t requests_failed;
+    uint64_t requests_rejected;   // rejected by headers_complete, not counted as completed or failed
+    uint64_t requests_cancelled;  // by curl_request_cancel or curl_session_cancel, not counted as failed
+
+    uint64_t new_connections;     // connections made by transfers, including redirects
+    uint64_t reused_connections;  // transfers that did not make a new connection
+    uint64_t http2_transfers;     // transfers done over HTTP/2 or HTTP/3
+    uint64_t multiplexed_streams; // HTTP/2 or HTTP/3 transfers done over existing connection
+
+    unsigned max_running;  // peak number of running transfers
+
+    uint64_t preconnects;  // requests made by curl_session_preconnect, not counted as added
+
+    uint64_t completions_queued;  // completions passed to worker threads
+    uint64_t completions_inline;  // completions done by loop thread because the queue was full
+
+    uint64_t pauses;       // transfers paused by sinks or by stream bodies that had no data
+    uint64_t resumes;
+    unsigned max_paused;   // peak number of paused transfers
+
+    uint64_t hedges_issued;     // duplicates made by hedge function, not counted as added
+    uint64_t hedges_won;        // duplicates completed before original requests
+    uint64_t hedges_cancelled;  // requests of hedged pairs cancelled because the other one won
+
+} CurlSessionStats;
+
+#define uw_curl_session_data_ptr(value)  ((CurlSessionData*) _uw_get_data_ptr((value), UwTypeId_CurlSession))
+
 // sessions
-void* create_curl_session();
-bool add_curl_request(void* session, UwValuePtr request);
-void delete_curl_session(void* session);
+UwResult create_curl_session(CurlSessionConfig* config);
+/*
+ * Create CurlSession, config can be nullptr for defaults.
+ */
+bool add_curl_request(UwValuePtr session, UwValuePtr request);
+/*
+ * Return false if the request is not added. Unless it was added already,
+ * continuations are called before returning. If the request or the session
+ * is cancelled, the result is CURLE_ABORTED_BY_CALLBACK and cancelled flag is set.
+ */
+void curl_request_drop(UwValuePtr request, CURLcode result);
+/*
+ * Finish request that is not going to be added: set result, call continuations
+ * and release private clone made when the request was created.
+ * Requests that are created but neither added nor dropped are never freed.
+ */
+
+bool curl_session_preconnect(UwValuePtr session, UwValuePtr url, UwValuePtr proxy, unsigned num_connections);
+/*
+ * Warm up connections to the host of url before real requests are added.
+ * Proxy can be nullptr.
+ */
+void curl_session_print_stats(UwValuePtr session, FILE* fp);
+
+// cancellation
+
+typedef enum {
+    CURL_CANCEL_NONE = 0,
+    CURL_CANCEL_DRAIN,  // running transfers go on, new requests are not started
+    CURL_CANCEL_ABORT   // running transfers are cancelled too
+} CurlCancelMode;
+
+void curl_session_cancel(UwValuePtr session, CurlCancelMode mode);
+/*
+ * Stop the session. Can be called from any thread and from signal handlers.
+ * The loop is woken up and cancels requests in curl_perform.
+ *
+ * Cancelled requests are not completed, continuations are called
+ * with CURLE_ABORTED_BY_CALLBACK result and cancelled flag set.
+ * Requests added or submitted after the session is stopped are not started,
+ * their continuations are called as if they were cancelled.
+ *
+ * ABORT overrides DRAIN, the session cannot be restarted.
+ */
+CurlCancelMode curl_session_cancel_mode(UwValuePtr session);
+
+void curl_request_cancel(UwValuePtr request);
+/*
+ * Cancel request and its hedge, if any. Can be called from any thread,
+ * the caller must keep the request alive. If the request is not added yet,
+ * it will not be started.
+ */
+
+// completion workers
+bool curl_session_start_workers(UwValuePtr session, unsigned num_workers, unsigned queue_capacity);
+/*
+ * Run complete methods in worker threads instead of the loop thread.
+ * If the queue is full, requests are completed by the loop thread.
+ * Requests and their stages must not be shared with other threads while completing.
+ * The allocator must be thread-safe, see curl_alloc_thread_safe.
+ *
+ * UW reference counts are not atomic. Values held by requests, such as URLs,
+ * templates, proxies, stores and WARC writers, can be shared with requests
+ * the loop thread is creating, so complete methods and continuations
+ * must not clone or destroy them. Completed requests are handed back
+ * and destroyed by the loop thread in curl_perform.
+ */
+void curl_session_stop_workers(UwValuePtr session);
+/*
+ * Wait for queued completions and stop worker threads.
+ * Called automatically when session is destroyed.
+ */
+
+// proxy pool
+typedef enum {
+    CURL_PROXY_LEAST_LOADED,   // fewest transfers in flight
+    CURL_PROXY_FASTEST         // best recent time to first byte, weighted by transfers in flight
+} CurlProxyPolicy;
+
+typedef struct {
+    // Per-proxy counters.
+
+    unsigned in_flight;
+    uint64_t requests;
+    uint64_t failures;       // connect failures
+    uint64_t ejections;
+    double latency_ms;       // moving average of time to first byte, zero if unknown
+    bool ejected;
+
+} CurlProxyStats;
+
+bool curl_session_set_proxy_pool(UwValuePtr session, char* proxies[], unsigned num_proxies,
+                                 CurlProxyPolicy policy, unsigned max_failures, unsigned eject_ms);
+/*
+ * Assign proxies to requests that have no proxy of their own when they are added.
+ * Each selection compares two random admitted proxies by policy, which is O(1).
+ * A proxy that fails to connect max_failures times in a row (default 3)
+ * is ejected and admitted again after eject_ms (default 30000).
+ *
+ * Must be called in the loop thread. The pool can be replaced only when
+ * none of its proxies is assigned to a running request, otherwise false is returned.
+ */
+unsigned curl_session_num_proxies(UwValuePtr session);
+bool curl_session_proxy_stats(UwValuePtr session, unsigned index, char** proxy, CurlProxyStats* stats);
+/*
+ * Get counters of index-th proxy of the pool.
+ */
+void curl_session_print_proxy_stats(UwValuePtr session, FILE* fp);
+
+// hedged requests
+typedef struct {
+    double ttfb_percentile;       // hedge requests waiting for response headers longer than
+                                  // this percentile of observed time to first byte, zero disables
+    unsigned min_ttfb_samples;    // TTFBs observed before the percentile is used, default 20
+    unsigned min_delay_ms;        // never hedge requests younger than that, default 100
+    curl_off_t min_speed;         // hedge requests downloading slower, bytes per second, zero disables
+    unsigned speed_window_ms;     // speed is measured over that interval, default 5000
+    unsigned max_hedge_percent;   // limit of issued hedges, percent of added requests, default 5
+
+} CurlHedgeConfig;
+
+typedef UwResult (*CurlHedgeFunc)(UwValuePtr request, void* ctx);
+/*
+ * Make a duplicate of request, possibly with different proxy, mirror URL or resume offset.
+ * The duplicate must not be added to the session. Return null to skip hedging.
+ */
+
+bool curl_session_enable_hedging(UwValuePtr session, CurlHedgeConfig* config, CurlHedgeFunc func, void* ctx);
+/*
+ * When a running request is a straggler, make a duplicate with func and add it to the session.
+ * The first request of the pair that completes successfully wins, the other one is cancelled:
+ * it is removed from the session, its continuations are called with cancelled and hedge_lost
+ * flags set and CURLE_ABORTED_BY_CALLBACK result, and complete method is not called.
+ * If either request fails, the other one goes on alone.
+ */
+
+// continuations
+bool curl_request_then(UwValuePtr request, CurlContinuation func, void* ctx);
+/*
+ * Add continuation, must be called before submitting request.
+ */
+bool curl_submit(UwValuePtr session, UwValuePtr request);
+/*
+ * Thread-safe version of add_curl_request.
+ * Can be called from continuations, including those running in worker threads.
+ * The request is added to multi handle by the loop thread in curl_perform.
+ */
+
+typedef struct CurlJoin CurlJoin;
+
+typedef void (*CurlJoinFunc)(unsigned num_requests, unsigned num_failed, void* ctx);
+
+CurlJoin* curl_join_create(CurlJoinFunc func, void* ctx);
+bool curl_join_add(CurlJoin* join, UwValuePtr request);
+void curl_join_seal(CurlJoin* join);
+/*
+ * Join calls func when all added requests are done and the join is sealed.
+ * Requests should be added before they are submitted.
+ * The join is freed after func returns.
+ */
 
 // request
 void curl_request_set_url(UwValuePtr request, UwValuePtr url);
@@ -62,14 +576,399 @@ void curl_request_set_resume(UwValuePtr request, size_t pos);
 bool curl_request_set_headers(UwValuePtr request, char* http_headers[], unsigned num_headers);
 void curl_request_verbose(UwValuePtr request, bool verbose);
 
+void curl_request_follow_location(UwValuePtr request, bool follow);
+/*
+ * Redirects are followed by default. Use this function instead of setting
+ * CURLOPT_FOLLOWLOCATION directly, the request needs to know which response is final.
+ */
+
+void curl_request_set_decode_mode(UwValuePtr request, CurlDecodeMode mode);
+/*
+ * Set how encoded content is handled. Must be called before the transfer.
+ * In modes other than CURL_DECODE_INLINE pipeline stages, write_data and digest
+ * receive content as sent by the server, and Accept-Encoding is still sent.
+ * CURL_DECODE_DEFERRED decodes content received by default handlers when
+ * the request is complete, i.e. in completion workers if they are started.
+ */
+
+void curl_request_resume(UwValuePtr request);
+/*
+ * Resume transfer paused by write_data method or pipeline stage
+ * when the sink has capacity again. The transfer is resumed by the loop thread
+ * in curl_perform, the same data is delivered again.
+ * Can be called from any thread, the caller must keep the request alive,
+ * e.g. by holding a clone made when pausing.
+ */
+
 void curl_update_status(UwValuePtr request);
 
+curl_off_t curl_request_content_length(UwValuePtr request);
+/*
+ * Return Content-Length of response or -1 if unknown.
+ */
+
+void curl_request_set_spill_threshold(UwValuePtr request, size_t threshold);
+/*
+ * Set the size of content received by default handlers above which it is moved
+ * to a temporary file. Must be called before the transfer.
+ * Thresholds above CURL_BUFFER_MAX_SPILL_THRESHOLD are clamped.
+ */
+
+bool curl_request_content(UwValuePtr request, uint8_t** data, size_t* size);
+/*
+ * Get read-only view of content received by default handlers.
+ */
+
+// content buffer
+void curl_buffer_init(CurlBuffer* buffer, size_t spill_threshold);
+/*
+ * Zero spill_threshold means CURL_BUFFER_SPILL_THRESHOLD.
+ * Thresholds above CURL_BUFFER_MAX_SPILL_THRESHOLD are clamped.
+ */
+void curl_buffer_set_spill_threshold(CurlBuffer* buffer, size_t spill_threshold);
+/*
+ * Same as for curl_buffer_init, must be called before data is appended.
+ */
+bool curl_buffer_reserve(CurlBuffer* buffer, size_t size);
+/*
+ * Preallocate memory for expected size, or spill immediately if it is above threshold.
+ */
+bool curl_buffer_append(CurlBuffer* buffer, void* data, size_t size);
+bool curl_buffer_view(CurlBuffer* buffer, uint8_t** data, size_t* size);
+/*
+ * The view is valid until next append or fini.
+ */
+void curl_buffer_fini(CurlBuffer* buffer);
+
+// content decoder
+bool curl_charset_from_name(UwValuePtr name, CurlCharset* charset);
+/*
+ * Null or empty name means UTF-8.
+ * Return false if charset is not supported.
+ */
+bool curl_decoder_init(CurlDecoder* decoder, CurlCharset charset, size_t size_hint);
+bool curl_decoder_update(CurlDecoder* decoder, uint8_t* data, size_t size);
+/*
+ * Decode next chunk. Incomplete UTF-8 sequence at the end is kept for the next call.
+ */
+UwResult curl_decoder_finish(CurlDecoder* decoder);
+/*
+ * Return decoded text and reset decoder.
+ */
+void curl_decoder_fini(CurlDecoder* decoder);
+
+UwResult curl_decode(uint8_t* data, size_t size, CurlCharset charset);
+/*
+ * Decode complete content.
+ * UTF-8 is validated first to create string of the narrowest char size with exact capacity.
+ */
+UwResult curl_request_decode_content(UwValuePtr request);
+/*
+ * Decode content received by default handlers using charset from Content-Type.
+ * Encoded content is decoded with curl_request_decode_encoding first.
+ * Return null if charset or content encoding is not supported.
+ */
+
+// content encoding
+typedef enum {
+    CURL_ENCODING_IDENTITY = 0,
+    CURL_ENCODING_GZIP,
+    CURL_ENCODING_DEFLATE,
+    CURL_ENCODING_BR,
+    CURL_ENCODING_ZSTD,
+    CURL_ENCODING_UNKNOWN   // unsupported or stacked codings
+} CurlContentEncoding;
+
+CurlContentEncoding curl_request_content_encoding(UwValuePtr request);
+/*
+ * Return encoding of content passed to stages and write_data.
+ * Always identity in CURL_DECODE_INLINE mode.
+ */
+char* curl_content_encoding_name(CurlContentEncoding encoding);
+
+bool curl_content_decode(CurlContentEncoding encoding, uint8_t* data, size_t size, CurlBuffer* out);
+/*
+ * Decode complete content and append the result to out.
+ * Return false if content is malformed or encoding is not supported.
+ * Can be called from any thread.
+ */
+bool curl_request_decode_encoding(UwValuePtr request);
+/*
+ * Decode content received by default handlers in place, if it is encoded.
+ * Does nothing if content is decoded already.
+ */
+
+// request body, can be set once
+bool curl_request_set_form(UwValuePtr request, char* form_data[], unsigned num_items);
+bool curl_request_set_body(UwValuePtr request, CurlUploadMethod method, void* data, size_t size);
+bool curl_request_set_body_fd(UwValuePtr request, CurlUploadMethod method, int fd, uint64_t size);
+bool curl_request_set_body_file(UwValuePtr request, CurlUploadMethod method, UwValuePtr filename);
+
+// request digests
+bool curl_request_enable_digest(UwValuePtr request, unsigned algorithms);
+bool curl_request_expect_digest(UwValuePtr request, CurlDigestAlgorithm algorithm,
+                                uint8_t* expected_digest, int64_t expected_size);
+/*
+ * Verify content against expected digest and/or size.
+ * expected_digest can be nullptr to check size only, expected_size can be negative if unknown.
+ * Size mismatch aborts the transfer as soon as it is detected.
+ * Digest mismatch sets digest->mismatch before complete is called.
+ */
+
 // runner
-bool curl_perform(void* session, int* running_transfers);
+bool curl_perform(UwValuePtr session, int* running_transfers);
+bool curl_perform_wait(UwValuePtr session, int* running_transfers, int timeout_ms);
+/*
+ * Same as curl_perform, with custom timeout for waiting on running transfers.
+ */
+bool curl_perform_fds(UwValuePtr session, int* running_transfers, int timeout_ms,
+                      struct curl_waitfd* extra_fds, unsigned num_extra_fds);
+/*
+ * Same as curl_perform_wait, also waiting on extra file descriptors,
+ * even if there are no running transfers. Events are returned in revents.
+ */
+
+// pipeline
+bool curl_request_append_stage(UwValuePtr request, UwValuePtr stage);
+
+// standard stages
+extern UwTypeId UwTypeId_CurlFilterStage;
+extern UwTypeId UwTypeId_CurlDigestStage;
+extern UwTypeId UwTypeId_CurlLinkExtractStage;
+extern UwTypeId UwTypeId_CurlNullSink;
+extern UwTypeId UwTypeId_CurlMemorySink;
+extern UwTypeId UwTypeId_CurlFileSink;
+
+UwResult curl_filter_stage(unsigned status, char* media_type);
+/*
+ * Abort transfer if response status or media type do not match.
+ * status 0 accepts any 2xx status.
+ * media_type can be nullptr, "type", or "type/subtype".
+ */
+
+UwResult curl_digest_stage(unsigned algorithms);
+CurlDigest* curl_digest_stage_digest(UwValuePtr stage);
+
+UwResult curl_link_extract_stage();
+UwResult curl_link_extract_stage_links(UwValuePtr stage);
+/*
+ * Link extractor collects values of href and src attributes from HTML content.
+ * Links are resolved against real URL when request is complete.
+ * Return array of strings.
+ */
+
+UwResult curl_null_sink();
+uint64_t curl_null_sink_bytes(UwValuePtr stage);
+/*
+ * Discard data and count bytes.
+ * Null sink can be shared by requests that run in one thread.
+ */
+
+UwResult curl_memory_sink();
+UwResult curl_memory_sink_content(UwValuePtr stage);
+
+UwResult curl_file_sink(UwValuePtr filename);
+/*
+ * The file is created on first chunk.
+ */
+
+// histograms
+
+/*
+ * HDR-style histogram: values are counted in buckets of relative width
+ * 1 / 2^(CURL_HISTOGRAM_SUB_BITS - 1), i.e. with about 1.6% precision, over the whole uint64_t range.
+ * Histogram is not thread-safe, use one per thread and merge them.
+ */
+
+#define CURL_HISTOGRAM_SUB_BITS  7
+#define CURL_HISTOGRAM_SIZE  ((1 << CURL_HISTOGRAM_SUB_BITS) + (64 - CURL_HISTOGRAM_SUB_BITS) * (1 << (CURL_HISTOGRAM_SUB_BITS - 1)))
+
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    double sum_squares;
+    uint64_t counts[CURL_HISTOGRAM_SIZE];
+
+} CurlHistogram;
+
+void     curl_histogram_reset(CurlHistogram* histogram);
+void     curl_histogram_record(CurlHistogram* histogram, uint64_t value);
+void     curl_histogram_merge(CurlHistogram* dest, CurlHistogram* src);
+uint64_t curl_histogram_percentile(CurlHistogram* histogram, double percentile);
+/*
+ * Return the highest value equivalent to the value at percentile (0..100).
+ */
+double   curl_histogram_mean(CurlHistogram* histogram);
+double   curl_histogram_stddev(CurlHistogram* histogram);
+
+// WARC archiving
+
+typedef enum {
+    CURL_WARC_PLAIN = 0,
+    CURL_WARC_GZIP,
+    CURL_WARC_ZSTD   // available if built with libzstd
+} CurlWarcCompression;
+
+#define CURL_WARC_SEGMENT_SIZE  (1024ULL * 1024 * 1024)  // default max size of segment file
+#define CURL_WARC_MAX_SEGMENTS  64  // max number of threads writing concurrently
+
+extern UwTypeId UwTypeId_CurlWarcWriter;
+extern UwTypeId UwTypeId_CurlWarcSink;
+
+UwResult curl_warc_writer(UwValuePtr prefix, CurlWarcCompression compression, uint64_t max_segment_size);
+/*
+ * Create writer of segment files named <prefix>-NNNNN.warc[.gz|.zst].
+ * Each thread writes to its own segment, segments are rolled when they exceed max size.
+ * Zero max_segment_size means CURL_WARC_SEGMENT_SIZE.
+ */
+void curl_warc_writer_close(UwValuePtr writer);
+/*
+ * Close segment files. Must be called when no thread writes records.
+ */
+
+UwResult curl_warc_sink(UwValuePtr writer);
+/*
+ * Stage that passes data through and writes request and response records
+ * when request is complete, in the thread that completes the request.
+ */
+
+// content-addressed store
+
+typedef enum {
+    CURL_STORE_HARDLINK = 0,  // names are hardlinks of objects, copies if not possible
+    CURL_STORE_REFLINK        // names are reflinks of objects, copies if not supported
+} CurlStoreLinkMode;
+
+typedef struct {
+    uint64_t objects_stored;  // new content
+    uint64_t objects_reused;  // content was already stored
+    uint64_t bytes_stored;
+    uint64_t bytes_reused;    // not stored again
+    uint64_t names_linked;
+    uint64_t index_hits;      // URLs found in the index
+
+} CurlStoreStats;
+
+extern UwTypeId UwTypeId_CurlStore;
+extern UwTypeId UwTypeId_CurlStoreSink;
+
+UwResult curl_store(UwValuePtr root, CurlDigestAlgorithm algorithm, CurlStoreLinkMode link_mode);
+/*
+ * Create store of content named by digest in root directory.
+ * The directory is created and its index is loaded on first use.
+ * Store can be shared by threads.
+ */
+bool curl_store_lookup(UwValuePtr store, UwValuePtr url, UwValuePtr digest, UwValuePtr name);
+/*
+ * Find URL in the index. If found and the content is still stored,
+ * assign digest and name strings and return true. digest and name must be null.
+ */
+bool curl_store_link(UwValuePtr store, UwValuePtr digest, UwValuePtr name);
+/*
+ * Make file name refer to stored content. Existing file is replaced.
+ */
+void curl_store_stats(UwValuePtr store, CurlStoreStats* stats);
+
+UwResult curl_store_sink(UwValuePtr store);
+/*
+ * Stage that consumes data, writes it to a staging file and hashes it,
+ * reusing request digest if it includes the algorithm of the store.
+ * When request is complete, the content is added to the store unless
+ * it is already there, linked to the name if set, and URL is added to the index.
+ */
+void curl_store_sink_set_name(UwValuePtr stage, UwValuePtr name);
+/*
+ * Set file name, can be called until request is complete.
+ */
+
+// digests
+bool     curl_digest_init(CurlDigest* digest, unsigned algorithms);
+void     curl_digest_update(CurlDigest* digest, void* data, size_t size);
+void     curl_digest_final(CurlDigest* digest);
+void     curl_digest_fini(CurlDigest* digest);
+unsigned curl_digest_size(CurlDigestAlgorithm algorithm);
+uint8_t* curl_digest_value(CurlDigest* digest, CurlDigestAlgorithm algorithm);
+UwResult curl_digest_hex(CurlDigest* digest, CurlDigestAlgorithm algorithm);
+
+// allocation accounting
+void curl_alloc_accounting_enable();
+/*
+ * Wrap default_allocator with counting methods.
+ * Must be called after init_allocator and before creating any values.
+ * The allocator must be thread-safe if completion workers are used.
+ */
+
+// allocator thread safety
+//
+// UW does not tell whether an allocator is thread-safe, so it is assumed it is not.
+// UW values must be created and destroyed in more than one thread only
+// when the allocator is declared thread-safe or serialized.
+// curl_session_start_workers refuses to start otherwise.
+
+void curl_alloc_declare_thread_safe();
+/*
+ * Declare that methods of default_allocator can be called concurrently.
+ */
+void curl_alloc_serialize();
+/*
+ * Wrap methods of default_allocator with a mutex, unless it is thread-safe already.
+ * Must be called while only one thread uses UW values.
+ */
+bool curl_alloc_thread_safe();
+void curl_alloc_global_stats(CurlAllocStats* stats);
+void curl_session_alloc_stats(UwValuePtr session, CurlAllocStats* stats);
+void curl_request_set_memory_budget(UwValuePtr request, uint64_t max_live_bytes);
+/*
+ * Abort transfer when memory attributed to the request exceeds the budget.
+ */
+void curl_print_alloc_stats(CurlAllocStats* stats, char* title, FILE* fp);
+
+// tracing
+void curl_trace_enable(bool enable);
+uint64_t curl_trace_now();
+bool curl_trace_dump(FILE* fp);
+/*
+ * Dump spans as Chrome trace event JSON, loadable by chrome://tracing or Perfetto.
+ */
 
 // utils
+
+typedef struct {
+    // Borrowed part of a buffer, not terminated.
+    char* ptr;
+    unsigned length;
+
+} CurlSlice;
+
+typedef struct {
+    // Parts of URL without delimiters, empty slices for missing ones.
+    CurlSlice scheme;
+    CurlSlice userinfo;
+    CurlSlice host;      // IPv6 address is kept in square brackets
+    CurlSlice port;
+    CurlSlice path;
+    CurlSlice basename;  // last segment of path
+    CurlSlice query;
+    CurlSlice fragment;
+
+} CurlUrlView;
+
+void curl_url_view(char* url, unsigned length, CurlUrlView* view);
+/*
+ * Split URL into slices of the original buffer. Nothing is allocated or validated.
+ */
+
+unsigned curl_percent_decode(CurlSlice src, char* dest, unsigned dest_size);
+/*
+ * Decode percent-encoded slice into caller's buffer and terminate it with zero.
+ * Return decoded length, truncated to dest_size - 1.
+ */
+
 UwResult urljoin_cstr(char* base_url, char* other_url);
 UwResult urljoin(UwValuePtr base_url, UwValuePtr other_url);
+UwResult urlorigin(UwValuePtr url);
 
 void curl_request_parse_content_type(CurlRequestData* req);
 void curl_request_parse_content_disposition(CurlRequestData* req);
@@ -0,0 +1,226 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Allocation accounting.
+ *
+ * Counting wrappers replace methods of default_allocator and forward calls
+ * to the original ones. Allocations are attributed to the request that is
+ * set as current for the calling thread, and to the session of that request.
+ * Memory released in a different scope is attributed to that scope,
+ * so per-request live bytes are approximate and can be negative.
+ */
+
+static UwAllocator base_allocator;
+static bool accounting_enabled = false;
+
+_Thread_local CurlRequestData* _curl_alloc_request = nullptr;
+
+static CurlAtomicAllocStats global_stats;
+
+static void update_peak(_Atomic int64_t* peak, int64_t live)
+{
+    int64_t current = atomic_load_explicit(peak, memory_order_relaxed);
+    while (live > current) {
+        if (atomic_compare_exchange_weak_explicit(peak, &current, live,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+static void account_atomic(CurlAtomicAllocStats* stats, int64_t nbytes)
+{
+    if (nbytes > 0) {
+        atomic_fetch_add_explicit(&stats->allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->allocated_bytes, nbytes, memory_order_relaxed);
+    }
+    int64_t live = atomic_fetch_add_explicit(&stats->live_bytes, nbytes, memory_order_relaxed) + nbytes;
+    update_peak(&stats->peak_bytes, live);
+}
+
+static void account(int64_t nbytes)
+{
+    account_atomic(&global_stats, nbytes);
+
+    CurlRequestData* req = _curl_alloc_request;
+    if (!req) {
+        return;
+    }
+    // request is accessed by one thread at a time, no atomics needed
+    if (nbytes > 0) {
+        req->alloc_stats.allocations++;
+        req->alloc_stats.allocated_bytes += nbytes;
+    }
+    req->alloc_stats.live_bytes += nbytes;
+    if (req->alloc_stats.live_bytes > req->alloc_stats.peak_bytes) {
+        req->alloc_stats.peak_bytes = req->alloc_stats.live_bytes;
+    }
+    if (req->session) {
+        account_atomic(&req->session->alloc_stats, nbytes);
+    }
+}
+
+static void* counting_allocate(unsigned nbytes, bool clean)
+{
+    void* result = base_allocator.allocate(nbytes, clean);
+    if (result) {
+        account(nbytes);
+    }
+    return result;
+}
+
+static bool counting_reallocate(void** addr_ptr, unsigned old_nbytes, unsigned new_nbytes,
+                                bool clean, unsigned* actual_nbytes)
+{
+    unsigned actual = new_nbytes;
+    bool result = base_allocator.reallocate(addr_ptr, old_nbytes, new_nbytes, clean, &actual);
+    if (result) {
+        account((int64_t) actual - (int64_t) old_nbytes);
+        if (actual_nbytes) {
+            *actual_nbytes = actual;
+        }
+    }
+    return result;
+}
+
+static void counting_release(void** addr_ptr, unsigned nbytes)
+{
+    if (*addr_ptr) {
+        account(-(int64_t) nbytes);
+    }
+    base_allocator.release(addr_ptr, nbytes);
+}
+
+void curl_alloc_accounting_enable()
+/*
+ * Wrap methods of default_allocator.
+ * Must be called after init_allocator and before creating any values.
+ */
+{
+    if (accounting_enabled) {
+        return;
+    }
+    base_allocator = default_allocator;
+    default_allocator.allocate   = counting_allocate;
+    default_allocator.reallocate = counting_reallocate;
+    default_allocator.release    = counting_release;
+    accounting_enabled = true;
+}
+
+/****************************************************************
+ * Thread safety
+ */
+
+static UwAllocator unlocked_allocator;
+static pthread_mutex_t allocator_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool allocator_thread_safe = false;
+
+static void* locked_allocate(unsigned nbytes, bool clean)
+{
+    pthread_mutex_lock(&allocator_lock);
+    void* result = unlocked_allocator.allocate(nbytes, clean);
+    pthread_mutex_unlock(&allocator_lock);
+    return result;
+}
+
+static bool locked_reallocate(void** addr_ptr, unsigned old_nbytes, unsigned new_nbytes,
+                              bool clean, unsigned* actual_nbytes)
+{
+    pthread_mutex_lock(&allocator_lock);
+    bool result = unlocked_allocator.reallocate(addr_ptr, old_nbytes, new_nbytes, clean, actual_nbytes);
+    pthread_mutex_unlock(&allocator_lock);
+    return result;
+}
+
+static void locked_release(void** addr_ptr, unsigned nbytes)
+{
+    pthread_mutex_lock(&allocator_lock);
+    unlocked_allocator.release(addr_ptr, nbytes);
+    pthread_mutex_unlock(&allocator_lock);
+}
+
+void curl_alloc_declare_thread_safe()
+{
+    allocator_thread_safe = true;
+}
+
+void curl_alloc_serialize()
+/*
+ * Counting wrappers can be installed before or after these,
+ * they update counters atomically either way.
+ */
+{
+    if (allocator_thread_safe) {
+        return;
+    }
+    unlocked_allocator = default_allocator;
+    default_allocator.allocate   = locked_allocate;
+    default_allocator.reallocate = locked_reallocate;
+    default_allocator.release    = locked_release;
+    allocator_thread_safe = true;
+}
+
+bool curl_alloc_thread_safe()
+{
+    return allocator_thread_safe;
+}
+
+static void load_stats(CurlAtomicAllocStats* src, CurlAllocStats* dest)
+{
+    dest->allocations     = atomic_load_explicit(&src->allocations,     memory_order_relaxed);
+    dest->allocated_bytes = atomic_load_explicit(&src->allocated_bytes, memory_order_relaxed);
+    dest->live_bytes      = atomic_load_explicit(&src->live_bytes,      memory_order_relaxed);
+    dest->peak_bytes      = atomic_load_explicit(&src->peak_bytes,      memory_order_relaxed);
+}
+
+void curl_alloc_global_stats(CurlAllocStats* stats)
+{
+    load_stats(&global_stats, stats);
+}
+
+void curl_session_alloc_stats(UwValuePtr session, CurlAllocStats* stats)
+{
+    load_stats(&uw_curl_session_data_ptr(session)->alloc_stats, stats);
+}
+
+void _curl_alloc_attach(CurlSessionData* session, CurlRequestData* req)
+/*
+ * Attach request to session. Memory held by request so far becomes session's live memory,
+ * so it is balanced when the request is released.
+ */
+{
+    req->session = session;
+    if (accounting_enabled && req->alloc_stats.live_bytes) {
+        account_atomic(&session->alloc_stats, req->alloc_stats.live_bytes);
+    }
+}
+
+void curl_request_set_memory_budget(UwValuePtr request, uint64_t max_live_bytes)
+{
+    uw_curl_request_data_ptr(request)->memory_budget = max_live_bytes;
+}
+
+bool _curl_check_memory_budget(CurlRequestData* req)
+{
+    if (req->alloc_stats.live_bytes > (int64_t) req->memory_budget) {
+        fprintf(stderr, "Request exceeded memory budget: %lld > %llu bytes\n",
+                (long long) req->alloc_stats.live_bytes, (unsigned long long) req->memory_budget);
+        return false;
+    }
+    return true;
+}
+
+void curl_print_alloc_stats(CurlAllocStats* stats, char* title, FILE* fp)
+{
+    fprintf(fp, "%s: %llu allocations, %llu bytes allocated, %lld live, %lld peak\n",
+            title,
+            (unsigned long long) stats->allocations,
+            (unsigned long long) stats->allocated_bytes,
+            (long long) stats->live_bytes,
+            (long long) stats->peak_bytes);
+}
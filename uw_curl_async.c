@@ -0,0 +1,176 @@
+#include <stdatomic.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Continuations and joins.
+ *
+ * Dependent transfers are chained by continuations instead of hand-written state machines:
+ * a continuation submits next requests, and a join waits for a group of them.
+ * Nothing blocks, so any number of such flows can run on a single loop.
+ */
+
+/****************************************************************
+ * Continuations
+ */
+
+bool curl_request_then(UwValuePtr request, CurlContinuation func, void* ctx)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    CurlThen* then = default_allocator.allocate(sizeof(CurlThen), true);
+    if (!then) {
+        return false;
+    }
+    then->func = func;
+    then->ctx = ctx;
+
+    // append to keep order
+    CurlThen** last = &req->continuations;
+    while (*last) {
+        last = &(*last)->next;
+    }
+    *last = then;
+    return true;
+}
+
+void _curl_run_continuations(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    // detach list first, continuations may add new ones to the same request
+    CurlThen* then = req->continuations;
+    req->continuations = nullptr;
+
+    while (then) {
+        then->func(request, req->result, then->ctx);
+        CurlThen* next = then->next;
+        default_allocator.release((void**) &then, sizeof(CurlThen));
+        then = next;
+    }
+}
+
+void _curl_free_continuations(CurlRequestData* req)
+{
+    CurlThen* then = req->continuations;
+    req->continuations = nullptr;
+
+    while (then) {
+        CurlThen* next = then->next;
+        default_allocator.release((void**) &then, sizeof(CurlThen));
+        then = next;
+    }
+}
+
+/****************************************************************
+ * Submitting
+ */
+
+bool curl_submit(UwValuePtr session, UwValuePtr request)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    req->next_submitted = nullptr;
+
+    pthread_mutex_lock(&sess->submit_lock);
+    if (sess->submitted_tail) {
+        sess->submitted_tail->next_submitted = req;
+    } else {
+        sess->submitted_head = req;
+    }
+    sess->submitted_tail = req;
+    pthread_mutex_unlock(&sess->submit_lock);
+
+    if (!pthread_equal(pthread_self(), sess->loop_thread)) {
+        // the loop may be waiting
+        curl_multi_wakeup(sess->multi_handle);
+    }
+    return true;
+}
+
+unsigned _curl_add_submitted(CurlSessionData* session)
+/*
+ * Called by loop thread to add submitted requests to multi handle.
+ * Return the number of added requests.
+ */
+{
+    unsigned n = 0;
+
+    pthread_mutex_lock(&session->submit_lock);
+    CurlRequestData* req = session->submitted_head;
+    session->submitted_head = nullptr;
+    session->submitted_tail = nullptr;
+    pthread_mutex_unlock(&session->submit_lock);
+
+    while (req) {
+        CurlRequestData* next = req->next_submitted;
+        req->next_submitted = nullptr;
+        if (_curl_add_easy_handle(session, req)) {
+            n++;
+        }
+        req = next;
+    }
+    return n;
+}
+
+/****************************************************************
+ * Joins
+ */
+
+struct CurlJoin {
+    _Atomic unsigned pending;  // added requests that are not done yet, plus one until sealed
+    _Atomic unsigned num_requests;
+    _Atomic unsigned num_failed;
+    CurlJoinFunc func;
+    void* ctx;
+};
+
+CurlJoin* curl_join_create(CurlJoinFunc func, void* ctx)
+{
+    CurlJoin* join = default_allocator.allocate(sizeof(CurlJoin), true);
+    if (!join) {
+        return nullptr;
+    }
+    atomic_init(&join->pending, 1);
+    atomic_init(&join->num_requests, 0);
+    atomic_init(&join->num_failed, 0);
+    join->func = func;
+    join->ctx = ctx;
+    return join;
+}
+
+static void join_release(CurlJoin* join)
+{
+    if (atomic_fetch_sub(&join->pending, 1) == 1) {
+        join->func(atomic_load(&join->num_requests), atomic_load(&join->num_failed), join->ctx);
+        default_allocator.release((void**) &join, sizeof(CurlJoin));
+    }
+}
+
+static void join_continuation(UwValuePtr request, CURLcode result, void* ctx)
+{
+    CurlJoin* join = ctx;
+    if (result != CURLE_OK) {
+        atomic_fetch_add(&join->num_failed, 1);
+    }
+    join_release(join);
+}
+
+bool curl_join_add(CurlJoin* join, UwValuePtr request)
+{
+    atomic_fetch_add(&join->pending, 1);
+    if (!curl_request_then(request, join_continuation, join)) {
+        atomic_fetch_sub(&join->pending, 1);
+        return false;
+    }
+    atomic_fetch_add(&join->num_requests, 1);
+    return true;
+}
+
+void curl_join_seal(CurlJoin* join)
+{
+    join_release(join);
+}
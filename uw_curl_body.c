@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Request bodies.
+ *
+ * Small bodies are passed to CURL as POSTFIELDS, without copying.
+ * Large files are mmap'd and streamed by read function,
+ * or read with pread if mmap is not possible.
+ * Pipes, sockets and devices have no size and cannot be read with pread,
+ * they are read sequentially and uploaded with chunked transfer encoding.
+ * Their descriptors are non-blocking: when no data is available the upload
+ * is paused and the loop thread resumes it when the descriptor becomes readable.
+ */
+
+static size_t read_stream(char* buffer, size_t n, CurlRequestData* req)
+{
+    CurlRequestBody* body = req->body;
+    for (;;) {
+        ssize_t bytes_read = read(body->fd, buffer, n);
+        if (bytes_read >= 0) {
+            body->pos += bytes_read;
+            return bytes_read;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            _curl_pause_upload(req);
+            return CURL_READFUNC_PAUSE;
+        }
+        if (errno != EINTR) {
+            perror(__func__);
+            return CURL_READFUNC_ABORT;
+        }
+    }
+}
+
+static size_t read_body(char* buffer, size_t size, size_t nitems, CurlRequestData* req)
+{
+    CurlRequestBody* body = req->body;
+    if (body->stream) {
+        return read_stream(buffer, size * nitems, req);
+    }
+    uint64_t remaining = body->size - body->pos;
+    size_t n = size * nitems;
+    if (n > remaining) {
+        n = remaining;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (body->data) {
+        memcpy(buffer, body->data + body->pos, n);
+    } else {
+        ssize_t bytes_read = pread(body->fd, buffer, n, body->pos);
+        if (bytes_read < 0) {
+            perror(__func__);
+            return CURL_READFUNC_ABORT;
+        }
+        n = bytes_read;
+    }
+    body->pos += n;
+    return n;
+}
+
+static int seek_body(CurlRequestBody* body, curl_off_t offset, int origin)
+/*
+ * CURL may rewind the body on redirects and authentication.
+ */
+{
+    if (body->stream) {
+        // CURL fails the request if it has to resend the body
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    curl_off_t pos;
+    switch (origin) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = body->pos + offset; break;
+        case SEEK_END: pos = body->size + offset; break;
+        default: return CURL_SEEKFUNC_CANTSEEK;
+    }
+    if (pos < 0 || (uint64_t) pos > body->size) {
+        return CURL_SEEKFUNC_FAIL;
+    }
+    body->pos = pos;
+    return CURL_SEEKFUNC_OK;
+}
+
+static CurlRequestBody* new_body(CurlRequestData* req)
+{
+    if (req->body) {
+        fprintf(stderr, "ERROR: request body is already set\n");
+        return nullptr;
+    }
+    req->body = default_allocator.allocate(sizeof(CurlRequestBody), true);
+    if (req->body) {
+        req->body->fd = -1;
+    }
+    return req->body;
+}
+
+void _curl_request_body_destroy(CurlRequestData* req)
+{
+    CurlRequestBody* body = req->body;
+    if (!body) {
+        return;
+    }
+    if (body->mapped) {
+        munmap(body->data, body->size);
+    }
+    if (body->own_fd && body->fd >= 0) {
+        close(body->fd);
+    }
+    default_allocator.release((void**) &req->body, sizeof(CurlRequestBody));
+}
+
+static void setup_upload(CurlRequestData* req, CurlUploadMethod method)
+{
+    CurlRequestBody* body = req->body;
+    CURL* easy_handle = req->easy_handle;
+
+    // -1 means unknown size, CURL uses chunked transfer encoding then
+    curl_off_t size = body->stream? -1 : (curl_off_t) body->size;
+
+    if (method == CURL_METHOD_POST && body->data && body->size <= CURL_BODY_POSTFIELDS_LIMIT) {
+        curl_easy_setopt(easy_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) body->size);
+        curl_easy_setopt(easy_handle, CURLOPT_POSTFIELDS, body->data);
+        return;
+    }
+    curl_easy_setopt(easy_handle, CURLOPT_READFUNCTION, read_body);
+    curl_easy_setopt(easy_handle, CURLOPT_READDATA, req);
+    curl_easy_setopt(easy_handle, CURLOPT_SEEKFUNCTION, seek_body);
+    curl_easy_setopt(easy_handle, CURLOPT_SEEKDATA, body);
+
+    if (method == CURL_METHOD_POST) {
+        curl_easy_setopt(easy_handle, CURLOPT_POST, 1L);
+        curl_easy_setopt(easy_handle, CURLOPT_POSTFIELDSIZE_LARGE, size);
+    } else {
+        curl_easy_setopt(easy_handle, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(easy_handle, CURLOPT_INFILESIZE_LARGE, size);
+    }
+}
+
+bool curl_request_set_form(UwValuePtr request, char* form_data[], unsigned num_items)
+/*
+ * form_data contains names and values, num_items must be even.
+ * The form is urlencoded and copied by CURL.
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    UwValue post_data = UwString();
+    if (uw_error(&post_data)) {
+        return false;
+    }
+    for (unsigned i = 0; i + 1 < num_items; i += 2) {
+        char* name = curl_easy_escape(req->easy_handle, form_data[i], 0);
+        char* value = curl_easy_escape(req->easy_handle, form_data[i + 1], 0);
+        bool ok = name && value;
+        if (ok && i) {
+            ok = uw_string_append(&post_data, "&");
+        }
+        if (ok) {
+            ok = uw_string_append(&post_data, name)
+                 && uw_string_append(&post_data, "=")
+                 && uw_string_append(&post_data, value);
+        }
+        curl_free(name);
+        curl_free(value);
+        if (!ok) {
+            return false;
+        }
+    }
+    UW_CSTRING_LOCAL(post_data_cstr, &post_data);
+    curl_easy_setopt(req->easy_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) strlen(post_data_cstr));
+    curl_easy_setopt(req->easy_handle, CURLOPT_COPYPOSTFIELDS, post_data_cstr);
+    return true;
+}
+
+bool curl_request_set_body(UwValuePtr request, CurlUploadMethod method, void* data, size_t size)
+/*
+ * The buffer is not copied and must be valid until the request is complete.
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    CurlRequestBody* body = new_body(req);
+    if (!body) {
+        return false;
+    }
+    body->data = data;
+    body->size = size;
+    setup_upload(req, method);
+    return true;
+}
+
+bool curl_request_set_body_fd(UwValuePtr request, CurlUploadMethod method, int fd, uint64_t size)
+/*
+ * Upload size bytes from file descriptor, using pread.
+ * The descriptor is not closed by request.
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    CurlRequestBody* body = new_body(req);
+    if (!body) {
+        return false;
+    }
+    body->fd = fd;
+    body->size = size;
+    setup_upload(req, method);
+    return true;
+}
+
+bool curl_request_set_body_file(UwValuePtr request, CurlUploadMethod method, UwValuePtr filename)
+/*
+ * Upload file. Regular files are mmap'd, or read with pread if mmap fails.
+ * Other files, e.g. pipes, are read until EOF and sent with chunked encoding.
+ * They are opened in blocking mode, so opening a FIFO waits for the writer,
+ * then switched to non-blocking reads.
+ */
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    UW_CSTRING_LOCAL(filename_cstr, filename);
+    int fd = open(filename_cstr, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(filename_cstr);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(filename_cstr);
+        close(fd);
+        return false;
+    }
+    CurlRequestBody* body = new_body(req);
+    if (!body) {
+        close(fd);
+        return false;
+    }
+    body->fd = fd;
+    body->own_fd = true;
+
+    if (!S_ISREG(st.st_mode)) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror(filename_cstr);
+            _curl_request_body_destroy(req);
+            return false;
+        }
+        body->stream = true;
+    } else {
+        body->size = st.st_size;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            body->data = map;
+            body->mapped = true;
+        }
+    }
+    setup_upload(req, method);
+    return true;
+}
@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <uw.h>
+
+#include "uw_curl.h"
+
+/*
+ * Content buffer.
+ *
+ * Small content is kept in memory. When it grows above the threshold,
+ * it is written to an unlinked temporary file and the memory is released,
+ * so a huge response costs disk space instead of process memory.
+ * Temporary files are created in TMPDIR, or /tmp if not set.
+ */
+
+void curl_buffer_init(CurlBuffer* buffer, size_t spill_threshold)
+{
+    memset(buffer, 0, sizeof(CurlBuffer));
+    buffer->fd = -1;
+    curl_buffer_set_spill_threshold(buffer, spill_threshold);
+}
+
+void curl_buffer_set_spill_threshold(CurlBuffer* buffer, size_t spill_threshold)
+{
+    if (spill_threshold == 0) {
+        spill_threshold = CURL_BUFFER_SPILL_THRESHOLD;
+    } else if (spill_threshold > CURL_BUFFER_MAX_SPILL_THRESHOLD) {
+        spill_threshold = CURL_BUFFER_MAX_SPILL_THRESHOLD;
+    }
+    buffer->spill_threshold = spill_threshold;
+}
+
+static void unmap_view(CurlBuffer* buffer)
+{
+    if (buffer->view) {
+        munmap(buffer->view, buffer->view_size);
+        buffer->view = nullptr;
+        buffer->view_size = 0;
+    }
+}
+
+void curl_buffer_fini(CurlBuffer* buffer)
+{
+    unmap_view(buffer);
+    if (buffer->data) {
+        default_allocator.release((void**) &buffer->data, buffer->capacity);
+    }
+    if (buffer->fd >= 0) {
+        close(buffer->fd);
+        buffer->fd = -1;
+    }
+    buffer->capacity = 0;
+    buffer->size = 0;
+}
+
+static int create_temp_file()
+{
+    char* tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir) {
+        tmpdir = "/tmp";
+    }
+    int fd;
+#ifdef O_TMPFILE
+    fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    // fallback for file systems without O_TMPFILE
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/uw-curl-XXXXXX", tmpdir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static bool write_all(int fd, uint8_t* data, size_t size)
+{
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(__func__);
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool spill(CurlBuffer* buffer)
+/*
+ * Move content to temporary file.
+ */
+{
+    int fd = create_temp_file();
+    if (fd < 0) {
+        return false;
+    }
+    if (buffer->size && !write_all(fd, buffer->data, buffer->size)) {
+        close(fd);
+        return false;
+    }
+    if (buffer->data) {
+        default_allocator.release((void**) &buffer->data, buffer->capacity);
+    }
+    buffer->capacity = 0;
+    buffer->fd = fd;
+    return true;
+}
+
+static bool grow(CurlBuffer* buffer, size_t new_capacity)
+{
+    if (buffer->data) {
+        if (!default_allocator.reallocate((void**) &buffer->data, buffer->capacity, new_capacity, false, nullptr)) {
+            return false;
+        }
+    } else {
+        buffer->data = default_allocator.allocate(new_capacity, false);
+        if (!buffer->data) {
+            return false;
+        }
+    }
+    buffer->capacity = new_capacity;
+    return true;
+}
+
+bool curl_buffer_reserve(CurlBuffer* buffer, size_t size)
+{
+    if (curl_buffer_spilled(buffer) || size <= buffer->capacity) {
+        return true;
+    }
+    if (size > buffer->spill_threshold) {
+        return spill(buffer);
+    }
+    return grow(buffer, size);
+}
+
+bool curl_buffer_append(CurlBuffer* buffer, void* data, size_t size)
+{
+    if (size == 0) {
+        return true;
+    }
+    if (!curl_buffer_spilled(buffer)) {
+        size_t new_size = buffer->size + size;
+        if (new_size > buffer->spill_threshold) {
+            if (!spill(buffer)) {
+                return false;
+            }
+        } else {
+            if (new_size > buffer->capacity) {
+                // double capacity, but do not exceed threshold
+                size_t new_capacity = buffer->capacity? buffer->capacity * 2 : 4096;
+                while (new_capacity < new_size) {
+                    new_capacity *= 2;
+                }
+                if (new_capacity > buffer->spill_threshold) {
+                    new_capacity = buffer->spill_threshold;
+                }
+                if (!grow(buffer, new_capacity)) {
+                    return false;
+                }
+            }
+            memcpy(buffer->data + buffer->size, data, size);
+            buffer->size = new_size;
+            return true;
+        }
+    }
+    if (!write_all(buffer->fd, data, size)) {
+        return false;
+    }
+    buffer->size += size;
+    return true;
+}
+
+bool curl_buffer_view(CurlBuffer* buffer, uint8_t** data, size_t* size)
+{
+    *size = buffer->size;
+    if (!curl_buffer_spilled(buffer) || buffer->size == 0) {
+        *data = buffer->data;
+        return true;
+    }
+    if (buffer->view && buffer->view_size == buffer->size) {
+        *data = buffer->view;
+        return true;
+    }
+    unmap_view(buffer);
+    void* map = mmap(nullptr, buffer->size, PROT_READ, MAP_SHARED, buffer->fd, 0);
+    if (map == MAP_FAILED) {
+        perror(__func__);
+        *data = nullptr;
+        return false;
+    }
+    buffer->view = map;
+    buffer->view_size = buffer->size;
+    *data = map;
+    return true;
+}
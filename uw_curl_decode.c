@@ -0,0 +1,573 @@
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <tmmintrin.h>
+#   define UW_CURL_SSSE3_UTF8
+#endif
+
+#include <uw.h>
+
+#include "uw_curl.h"
+
+/*
+ * Content decoding.
+ *
+ * ASCII runs are detected 16 bytes at a time with SSE2, or 8 bytes at a time
+ * without it, and appended in one call. Only non-ASCII characters are decoded one by one.
+ *
+ * One-shot UTF-8 decoding makes two passes: the first one validates content,
+ * counts chars and finds the widest one, the second one converts content
+ * to the string of exact size. On CPUs with SSSE3 the first pass is vectorized,
+ * using the lookup algorithm of Keiser and Lemire, "Validating UTF-8 in less
+ * than one instruction per byte". Malformed content is measured by scalar code
+ * because replacement chars make the count depend on where sequences break.
+ */
+
+#define REPLACEMENT_CHAR  0xFFFD
+
+// windows-1252 characters 0x80..0x9F, undefined ones are mapped as in ISO-8859-1
+static char32_t cp1252_table[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+static size_t ascii_prefix(uint8_t* data, size_t size)
+/*
+ * Return the length of ASCII run at the beginning of data.
+ */
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i*) (data + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+    while (i < size && data[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+static unsigned decode_utf8_char(uint8_t* data, size_t size, char32_t* chr)
+/*
+ * Decode non-ASCII UTF-8 sequence.
+ * Return the number of bytes consumed, or 0 if sequence is valid so far but incomplete.
+ * Malformed sequence is decoded as replacement char.
+ */
+{
+    uint8_t c = data[0];
+    unsigned length;
+    uint8_t lower = 0x80;
+    uint8_t upper = 0xBF;
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        length = 2;
+        *chr = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        length = 3;
+        *chr = c & 0x0F;
+        if (c == 0xE0) {
+            lower = 0xA0;  // overlong
+        } else if (c == 0xED) {
+            upper = 0x9F;  // surrogates
+        }
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        length = 4;
+        *chr = c & 0x07;
+        if (c == 0xF0) {
+            lower = 0x90;  // overlong
+        } else if (c == 0xF4) {
+            upper = 0x8F;  // above U+10FFFF
+        }
+    } else {
+        *chr = REPLACEMENT_CHAR;
+        return 1;
+    }
+    for (unsigned i = 1; i < length; i++) {
+        if (i == size) {
+            return 0;
+        }
+        uint8_t b = data[i];
+        if (b < lower || b > upper) {
+            *chr = REPLACEMENT_CHAR;
+            return i;
+        }
+        lower = 0x80;
+        upper = 0xBF;
+        *chr = (*chr << 6) | (b & 0x3F);
+    }
+    return length;
+}
+
+static uint8_t char_size_of(char32_t max_char)
+{
+    if (max_char < 0x100) {
+        return 1;
+    } else if (max_char < 0x10000) {
+        return 2;
+    } else if (max_char < 0x1000000) {
+        return 3;
+    } else {
+        return 4;
+    }
+}
+
+static bool append_utf8(UwValuePtr text, uint8_t* data, size_t size, size_t* bytes_consumed)
+/*
+ * Append UTF-8 data to text, leaving incomplete sequence at the end.
+ */
+{
+    size_t i = 0;
+    while (i < size) {
+        size_t run = ascii_prefix(data + i, size - i);
+        if (run) {
+            if (!uw_string_append_substring(text, (char*) data + i, 0, run)) {
+                return false;
+            }
+            i += run;
+            if (i == size) {
+                break;
+            }
+        }
+        char32_t chr;
+        unsigned n = decode_utf8_char(data + i, size - i, &chr);
+        if (n == 0) {
+            break;
+        }
+        if (!uw_string_append(text, chr)) {
+            return false;
+        }
+        i += n;
+    }
+    *bytes_consumed = i;
+    return true;
+}
+
+static bool append_cp1252(UwValuePtr text, uint8_t* data, size_t size)
+{
+    size_t i = 0;
+    while (i < size) {
+        size_t run = ascii_prefix(data + i, size - i);
+        if (run) {
+            if (!uw_string_append_substring(text, (char*) data + i, 0, run)) {
+                return false;
+            }
+            i += run;
+            if (i == size) {
+                break;
+            }
+        }
+        uint8_t c = data[i++];
+        char32_t chr = (c < 0xA0)? cp1252_table[c - 0x80] : c;
+        if (!uw_string_append(text, chr)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool curl_charset_from_name(UwValuePtr name, CurlCharset* charset)
+{
+    if (!uw_is_string(name) || uw_strlen(name) == 0) {
+        *charset = CURL_CHARSET_UTF8;
+        return true;
+    }
+    UW_CSTRING_LOCAL(name_cstr, name);
+    if (strcasecmp(name_cstr, "utf-8") == 0
+        || strcasecmp(name_cstr, "utf8") == 0
+        || strcasecmp(name_cstr, "us-ascii") == 0) {
+        *charset = CURL_CHARSET_UTF8;
+    } else if (strcasecmp(name_cstr, "iso-8859-1") == 0
+               || strcasecmp(name_cstr, "latin1") == 0) {
+        *charset = CURL_CHARSET_LATIN1;
+    } else if (strcasecmp(name_cstr, "windows-1252") == 0
+               || strcasecmp(name_cstr, "cp1252") == 0) {
+        *charset = CURL_CHARSET_CP1252;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/****************************************************************
+ * Incremental decoding
+ */
+
+bool curl_decoder_init(CurlDecoder* decoder, CurlCharset charset, size_t size_hint)
+{
+    decoder->charset = charset;
+    decoder->partial_size = 0;
+    decoder->text = uw_create_empty_string(size_hint, 1);
+    return !uw_error(&decoder->text);
+}
+
+void curl_decoder_fini(CurlDecoder* decoder)
+{
+    uw_destroy(&decoder->text);
+    decoder->partial_size = 0;
+}
+
+bool curl_decoder_update(CurlDecoder* decoder, uint8_t* data, size_t size)
+{
+    switch (decoder->charset) {
+        case CURL_CHARSET_LATIN1:
+            // bytes are code points, the string never gets wider than 1 byte
+            return uw_string_append_buffer(&decoder->text, data, size);
+
+        case CURL_CHARSET_CP1252:
+            return append_cp1252(&decoder->text, data, size);
+
+        default:
+            break;
+    }
+
+    if (decoder->partial_size) {
+        // complete sequence left from previous chunk
+        uint8_t buf[8];
+        unsigned old_size = decoder->partial_size;
+        unsigned extra = (size < 4)? size : 4;
+        memcpy(buf, decoder->partial, old_size);
+        memcpy(buf + old_size, data, extra);
+        unsigned total = old_size + extra;
+        unsigned pos = 0;
+        while (pos < old_size) {
+            char32_t chr;
+            unsigned n = decode_utf8_char(buf + pos, total - pos, &chr);
+            if (n == 0) {
+                // still incomplete, the whole chunk is consumed
+                decoder->partial_size = total - pos;
+                memcpy(decoder->partial, buf + pos, decoder->partial_size);
+                return true;
+            }
+            if (!uw_string_append(&decoder->text, chr)) {
+                return false;
+            }
+            pos += n;
+        }
+        data += pos - old_size;
+        size -= pos - old_size;
+        decoder->partial_size = 0;
+    }
+
+    size_t consumed;
+    if (!append_utf8(&decoder->text, data, size, &consumed)) {
+        return false;
+    }
+    // keep incomplete sequence, it's never longer than 3 bytes
+    decoder->partial_size = size - consumed;
+    memcpy(decoder->partial, data + consumed, decoder->partial_size);
+    return true;
+}
+
+UwResult curl_decoder_finish(CurlDecoder* decoder)
+{
+    if (decoder->partial_size) {
+        // truncated sequence
+        decoder->partial_size = 0;
+        if (!uw_string_append(&decoder->text, (char32_t) REPLACEMENT_CHAR)) {
+            return UwOOM();
+        }
+    }
+    UwValue text = uw_move(&decoder->text);
+    decoder->text = UwString();
+    return uw_move(&text);
+}
+
+/****************************************************************
+ * One-shot decoding
+ */
+
+static void measure_utf8_scalar(uint8_t* data, size_t size, size_t* result_num_chars, char32_t* result_max_char)
+/*
+ * Count chars and find the widest one, malformed sequences count as replacement chars.
+ */
+{
+    size_t num_chars = 0;
+    char32_t max_char = 0;
+    size_t i = 0;
+    while (i < size) {
+        size_t run = ascii_prefix(data + i, size - i);
+        num_chars += run;
+        i += run;
+        if (i == size) {
+            break;
+        }
+        char32_t chr;
+        unsigned n = decode_utf8_char(data + i, size - i, &chr);
+        if (n == 0) {
+            // truncated at the end
+            chr = REPLACEMENT_CHAR;
+            n = size - i;
+        }
+        if (chr > max_char) {
+            max_char = chr;
+        }
+        num_chars++;
+        i += n;
+    }
+    *result_num_chars = num_chars;
+    *result_max_char = max_char;
+}
+
+#ifdef UW_CURL_SSSE3_UTF8
+
+// error bits of the lookup tables, each is set when a pair of bytes matches the pattern
+#define TOO_SHORT   (1 << 0)  // 11______ 0_______ or 11______ 11______
+#define TOO_LONG    (1 << 1)  // 0_______ 10______
+#define OVERLONG_3  (1 << 2)  // 11100000 100_____
+#define TOO_LARGE   (1 << 3)  // 11110100 1001____ or 11110100 101_____ or 11110101..11111111
+#define SURROGATE   (1 << 4)  // 11101101 101_____
+#define OVERLONG_2  (1 << 5)  // 1100000_ 10______
+#define TOO_LARGE_1000  (1 << 6)  // 11110101..11111111 1000____
+#define OVERLONG_4  (1 << 6)  // 11110000 1000____
+#define TWO_CONTS   (1 << 7)  // 10______ 10______, valid only if 3rd or 4th byte
+#define CARRY       (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+[[ gnu::target("ssse3") ]]
+static inline __m128i prev_bytes(__m128i input, __m128i prev_input, int n)
+{
+    switch (n) {
+        case 1:  return _mm_alignr_epi8(input, prev_input, 15);
+        case 2:  return _mm_alignr_epi8(input, prev_input, 14);
+        default: return _mm_alignr_epi8(input, prev_input, 13);
+    }
+}
+
+[[ gnu::target("ssse3") ]]
+static inline __m128i check_block(__m128i input, __m128i prev_input)
+/*
+ * Return nonzero bytes where the block has errors, given the previous block.
+ */
+{
+    __m128i low_nibble = _mm_set1_epi8(0x0F);
+
+    __m128i prev1 = prev_bytes(input, prev_input, 1);
+    __m128i byte_1_high = _mm_shuffle_epi8(
+        _mm_setr_epi8(
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+        ),
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble)
+    );
+    __m128i byte_1_low = _mm_shuffle_epi8(
+        _mm_setr_epi8(
+            CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+            CARRY | OVERLONG_2,
+            CARRY,
+            CARRY,
+            CARRY | TOO_LARGE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000
+        ),
+        _mm_and_si128(prev1, low_nibble)
+    );
+    __m128i byte_2_high = _mm_shuffle_epi8(
+        _mm_setr_epi8(
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+        ),
+        _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble)
+    );
+    __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // two continuations are valid only as 3rd or 4th byte of a sequence
+    __m128i is_third_byte  = _mm_subs_epu8(prev_bytes(input, prev_input, 2), _mm_set1_epi8((char) (0xE0 - 0x80)));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev_bytes(input, prev_input, 3), _mm_set1_epi8((char) (0xF0 - 0x80)));
+    __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8((char) 0x80));
+
+    return _mm_xor_si128(must_be_continuation, special_cases);
+}
+
+[[ gnu::target("ssse3") ]]
+static bool measure_utf8_ssse3(uint8_t* data, size_t size, size_t* result_num_chars, char32_t* result_max_char)
+/*
+ * Validate, count chars and find max byte in one pass.
+ * Return false if content is malformed, result is not set then.
+ */
+{
+    // bytes that start sequences longer than the rest of block
+    __m128i incomplete_limit = _mm_setr_epi8(
+        (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF,
+        (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF,
+        (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1)
+    );
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i max_byte = _mm_setzero_si128();
+    __m128i cont_limit = _mm_set1_epi8((char) 0xC0);  // continuation bytes are less than this as signed
+    size_t num_continuations = 0;
+
+    size_t i = 0;
+    uint8_t tail[16];
+    for (;;) {
+        __m128i input;
+        if (i + 16 <= size) {
+            input = _mm_loadu_si128((__m128i*) (data + i));
+        } else if (i < size) {
+            // pad the last block with zeros, they are ASCII and counted out below
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, data + i, size - i);
+            input = _mm_loadu_si128((__m128i*) tail);
+        } else {
+            break;
+        }
+        if (_mm_movemask_epi8(input) == 0) {
+            // ASCII block is valid unless the previous one ends with incomplete sequence
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        } else {
+            error = _mm_or_si128(error, check_block(input, prev_input));
+            prev_incomplete = _mm_subs_epu8(input, incomplete_limit);
+            max_byte = _mm_max_epu8(max_byte, input);
+            num_continuations += __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(input, cont_limit)));
+        }
+        prev_input = input;
+        i += 16;
+    }
+    // content must not end with incomplete sequence
+    error = _mm_or_si128(error, prev_incomplete);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+        return false;
+    }
+    *result_num_chars = size - num_continuations;
+
+    // valid sequences starting with C2..C3 encode chars below U+100,
+    // C4..EF below U+10000, F0..F4 above
+    uint8_t bytes[16];
+    _mm_storeu_si128((__m128i*) bytes, max_byte);
+    uint8_t max = 0;
+    for (unsigned j = 0; j < 16; j++) {
+        if (bytes[j] > max) {
+            max = bytes[j];
+        }
+    }
+    if (max < 0x80) {
+        *result_max_char = 0;
+    } else if (max < 0xC4) {
+        *result_max_char = 0xFF;
+    } else if (max < 0xF0) {
+        *result_max_char = 0xFFFF;
+    } else {
+        *result_max_char = 0x10FFFF;
+    }
+    return true;
+}
+
+#endif
+
+static void measure_utf8(uint8_t* data, size_t size, size_t* num_chars, char32_t* max_char)
+{
+#ifdef UW_CURL_SSSE3_UTF8
+    if (__builtin_cpu_supports("ssse3") && measure_utf8_ssse3(data, size, num_chars, max_char)) {
+        return;
+    }
+#endif
+    measure_utf8_scalar(data, size, num_chars, max_char);
+}
+
+static UwResult decode_utf8(uint8_t* data, size_t size)
+{
+    size_t num_chars;
+    char32_t max_char;
+    measure_utf8(data, size, &num_chars, &max_char);
+
+    UwValue text = uw_create_empty_string(num_chars, char_size_of(max_char));
+    uw_return_if_error(&text);
+
+    if (max_char == 0) {
+        // pure ASCII
+        if (!uw_string_append_buffer(&text, data, size)) {
+            return UwOOM();
+        }
+        return uw_move(&text);
+    }
+
+    // convert, the string has the final char size and capacity, so it's never reallocated
+
+    size_t consumed;
+    if (!append_utf8(&text, data, size, &consumed)) {
+        return UwOOM();
+    }
+    if (consumed < size) {
+        if (!uw_string_append(&text, (char32_t) REPLACEMENT_CHAR)) {
+            return UwOOM();
+        }
+    }
+    return uw_move(&text);
+}
+
+UwResult curl_decode(uint8_t* data, size_t size, CurlCharset charset)
+{
+    if (charset == CURL_CHARSET_UTF8) {
+        return decode_utf8(data, size);
+    }
+    CurlDecoder decoder;
+    if (!curl_decoder_init(&decoder, charset, size)) {
+        return UwOOM();
+    }
+    if (!curl_decoder_update(&decoder, data, size)) {
+        curl_decoder_fini(&decoder);
+        return UwOOM();
+    }
+    UwValue text = curl_decoder_finish(&decoder);
+    curl_decoder_fini(&decoder);
+    return uw_move(&text);
+}
+
+UwResult curl_request_decode_content(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    CurlCharset charset = CURL_CHARSET_UTF8;
+    if (uw_is_map(&req->media_type_params)) {
+        UwValue name = uw_map_get(&req->media_type_params, "charset");
+        if (!curl_charset_from_name(&name, &charset)) {
+            return UwNull();
+        }
+    }
+    if (!curl_request_decode_encoding(request)) {
+        return UwNull();
+    }
+    uint8_t* data;
+    size_t size;
+    if (!curl_request_content(request, &data, &size)) {
+        return UwOOM();  // XXX no suitable error code
+    }
+    return curl_decode(data, size, charset);
+}
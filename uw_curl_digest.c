@@ -0,0 +1,228 @@
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#if __has_include(<xxhash.h>)
+#   include <xxhash.h>
+#   define UW_CURL_HAVE_XXHASH
+#endif
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Incremental digests.
+ *
+ * SHA-256 is computed with OpenSSL EVP which picks SHA-NI/AVX2 code at runtime.
+ * XXH3 comes from libxxhash, its vectorized variant depends on how the library was built.
+ */
+
+unsigned curl_digest_size(CurlDigestAlgorithm algorithm)
+{
+    switch (algorithm) {
+        case CURL_DIGEST_XXH3:   return 8;
+        case CURL_DIGEST_SHA256: return 32;
+        default: return 0;
+    }
+}
+
+bool curl_digest_init(CurlDigest* digest, unsigned algorithms)
+{
+    digest->algorithms = algorithms;
+    digest->size = 0;
+    digest->finalized = false;
+
+    if (algorithms & CURL_DIGEST_XXH3) {
+#       ifdef UW_CURL_HAVE_XXHASH
+            XXH3_state_t* state = XXH3_createState();
+            if (!state) {
+                return false;
+            }
+            XXH3_64bits_reset(state);
+            digest->xxh3_state = state;
+#       else
+            fprintf(stderr, "ERROR %s: built without xxHash\n", __func__);
+            return false;
+#       endif
+    }
+    if (algorithms & CURL_DIGEST_SHA256) {
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        if (!ctx) {
+            curl_digest_fini(digest);
+            return false;
+        }
+        if (!EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) {
+            EVP_MD_CTX_free(ctx);
+            curl_digest_fini(digest);
+            return false;
+        }
+        digest->sha256_ctx = ctx;
+    }
+    return true;
+}
+
+void curl_digest_update(CurlDigest* digest, void* data, size_t size)
+{
+#   ifdef UW_CURL_HAVE_XXHASH
+        if (digest->xxh3_state) {
+            XXH3_64bits_update(digest->xxh3_state, data, size);
+        }
+#   endif
+    if (digest->sha256_ctx) {
+        EVP_DigestUpdate(digest->sha256_ctx, data, size);
+    }
+    digest->size += size;
+}
+
+void curl_digest_final(CurlDigest* digest)
+{
+    if (digest->finalized) {
+        return;
+    }
+#   ifdef UW_CURL_HAVE_XXHASH
+        if (digest->xxh3_state) {
+            XXH64_canonical_t canonical;
+            XXH64_canonicalFromHash(&canonical, XXH3_64bits_digest(digest->xxh3_state));
+            memcpy(digest->xxh3, canonical.digest, sizeof(digest->xxh3));
+        }
+#   endif
+    if (digest->sha256_ctx) {
+        EVP_DigestFinal_ex(digest->sha256_ctx, digest->sha256, nullptr);
+    }
+    digest->finalized = true;
+
+    // verify
+    if (digest->has_expected_size && digest->size != digest->expected_size) {
+        digest->mismatch = true;
+    }
+    if (digest->expected_algorithm) {
+        uint8_t* value = curl_digest_value(digest, digest->expected_algorithm);
+        if (memcmp(value, digest->expected, curl_digest_size(digest->expected_algorithm)) != 0) {
+            digest->mismatch = true;
+        }
+    }
+}
+
+void curl_digest_fini(CurlDigest* digest)
+{
+#   ifdef UW_CURL_HAVE_XXHASH
+        if (digest->xxh3_state) {
+            XXH3_freeState(digest->xxh3_state);
+        }
+#   endif
+    digest->xxh3_state = nullptr;
+
+    if (digest->sha256_ctx) {
+        EVP_MD_CTX_free(digest->sha256_ctx);
+        digest->sha256_ctx = nullptr;
+    }
+}
+
+uint8_t* curl_digest_value(CurlDigest* digest, CurlDigestAlgorithm algorithm)
+{
+    switch (algorithm) {
+        case CURL_DIGEST_XXH3:   return digest->xxh3;
+        case CURL_DIGEST_SHA256: return digest->sha256;
+        default: return nullptr;
+    }
+}
+
+UwResult curl_digest_hex(CurlDigest* digest, CurlDigestAlgorithm algorithm)
+/*
+ * Return digest as hex string or null value if the digest is not calculated.
+ */
+{
+    static char hex_digits[] = "0123456789abcdef";
+
+    if (!(digest->finalized && (digest->algorithms & algorithm))) {
+        return UwNull();
+    }
+    uint8_t* value = curl_digest_value(digest, algorithm);
+    unsigned n = curl_digest_size(algorithm);
+
+    char hex[CURL_DIGEST_MAX_SIZE * 2 + 1];
+    for (unsigned i = 0; i < n; i++) {
+        hex[i * 2]     = hex_digits[value[i] >> 4];
+        hex[i * 2 + 1] = hex_digits[value[i] & 15];
+    }
+    hex[n * 2] = 0;
+    return uw_create_string(hex);
+}
+
+/****************************************************************
+ * Request digests
+ */
+
+bool curl_request_enable_digest(UwValuePtr request, unsigned algorithms)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    if (req->digest) {
+        // already enabled
+        return (req->digest->algorithms & algorithms) == algorithms;
+    }
+    req->digest = default_allocator.allocate(sizeof(CurlDigest), true);
+    if (!req->digest) {
+        return false;
+    }
+    if (!curl_digest_init(req->digest, algorithms)) {
+        default_allocator.release((void**) &req->digest, sizeof(CurlDigest));
+        return false;
+    }
+    return true;
+}
+
+bool curl_request_expect_digest(UwValuePtr request, CurlDigestAlgorithm algorithm,
+                                uint8_t* expected_digest, int64_t expected_size)
+{
+    if (!curl_request_enable_digest(request, expected_digest? algorithm : 0)) {
+        return false;
+    }
+    CurlDigest* digest = uw_curl_request_data_ptr(request)->digest;
+
+    if (expected_digest) {
+        digest->expected_algorithm = algorithm;
+        memcpy(digest->expected, expected_digest, curl_digest_size(algorithm));
+    }
+    if (expected_size >= 0) {
+        digest->has_expected_size = true;
+        digest->expected_size = expected_size;
+    }
+    return true;
+}
+
+bool _curl_request_check_digest_size(CurlRequestData* req, size_t size)
+/*
+ * Called by write callback before passing data to the consumer.
+ * Return false if the content does not fit expected size.
+ */
+{
+    CurlDigest* digest = req->digest;
+
+    if (!digest->has_expected_size) {
+        return true;
+    }
+    if (digest->size == 0) {
+        // check Content-Length on first chunk, only if content is not decoded by CURL
+        // because decoded size is what is hashed then
+        struct curl_header* hdr;
+        if (req->decode_mode != CURL_DECODE_INLINE
+            || curl_easy_header(req->easy_handle, "Content-Encoding", 0, CURLH_HEADER, -1, &hdr) != CURLHE_OK) {
+            curl_off_t content_length;
+            CURLcode res = curl_easy_getinfo(req->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+            if (res == CURLE_OK && content_length >= 0 && (uint64_t) content_length != digest->expected_size) {
+                fprintf(stderr, "Content-Length %lld does not match expected size %llu\n",
+                        (long long) content_length, (unsigned long long) digest->expected_size);
+                digest->mismatch = true;
+                return false;
+            }
+        }
+    }
+    if (digest->size + size > digest->expected_size) {
+        fprintf(stderr, "Content exceeds expected size %llu\n", (unsigned long long) digest->expected_size);
+        digest->mismatch = true;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,293 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+
+#if __has_include(<zstd.h>)
+#   include <zstd.h>
+#   define UW_CURL_HAVE_ZSTD
+#endif
+
+#if __has_include(<brotli/decode.h>)
+#   include <brotli/decode.h>
+#   define UW_CURL_HAVE_BROTLI
+#endif
+
+#include <uw.h>
+
+#include "uw_curl.h"
+
+/*
+ * Content-Encoding.
+ *
+ * By default CURL decodes content in the loop thread. When decoding is turned off
+ * with curl_request_set_decode_mode, content is received as sent by the server
+ * and decoded here, either before complete in CURL_DECODE_DEFERRED mode,
+ * or on demand in CURL_DECODE_NONE mode.
+ *
+ * Content is complete at that point, so decoders run over contiguous view
+ * of the buffer and append output in chunks of OUT_CHUNK_SIZE.
+ */
+
+#define OUT_CHUNK_SIZE  (64 * 1024)
+
+static char* encoding_names[] = {
+    [CURL_ENCODING_IDENTITY] = "identity",
+    [CURL_ENCODING_GZIP]     = "gzip",
+    [CURL_ENCODING_DEFLATE]  = "deflate",
+    [CURL_ENCODING_BR]       = "br",
+    [CURL_ENCODING_ZSTD]     = "zstd",
+    [CURL_ENCODING_UNKNOWN]  = "unknown"
+};
+
+char* curl_content_encoding_name(CurlContentEncoding encoding)
+{
+    return encoding_names[encoding];
+}
+
+static CurlContentEncoding encoding_from_name(char* name)
+{
+    while (*name == ' ' || *name == '\t') {
+        name++;
+    }
+    size_t length = strlen(name);
+    while (length && (name[length - 1] == ' ' || name[length - 1] == '\t')) {
+        length--;
+    }
+    if (length == 0 || (length == 8 && strncasecmp(name, "identity", 8) == 0)) {
+        return CURL_ENCODING_IDENTITY;
+    }
+    if ((length == 4 && strncasecmp(name, "gzip", 4) == 0)
+        || (length == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+        return CURL_ENCODING_GZIP;
+    }
+    if (length == 7 && strncasecmp(name, "deflate", 7) == 0) {
+        return CURL_ENCODING_DEFLATE;
+    }
+    if (length == 2 && strncasecmp(name, "br", 2) == 0) {
+        return CURL_ENCODING_BR;
+    }
+    if (length == 4 && strncasecmp(name, "zstd", 4) == 0) {
+        return CURL_ENCODING_ZSTD;
+    }
+    // stacked codings end up here too
+    return CURL_ENCODING_UNKNOWN;
+}
+
+CurlContentEncoding curl_request_content_encoding(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    if (req->decode_mode == CURL_DECODE_INLINE) {
+        return CURL_ENCODING_IDENTITY;
+    }
+    struct curl_header* hdr;
+    if (curl_easy_header(req->easy_handle, "Content-Encoding", 0, CURLH_HEADER, -1, &hdr) != CURLHE_OK) {
+        return CURL_ENCODING_IDENTITY;
+    }
+    if (hdr->amount > 1) {
+        return CURL_ENCODING_UNKNOWN;
+    }
+    return encoding_from_name(hdr->value);
+}
+
+/****************************************************************
+ * Decoders
+ */
+
+static bool inflate_content(uint8_t* data, size_t size, int window_bits, CurlBuffer* out)
+/*
+ * Decode zlib, gzip or raw deflate stream depending on window_bits.
+ * Concatenated gzip members are decoded as one content.
+ */
+{
+    z_stream zs = {};
+    if (inflateInit2(&zs, window_bits) != Z_OK) {
+        fprintf(stderr, "Cannot initialize zlib stream\n");
+        return false;
+    }
+    uint8_t chunk[OUT_CHUNK_SIZE];
+    bool ok = true;
+    int ret = Z_OK;
+    zs.next_in = data;
+    for (;;) {
+        if (zs.avail_in == 0) {
+            // avail_in is 32-bit, feed large content in pieces
+            size_t remaining = size - (zs.next_in - data);
+            if (remaining == 0 && zs.avail_out != 0) {
+                // if the last chunk was filled up, inflate may have more output pending
+                break;
+            }
+            zs.avail_in = remaining > UINT_MAX? UINT_MAX : (uInt) remaining;
+        }
+        zs.next_out = chunk;
+        zs.avail_out = sizeof(chunk);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            ok = false;
+            break;
+        }
+        size_t produced = sizeof(chunk) - zs.avail_out;
+        if (produced && !curl_buffer_append(out, chunk, produced)) {
+            ok = false;
+            break;
+        }
+        if (ret == Z_STREAM_END) {
+            if (zs.avail_in == 0 && (size_t) (zs.next_in - data) == size) {
+                break;
+            }
+            // next gzip member
+            inflateReset(&zs);
+        }
+    }
+    inflateEnd(&zs);
+    return ok && ret == Z_STREAM_END;
+}
+
+#ifdef UW_CURL_HAVE_ZSTD
+static bool zstd_decompress(uint8_t* data, size_t size, CurlBuffer* out)
+{
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        fprintf(stderr, "Cannot create zstd context\n");
+        return false;
+    }
+    uint8_t chunk[OUT_CHUNK_SIZE];
+    ZSTD_inBuffer input = { data, size, 0 };
+    size_t ret = 0;
+    bool ok = true;
+    for (;;) {
+        ZSTD_outBuffer output = { chunk, sizeof(chunk), 0 };
+        ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret)) {
+            ok = false;
+            break;
+        }
+        if (output.pos && !curl_buffer_append(out, chunk, output.pos)) {
+            ok = false;
+            break;
+        }
+        if (input.pos == input.size && output.pos < output.size) {
+            // all input is consumed and output is flushed
+            break;
+        }
+    }
+    ZSTD_freeDCtx(dctx);
+    // nonzero ret means the last frame is truncated
+    return ok && ret == 0;
+}
+#endif
+
+#ifdef UW_CURL_HAVE_BROTLI
+static bool brotli_decompress(uint8_t* data, size_t size, CurlBuffer* out)
+{
+    BrotliDecoderState* state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    if (!state) {
+        fprintf(stderr, "Cannot create brotli decoder\n");
+        return false;
+    }
+    uint8_t chunk[OUT_CHUNK_SIZE];
+    size_t avail_in = size;
+    const uint8_t* next_in = data;
+    BrotliDecoderResult result;
+    bool ok = true;
+    do {
+        size_t avail_out = sizeof(chunk);
+        uint8_t* next_out = chunk;
+        result = BrotliDecoderDecompressStream(state, &avail_in, &next_in, &avail_out, &next_out, nullptr);
+        size_t produced = sizeof(chunk) - avail_out;
+        if (produced && !curl_buffer_append(out, chunk, produced)) {
+            ok = false;
+            break;
+        }
+    } while (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+
+    BrotliDecoderDestroyInstance(state);
+    return ok && result == BROTLI_DECODER_RESULT_SUCCESS;
+}
+#endif
+
+bool curl_content_decode(CurlContentEncoding encoding, uint8_t* data, size_t size, CurlBuffer* out)
+{
+    switch (encoding) {
+        case CURL_ENCODING_IDENTITY:
+            return curl_buffer_append(out, data, size);
+
+        case CURL_ENCODING_GZIP:
+            return inflate_content(data, size, 15 + 16, out);
+
+        case CURL_ENCODING_DEFLATE: {
+            // should be zlib stream, but some servers send raw deflate
+            size_t initial_size = out->size;
+            if (inflate_content(data, size, 15, out)) {
+                return true;
+            }
+            if (out->size != initial_size) {
+                // not a header problem, the stream is malformed
+                return false;
+            }
+            return inflate_content(data, size, -15, out);
+        }
+
+#ifdef UW_CURL_HAVE_BROTLI
+        case CURL_ENCODING_BR:
+            return brotli_decompress(data, size, out);
+#endif
+
+#ifdef UW_CURL_HAVE_ZSTD
+        case CURL_ENCODING_ZSTD:
+            return zstd_decompress(data, size, out);
+#endif
+
+        default:
+            fprintf(stderr, "Content-Encoding %s is not supported\n", curl_content_encoding_name(encoding));
+            return false;
+    }
+}
+
+/****************************************************************
+ * Request content
+ */
+
+bool curl_request_decode_encoding(UwValuePtr request)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    if (req->decode_mode == CURL_DECODE_INLINE || req->content_decoded) {
+        return true;
+    }
+    CurlContentEncoding encoding = curl_request_content_encoding(request);
+    if (encoding == CURL_ENCODING_IDENTITY) {
+        req->content_decoded = true;
+        return true;
+    }
+    uint8_t* data;
+    size_t size;
+    if (!curl_buffer_view(&req->content, &data, &size)) {
+        return false;
+    }
+    if (size == 0) {
+        // content is not received by default handlers
+        req->content_decoded = true;
+        return true;
+    }
+    CurlBuffer decoded;
+    curl_buffer_init(&decoded, req->content.spill_threshold);
+
+    // compression ratio of text is usually 3 to 5
+    if (!curl_buffer_reserve(&decoded, size * 4)) {
+        curl_buffer_fini(&decoded);
+        return false;
+    }
+    if (!curl_content_decode(encoding, data, size, &decoded)) {
+        fprintf(stderr, "Cannot decode %s content\n", curl_content_encoding_name(encoding));
+        curl_buffer_fini(&decoded);
+        return false;
+    }
+    curl_buffer_fini(&req->content);
+    req->content = decoded;
+    req->content_decoded = true;
+    return true;
+}
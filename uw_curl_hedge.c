@@ -0,0 +1,186 @@
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Hedged requests.
+ *
+ * Running requests are scanned by the loop thread at most every SCAN_INTERVAL_MS
+ * after checking done transfers. Time to first byte of successful requests
+ * is collected in histogram, in microseconds.
+ */
+
+#define SCAN_INTERVAL_MS  100
+
+struct CurlHedging {
+    CurlHedgeConfig config;
+    CurlHedgeFunc func;
+    void* ctx;
+    uint64_t last_scan_ns;
+    CurlHistogram ttfb;
+};
+
+bool curl_session_enable_hedging(UwValuePtr session, CurlHedgeConfig* config, CurlHedgeFunc func, void* ctx)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+
+    if (!sess->hedging) {
+        sess->hedging = default_allocator.allocate(sizeof(CurlHedging), false);
+        if (!sess->hedging) {
+            fprintf(stderr, "Cannot allocate hedging data\n");
+            return false;
+        }
+    }
+    CurlHedging* hedging = sess->hedging;
+
+    hedging->config = *config;
+    if (hedging->config.min_ttfb_samples == 0) {
+        hedging->config.min_ttfb_samples = 20;
+    }
+    if (hedging->config.min_delay_ms == 0) {
+        hedging->config.min_delay_ms = 100;
+    }
+    if (hedging->config.speed_window_ms == 0) {
+        hedging->config.speed_window_ms = 5000;
+    }
+    if (hedging->config.max_hedge_percent == 0) {
+        hedging->config.max_hedge_percent = 5;
+    }
+    hedging->func = func;
+    hedging->ctx = ctx;
+    hedging->last_scan_ns = 0;
+    curl_histogram_reset(&hedging->ttfb);
+    return true;
+}
+
+void _curl_hedge_fini(CurlSessionData* session)
+{
+    if (session->hedging) {
+        default_allocator.release((void**) &session->hedging, sizeof(CurlHedging));
+    }
+}
+
+static UwValuePtr request_of(CurlRequestData* req)
+/*
+ * Get private clone of request made in init_curl_request.
+ */
+{
+    UwValuePtr request = nullptr;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_PRIVATE, (char**) &request);
+    return request;
+}
+
+static void issue_hedge(CurlSessionData* session, CurlRequestData* req)
+{
+    CurlHedging* hedging = session->hedging;
+
+    UwValuePtr request = request_of(req);
+    if (!request) {
+        return;
+    }
+    UwValue duplicate = hedging->func(request, hedging->ctx);
+    if (uw_error(&duplicate) || uw_is_null(&duplicate)) {
+        return;
+    }
+    CurlRequestData* dup_req = uw_curl_request_data_ptr(&duplicate);
+    dup_req->hedge = true;
+    if (!_curl_add_easy_handle(session, dup_req)) {
+        return;
+    }
+    req->hedge_peer = dup_req;
+    dup_req->hedge_peer = req;
+}
+
+void _curl_hedge_done(CurlSessionData* session, CurlRequestData* req, bool success)
+{
+    if (success && session->hedging) {
+        curl_off_t ttfb;
+        if (curl_easy_getinfo(req->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb) == CURLE_OK) {
+            curl_histogram_record(&session->hedging->ttfb, ttfb);
+        }
+    }
+    CurlRequestData* peer = req->hedge_peer;
+    if (!peer) {
+        return;
+    }
+    req->hedge_peer = nullptr;
+    peer->hedge_peer = nullptr;
+
+    if (!success) {
+        // the peer goes on alone
+        return;
+    }
+    if (req->hedge) {
+        session->stats.hedges_won++;
+    }
+    session->stats.hedges_cancelled++;
+    peer->hedge_lost = true;
+    _curl_cancel_request(session, peer);
+}
+
+void _curl_hedge_scan(CurlSessionData* session)
+{
+    CurlHedging* hedging = session->hedging;
+    CurlHedgeConfig* config = &hedging->config;
+
+    uint64_t now = curl_trace_now();
+    if (now - hedging->last_scan_ns < SCAN_INTERVAL_MS * 1000000ULL) {
+        return;
+    }
+    hedging->last_scan_ns = now;
+
+    uint64_t min_delay = config->min_delay_ms * 1000000ULL;
+    uint64_t speed_window = config->speed_window_ms * 1000000ULL;
+
+    uint64_t ttfb_threshold = UINT64_MAX;
+    if (config->ttfb_percentile > 0.0 && hedging->ttfb.count >= config->min_ttfb_samples) {
+        ttfb_threshold = curl_histogram_percentile(&hedging->ttfb, config->ttfb_percentile) * 1000;
+    }
+
+    for (CurlRequestData* req = session->running_head; req; req = req->next_running) {
+
+        if (session->stats.hedges_issued * 100 >= session->stats.requests_added * config->max_hedge_percent) {
+            // budget is exhausted
+            break;
+        }
+        if (req->preconnect || req->hedge || req->hedge_peer || req->rejected) {
+            continue;
+        }
+        uint64_t age = now - req->added_ns;
+        if (age < min_delay) {
+            continue;
+        }
+        if (!req->headers_checked) {
+            if (age >= ttfb_threshold) {
+                issue_hedge(session, req);
+            }
+            continue;
+        }
+        if (config->min_speed == 0) {
+            continue;
+        }
+        if (req->paused) {
+            // slow sink, not a straggler, measure again after resume
+            req->speed_check_ns = 0;
+            continue;
+        }
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(req->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        if (req->speed_check_ns == 0) {
+            // start measuring when headers are received
+            req->speed_check_ns = now;
+            req->speed_check_bytes = bytes;
+            continue;
+        }
+        uint64_t elapsed = now - req->speed_check_ns;
+        if (elapsed < speed_window) {
+            continue;
+        }
+        double speed = (bytes - req->speed_check_bytes) * 1e9 / elapsed;
+        req->speed_check_ns = now;
+        req->speed_check_bytes = bytes;
+        if (speed < config->min_speed) {
+            issue_hedge(session, req);
+        }
+    }
+}
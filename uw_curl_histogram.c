@@ -0,0 +1,115 @@
+#include <math.h>
+#include <string.h>
+
+#include <uw.h>
+
+#include "uw_curl.h"
+
+/*
+ * Histograms.
+ *
+ * Values below 2^SUB_BITS are counted exactly. Larger values are split into
+ * power-of-two ranges, each divided into 2^(SUB_BITS - 1) linear sub-buckets,
+ * as in HdrHistogram.
+ */
+
+#define SUB_BITS   CURL_HISTOGRAM_SUB_BITS
+#define SUB_COUNT  (1 << SUB_BITS)
+#define HALF_COUNT (1 << (SUB_BITS - 1))
+
+static unsigned value_index(uint64_t value)
+{
+    if (value < SUB_COUNT) {
+        return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - SUB_BITS + 1;
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT);
+}
+
+static uint64_t highest_equivalent_value(unsigned index)
+{
+    if (index < SUB_COUNT) {
+        return index;
+    }
+    unsigned shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    uint64_t top = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return (top << shift) | ((1ULL << shift) - 1);
+}
+
+void curl_histogram_reset(CurlHistogram* histogram)
+{
+    memset(histogram, 0, sizeof(CurlHistogram));
+    histogram->min = UINT64_MAX;
+}
+
+void curl_histogram_record(CurlHistogram* histogram, uint64_t value)
+{
+    histogram->counts[value_index(value)]++;
+    histogram->count++;
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->sum += (double) value;
+    histogram->sum_squares += (double) value * (double) value;
+}
+
+void curl_histogram_merge(CurlHistogram* dest, CurlHistogram* src)
+{
+    for (unsigned i = 0; i < CURL_HISTOGRAM_SIZE; i++) {
+        dest->counts[i] += src->counts[i];
+    }
+    dest->count += src->count;
+    if (src->min < dest->min) {
+        dest->min = src->min;
+    }
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+    dest->sum += src->sum;
+    dest->sum_squares += src->sum_squares;
+}
+
+uint64_t curl_histogram_percentile(CurlHistogram* histogram, double percentile)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+    if (percentile >= 100.0) {
+        return histogram->max;
+    }
+    uint64_t target = (uint64_t) ceil(percentile / 100.0 * histogram->count);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t total = 0;
+    for (unsigned i = 0; i < CURL_HISTOGRAM_SIZE; i++) {
+        total += histogram->counts[i];
+        if (total >= target) {
+            uint64_t value = highest_equivalent_value(i);
+            return (value > histogram->max)? histogram->max : value;
+        }
+    }
+    return histogram->max;
+}
+
+double curl_histogram_mean(CurlHistogram* histogram)
+{
+    if (histogram->count == 0) {
+        return 0.0;
+    }
+    return histogram->sum / histogram->count;
+}
+
+double curl_histogram_stddev(CurlHistogram* histogram)
+{
+    if (histogram->count == 0) {
+        return 0.0;
+    }
+    double mean = histogram->sum / histogram->count;
+    double variance = histogram->sum_squares / histogram->count - mean * mean;
+    return (variance > 0.0)? sqrt(variance) : 0.0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+/*
+ * Internal functions shared by library modules.
+ * Not installed, applications use uw_curl.h only.
+ */
+
+#include "uw_curl.h"
+
+// session data, applications use curl_session_* functions
+
+typedef struct CurlWorkers CurlWorkers;
+typedef struct CurlHedging CurlHedging;
+typedef struct CurlProxyPool CurlProxyPool;
+
+struct _CurlSessionData {
+    CURLM* multi_handle;
+    CurlSessionConfig config;
+    CurlSessionStats stats;
+    CurlAtomicAllocStats alloc_stats;
+    CurlWorkers* workers;
+    _Atomic unsigned pending_completions;  // requests queued to workers and not completed yet
+
+    // requests submitted with curl_submit, possibly from other threads
+    pthread_mutex_t submit_lock;
+    CurlRequestData* submitted_head;
+    CurlRequestData* submitted_tail;
+    pthread_t loop_thread;  // the thread that called curl_perform last time
+
+    CurlRequestData* running_head;  // requests added to multi handle
+    CurlRequestData* paused_head;   // paused requests
+    unsigned num_paused;
+    unsigned num_paused_uploads;    // paused requests waiting for their stream bodies to become readable
+    struct curl_waitfd* wait_fds;   // extra descriptors and stream bodies to wait for
+    unsigned wait_fds_capacity;
+    _Atomic bool resume_pending;    // curl_request_resume was called for some of paused requests
+    _Atomic int cancel_mode;        // CurlCancelMode set by curl_session_cancel
+    _Atomic bool cancel_pending;    // curl_request_cancel was called for some of requests
+    CurlHedging* hedging;           // nullptr if hedging is not enabled
+    CurlProxyPool* proxy_pool;      // nullptr if proxies are not pooled
+};
+
+// request templates
+extern _Thread_local CurlTemplateData* _curl_stamping_template;
+struct curl_slist* _curl_default_headers();
+bool _curl_setup_easy_handle(CURL* easy_handle);
+bool _curl_copy_headers(struct curl_slist** dest, struct curl_slist* src);
+
+// request lifecycle, loop thread unless noted
+void _curl_run_continuations(UwValuePtr request);
+void _curl_free_continuations(CurlRequestData* req);
+unsigned _curl_add_submitted(CurlSessionData* session);
+bool _curl_add_easy_handle(CurlSessionData* session, CurlRequestData* req);
+void _curl_complete_request(UwValuePtr request);  // loop thread or worker
+void _curl_release_request(UwValuePtr request);   // loop thread or worker
+void _curl_cancel_request(CurlSessionData* session, CurlRequestData* req);
+void _curl_drop_request(CurlRequestData* req, bool run_continuations);
+void _curl_unlink_running(CurlSessionData* session, CurlRequestData* req);
+void _curl_unlink_paused(CurlSessionData* session, CurlRequestData* req);
+void _curl_pause_upload(CurlRequestData* req);
+
+// completion workers
+bool _curl_queue_completion(CurlSessionData* session, UwValuePtr request);
+void _curl_stop_workers(CurlSessionData* session);
+void _curl_release_completed(CurlSessionData* session);
+
+// hedging
+void _curl_hedge_scan(CurlSessionData* session);
+void _curl_hedge_done(CurlSessionData* session, CurlRequestData* req, bool success);
+void _curl_hedge_fini(CurlSessionData* session);
+
+// proxy pool
+void _curl_proxy_pool_assign(CurlSessionData* session, CurlRequestData* req);
+void _curl_proxy_pool_done(CurlSessionData* session, CurlRequestData* req, CURLcode result);
+void _curl_proxy_pool_fini(CurlSessionData* session);
+
+// request body
+void _curl_request_body_destroy(CurlRequestData* req);
+
+// digests
+bool _curl_request_check_digest_size(CurlRequestData* req, size_t size);
+
+// pipeline
+void _curl_register_stage_interface();
+CurlStageResult _curl_pipeline_process(UwValuePtr request, CurlPipeline* pipeline, uint8_t* data, size_t size);
+void _curl_pipeline_complete(UwValuePtr request, CurlPipeline* pipeline);
+void _curl_pipeline_destroy(CurlRequestData* req);
+
+// allocation accounting
+extern _Thread_local CurlRequestData* _curl_alloc_request;
+
+// set current request for allocation accounting in the calling thread
+#define _CURL_ALLOC_ENTER(req)  \
+    CurlRequestData* _curl_saved_alloc_request = _curl_alloc_request;  \
+    _curl_alloc_request = (req)
+
+#define _CURL_ALLOC_LEAVE()  \
+    _curl_alloc_request = _curl_saved_alloc_request
+
+bool _curl_check_memory_budget(CurlRequestData* req);
+void _curl_alloc_attach(CurlSessionData* session, CurlRequestData* req);
+
+// tracing
+extern bool curl_trace_enabled;
+
+#define CURL_TRACE_ON()  __builtin_expect(curl_trace_enabled, 0)
+
+void _curl_trace_span(char* name, uint64_t start_ns, uint64_t end_ns, uint64_t request_id, int64_t arg);
+void _curl_trace_transfer_phases(CurlRequestData* req);
+uint64_t _curl_trace_request_id();
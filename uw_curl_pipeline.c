@@ -0,0 +1,712 @@
+#include <ctype.h>
+#include <string.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/****************************************************************
+ * Pipeline
+ */
+
+bool curl_request_append_stage(UwValuePtr request, UwValuePtr stage)
+{
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    UwInterface_CurlStage* iface = uw_interface(stage->type_id, CurlStage);
+    if (!iface) {
+        fprintf(stderr, "ERROR %s: value does not support CurlStage interface\n", __func__);
+        return false;
+    }
+    if (!req->pipeline) {
+        req->pipeline = default_allocator.allocate(sizeof(CurlPipeline), true);
+        if (!req->pipeline) {
+            return false;
+        }
+    }
+    CurlPipeline* pipeline = req->pipeline;
+    if (pipeline->num_stages == CURL_MAX_STAGES) {
+        fprintf(stderr, "ERROR %s: too many stages\n", __func__);
+        return false;
+    }
+    pipeline->stages[pipeline->num_stages].stage = uw_clone(stage);
+    pipeline->stages[pipeline->num_stages].iface = iface;
+    pipeline->num_stages++;
+    return true;
+}
+
+CurlStageResult _curl_pipeline_process(UwValuePtr request, CurlPipeline* pipeline, uint8_t* data, size_t size)
+{
+    // after pause CURL delivers the same data again, skip stages that have already processed it
+    unsigned i = pipeline->resume_stage;
+    pipeline->resume_stage = 0;
+
+    for (; i < pipeline->num_stages; i++) {
+        UwValuePtr stage = &pipeline->stages[i].stage;
+        CurlStageResult result = pipeline->stages[i].iface->process(stage, request, data, size);
+        switch (result) {
+            case CURL_STAGE_CONTINUE:
+                break;
+            case CURL_STAGE_PAUSE:
+                pipeline->resume_stage = i;
+                return result;
+            default:
+                return result;
+        }
+    }
+    return CURL_STAGE_CONTINUE;
+}
+
+void _curl_pipeline_complete(UwValuePtr request, CurlPipeline* pipeline)
+{
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        pipeline->stages[i].iface->complete(&pipeline->stages[i].stage, request);
+    }
+}
+
+void _curl_pipeline_destroy(CurlRequestData* req)
+{
+    CurlPipeline* pipeline = req->pipeline;
+    if (!pipeline) {
+        return;
+    }
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        uw_destroy(&pipeline->stages[i].stage);
+    }
+    default_allocator.release((void**) &req->pipeline, sizeof(CurlPipeline));
+}
+
+static void stage_complete_noop(UwValuePtr self, UwValuePtr request)
+{
+}
+
+unsigned UwInterfaceId_CurlStage = 0;
+
+/****************************************************************
+ * Filter stage
+ */
+
+typedef struct {
+    unsigned status;
+    _UwValue media_type;
+    _UwValue media_subtype;
+    bool checked;
+
+} CurlFilterStageData;
+
+#define filter_stage_data_ptr(value)  ((CurlFilterStageData*) _uw_get_data_ptr((value), UwTypeId_CurlFilterStage))
+
+UwTypeId UwTypeId_CurlFilterStage = 0;
+
+static void fini_filter_stage(UwValuePtr self)
+{
+    CurlFilterStageData* data = filter_stage_data_ptr(self);
+
+    uw_destroy(&data->media_type);
+    uw_destroy(&data->media_subtype);
+
+    uw_ancestor_of(UwTypeId_CurlFilterStage)->fini(self);
+}
+
+static CurlStageResult filter_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    CurlFilterStageData* filter = filter_stage_data_ptr(self);
+    if (filter->checked) {
+        return CURL_STAGE_CONTINUE;
+    }
+    filter->checked = true;
+
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    curl_update_status(request);
+
+    if (filter->status) {
+        if (req->status != filter->status) {
+            return CURL_STAGE_ABORT;
+        }
+    } else if (req->status < 200 || req->status > 299) {
+        return CURL_STAGE_ABORT;
+    }
+
+    if (uw_is_string(&filter->media_type)) {
+        curl_request_parse_content_type(req);
+        if (!uw_equal(&req->media_type, &filter->media_type)) {
+            return CURL_STAGE_ABORT;
+        }
+        if (uw_strlen(&filter->media_subtype) && !uw_equal(&req->media_subtype, &filter->media_subtype)) {
+            return CURL_STAGE_ABORT;
+        }
+    }
+    return CURL_STAGE_CONTINUE;
+}
+
+static UwInterface_CurlStage filter_stage_interface = {
+    .process  = filter_process,
+    .complete = stage_complete_noop
+};
+
+UwResult curl_filter_stage(unsigned status, char* media_type)
+{
+    UwValue result = uw_create(UwTypeId_CurlFilterStage);
+    uw_return_if_error(&result);
+
+    CurlFilterStageData* filter = filter_stage_data_ptr(&result);
+    filter->status = status;
+
+    if (media_type) {
+        UwValue mt = uw_create_string(media_type);
+        uw_return_if_error(&mt);
+        UwValue parts = uw_string_split_chr(&mt, '/', 1);
+        uw_return_if_error(&parts);
+
+        filter->media_type = uw_array_item(&parts, 0);
+        uw_string_lower(&filter->media_type);
+        if (uw_array_length(&parts) > 1) {
+            filter->media_subtype = uw_array_item(&parts, 1);
+            uw_string_lower(&filter->media_subtype);
+        } else {
+            filter->media_subtype = UwString();
+        }
+    }
+    return uw_move(&result);
+}
+
+/****************************************************************
+ * Digest stage
+ */
+
+typedef struct {
+    CurlDigest digest;
+
+} CurlDigestStageData;
+
+#define digest_stage_data_ptr(value)  ((CurlDigestStageData*) _uw_get_data_ptr((value), UwTypeId_CurlDigestStage))
+
+UwTypeId UwTypeId_CurlDigestStage = 0;
+
+static void fini_digest_stage(UwValuePtr self)
+{
+    curl_digest_fini(&digest_stage_data_ptr(self)->digest);
+
+    uw_ancestor_of(UwTypeId_CurlDigestStage)->fini(self);
+}
+
+static CurlStageResult digest_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    curl_digest_update(&digest_stage_data_ptr(self)->digest, data, size);
+    return CURL_STAGE_CONTINUE;
+}
+
+static void digest_complete(UwValuePtr self, UwValuePtr request)
+{
+    curl_digest_final(&digest_stage_data_ptr(self)->digest);
+}
+
+static UwInterface_CurlStage digest_stage_interface = {
+    .process  = digest_process,
+    .complete = digest_complete
+};
+
+UwResult curl_digest_stage(unsigned algorithms)
+{
+    UwValue result = uw_create(UwTypeId_CurlDigestStage);
+    uw_return_if_error(&result);
+
+    if (!curl_digest_init(&digest_stage_data_ptr(&result)->digest, algorithms)) {
+        return UwOOM();
+    }
+    return uw_move(&result);
+}
+
+CurlDigest* curl_digest_stage_digest(UwValuePtr stage)
+{
+    return &digest_stage_data_ptr(stage)->digest;
+}
+
+/****************************************************************
+ * Link extractor
+ *
+ * This is not a HTML parser, it simply looks for href= and src=
+ * preceded by whitespace. State is kept between chunks,
+ * so data is scanned only once.
+ */
+
+#define MAX_LINK_LENGTH  4096
+
+typedef enum {
+    LINK_DISABLED = 0,  // content is not HTML
+    LINK_SCAN,
+    LINK_BEFORE_VALUE,
+    LINK_VALUE,
+    LINK_CHECK_CONTENT_TYPE  // initial state set by constructor, checked on first chunk
+} LinkState;
+
+typedef struct {
+    LinkState state;
+    char quote;      // quote char of current value, 0 for unquoted
+    bool skip;       // current value is too long
+    uint8_t tail[6]; // last bytes of previous chunk, for lookbehind
+    unsigned tail_length;
+    _UwValue current;
+    _UwValue links;
+
+} CurlLinkExtractStageData;
+
+#define link_stage_data_ptr(value)  ((CurlLinkExtractStageData*) _uw_get_data_ptr((value), UwTypeId_CurlLinkExtractStage))
+
+UwTypeId UwTypeId_CurlLinkExtractStage = 0;
+
+static void fini_link_stage(UwValuePtr self)
+{
+    CurlLinkExtractStageData* ls = link_stage_data_ptr(self);
+
+    uw_destroy(&ls->current);
+    uw_destroy(&ls->links);
+
+    uw_ancestor_of(UwTypeId_CurlLinkExtractStage)->fini(self);
+}
+
+static inline bool is_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool is_link_attr(CurlLinkExtractStageData* ls, uint8_t* data, uint8_t* eq)
+/*
+ * Check if the name before equal sign is href or src.
+ */
+{
+    // collect up to 5 bytes before equal sign, in reverse order
+    uint8_t back[5];
+    unsigned n = 0;
+    uint8_t* p = eq;
+    while (n < 5 && p > data) {
+        back[n++] = tolower(*--p);
+    }
+    for (unsigned i = ls->tail_length; n < 5 && i > 0; i--) {
+        back[n++] = tolower(ls->tail[i - 1]);
+    }
+    if (n >= 4 && back[0] == 'f' && back[1] == 'e' && back[2] == 'r' && back[3] == 'h') {
+        return n == 4 || is_space(back[4]);
+    }
+    if (n >= 3 && back[0] == 'c' && back[1] == 'r' && back[2] == 's') {
+        return n == 3 || is_space(back[3]);
+    }
+    return false;
+}
+
+static bool finish_link(CurlLinkExtractStageData* ls)
+{
+    bool ok = true;
+    if (!ls->skip && uw_strlen(&ls->current)) {
+        ok = uw_array_append(&ls->links, &ls->current);
+    }
+    uw_destroy(&ls->current);
+    ls->current = UwString();
+    ls->skip = false;
+    ls->state = LINK_SCAN;
+    return ok;
+}
+
+static bool append_link_part(CurlLinkExtractStageData* ls, uint8_t* start, uint8_t* end)
+{
+    if (ls->skip || start == end) {
+        return true;
+    }
+    if (uw_strlen(&ls->current) + (end - start) > MAX_LINK_LENGTH) {
+        ls->skip = true;
+        return true;
+    }
+    return uw_string_append_substring(&ls->current, (char*) start, 0, end - start);
+}
+
+static CurlStageResult link_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    CurlLinkExtractStageData* ls = link_stage_data_ptr(self);
+
+    if (ls->state == LINK_CHECK_CONTENT_TYPE) {
+        CurlRequestData* req = uw_curl_request_data_ptr(request);
+        curl_request_parse_content_type(req);
+        if (uw_equal(&req->media_subtype, "html") || uw_equal(&req->media_subtype, "xhtml+xml")) {
+            ls->state = LINK_SCAN;
+        } else {
+            ls->state = LINK_DISABLED;
+        }
+    }
+    if (ls->state == LINK_DISABLED) {
+        return CURL_STAGE_CONTINUE;
+    }
+
+    uint8_t* ptr = data;
+    uint8_t* end = data + size;
+
+    while (ptr < end) {
+        switch (ls->state) {
+            case LINK_SCAN: {
+                uint8_t* eq = memchr(ptr, '=', end - ptr);
+                if (!eq) {
+                    ptr = end;
+                    break;
+                }
+                if (is_link_attr(ls, data, eq)) {
+                    ls->state = LINK_BEFORE_VALUE;
+                }
+                ptr = eq + 1;
+                break;
+            }
+            case LINK_BEFORE_VALUE: {
+                uint8_t c = *ptr;
+                if (is_space(c)) {
+                    ptr++;
+                } else if (c == '"' || c == '\'') {
+                    ls->quote = c;
+                    ls->state = LINK_VALUE;
+                    ptr++;
+                } else if (c == '>') {
+                    ls->state = LINK_SCAN;
+                } else {
+                    ls->quote = 0;
+                    ls->state = LINK_VALUE;
+                }
+                break;
+            }
+            case LINK_VALUE: {
+                uint8_t* value_end;
+                if (ls->quote) {
+                    value_end = memchr(ptr, ls->quote, end - ptr);
+                } else {
+                    value_end = ptr;
+                    while (value_end < end && !(is_space(*value_end) || *value_end == '>')) {
+                        value_end++;
+                    }
+                    if (value_end == end) {
+                        value_end = nullptr;
+                    }
+                }
+                if (!value_end) {
+                    if (!append_link_part(ls, ptr, end)) {
+                        return CURL_STAGE_ABORT;
+                    }
+                    ptr = end;
+                    break;
+                }
+                if (!append_link_part(ls, ptr, value_end)) {
+                    return CURL_STAGE_ABORT;
+                }
+                if (!finish_link(ls)) {
+                    return CURL_STAGE_ABORT;
+                }
+                ptr = value_end + (ls->quote? 1 : 0);
+                break;
+            }
+            default:
+                ptr = end;
+                break;
+        }
+    }
+
+    // save tail for lookbehind
+    if (size >= sizeof(ls->tail)) {
+        memcpy(ls->tail, end - sizeof(ls->tail), sizeof(ls->tail));
+        ls->tail_length = sizeof(ls->tail);
+    } else {
+        unsigned keep = sizeof(ls->tail) - size;
+        if (keep > ls->tail_length) {
+            keep = ls->tail_length;
+        }
+        memmove(ls->tail, ls->tail + ls->tail_length - keep, keep);
+        memcpy(ls->tail + keep, data, size);
+        ls->tail_length = keep + size;
+    }
+    return CURL_STAGE_CONTINUE;
+}
+
+static void link_complete(UwValuePtr self, UwValuePtr request)
+{
+    CurlLinkExtractStageData* ls = link_stage_data_ptr(self);
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    if (ls->state == LINK_VALUE && !ls->quote) {
+        // unquoted value at the end of content
+        finish_link(ls);
+    }
+
+    // resolve links
+    UwValue resolved = UwArray();
+    if (uw_error(&resolved)) {
+        return;
+    }
+    unsigned n = uw_array_length(&ls->links);
+    for (unsigned i = 0; i < n; i++) {{
+        UwValue link = uw_array_item(&ls->links, i);
+        UwValue url = urljoin(&req->real_url, &link);
+        if (uw_is_string(&url)) {
+            uw_array_append(&resolved, &url);
+        }
+    }}
+    uw_destroy(&ls->links);
+    ls->links = uw_move(&resolved);
+}
+
+static UwInterface_CurlStage link_stage_interface = {
+    .process  = link_process,
+    .complete = link_complete
+};
+
+UwResult curl_link_extract_stage()
+{
+    UwValue result = uw_create(UwTypeId_CurlLinkExtractStage);
+    uw_return_if_error(&result);
+
+    CurlLinkExtractStageData* ls = link_stage_data_ptr(&result);
+    ls->state = LINK_CHECK_CONTENT_TYPE;
+    ls->current = UwString();
+    ls->links = UwArray();
+    if (uw_error(&ls->links)) {
+        return uw_move(&ls->links);
+    }
+    return uw_move(&result);
+}
+
+UwResult curl_link_extract_stage_links(UwValuePtr stage)
+{
+    return uw_clone(&link_stage_data_ptr(stage)->links);
+}
+
+/****************************************************************
+ * Null sink
+ */
+
+typedef struct {
+    uint64_t bytes;
+
+} CurlNullSinkData;
+
+#define null_sink_data_ptr(value)  ((CurlNullSinkData*) _uw_get_data_ptr((value), UwTypeId_CurlNullSink))
+
+UwTypeId UwTypeId_CurlNullSink = 0;
+
+static CurlStageResult null_sink_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    null_sink_data_ptr(self)->bytes += size;
+    return CURL_STAGE_CONSUMED;
+}
+
+static UwInterface_CurlStage null_sink_interface = {
+    .process  = null_sink_process,
+    .complete = stage_complete_noop
+};
+
+UwResult curl_null_sink()
+{
+    return uw_create(UwTypeId_CurlNullSink);
+}
+
+uint64_t curl_null_sink_bytes(UwValuePtr stage)
+{
+    return null_sink_data_ptr(stage)->bytes;
+}
+
+/****************************************************************
+ * Memory sink
+ */
+
+typedef struct {
+    _UwValue content;
+
+} CurlMemorySinkData;
+
+#define memory_sink_data_ptr(value)  ((CurlMemorySinkData*) _uw_get_data_ptr((value), UwTypeId_CurlMemorySink))
+
+UwTypeId UwTypeId_CurlMemorySink = 0;
+
+static void fini_memory_sink(UwValuePtr self)
+{
+    uw_destroy(&memory_sink_data_ptr(self)->content);
+
+    uw_ancestor_of(UwTypeId_CurlMemorySink)->fini(self);
+}
+
+static CurlStageResult memory_sink_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    CurlMemorySinkData* sink = memory_sink_data_ptr(self);
+
+    if (uw_is_null(&sink->content)) {
+        CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+        curl_off_t content_length;
+        CURLcode res = curl_easy_getinfo(req->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if (res != CURLE_OK || content_length < 0) {
+            content_length = 0;
+        }
+        sink->content = uw_create_empty_string(content_length, 1);
+        if (uw_error(&sink->content)) {
+            return CURL_STAGE_ABORT;
+        }
+    }
+    if (!uw_string_append_buffer(&sink->content, data, size)) {
+        return CURL_STAGE_ABORT;
+    }
+    return CURL_STAGE_CONSUMED;
+}
+
+static UwInterface_CurlStage memory_sink_interface = {
+    .process  = memory_sink_process,
+    .complete = stage_complete_noop
+};
+
+UwResult curl_memory_sink()
+{
+    return uw_create(UwTypeId_CurlMemorySink);
+}
+
+UwResult curl_memory_sink_content(UwValuePtr stage)
+{
+    return uw_clone(&memory_sink_data_ptr(stage)->content);
+}
+
+/****************************************************************
+ * File sink
+ */
+
+typedef struct {
+    _UwValue filename;
+    _UwValue file;
+
+} CurlFileSinkData;
+
+#define file_sink_data_ptr(value)  ((CurlFileSinkData*) _uw_get_data_ptr((value), UwTypeId_CurlFileSink))
+
+UwTypeId UwTypeId_CurlFileSink = 0;
+
+static void fini_file_sink(UwValuePtr self)
+{
+    CurlFileSinkData* sink = file_sink_data_ptr(self);
+
+    uw_destroy(&sink->file);
+    uw_destroy(&sink->filename);
+
+    uw_ancestor_of(UwTypeId_CurlFileSink)->fini(self);
+}
+
+static CurlStageResult file_sink_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    CurlFileSinkData* sink = file_sink_data_ptr(self);
+
+    if (uw_is_null(&sink->file)) {
+        sink->file = uw_file_open(&sink->filename, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (uw_error(&sink->file)) {
+            uw_print_status(stderr, &sink->file);
+            return CURL_STAGE_ABORT;
+        }
+    }
+    unsigned bytes_written;
+    UwValue status = uw_file_write(&sink->file, data, size, &bytes_written);
+    if (uw_error(&status)) {
+        uw_print_status(stderr, &status);
+        return CURL_STAGE_ABORT;
+    }
+    if (bytes_written != size) {
+        return CURL_STAGE_ABORT;
+    }
+    return CURL_STAGE_CONSUMED;
+}
+
+static void file_sink_complete(UwValuePtr self, UwValuePtr request)
+{
+    CurlFileSinkData* sink = file_sink_data_ptr(self);
+
+    if (!uw_is_null(&sink->file)) {
+        uw_file_close(&sink->file);
+    }
+}
+
+static UwInterface_CurlStage file_sink_interface = {
+    .process  = file_sink_process,
+    .complete = file_sink_complete
+};
+
+UwResult curl_file_sink(UwValuePtr filename)
+{
+    UwValue result = uw_create(UwTypeId_CurlFileSink);
+    uw_return_if_error(&result);
+
+    file_sink_data_ptr(&result)->filename = uw_clone(filename);
+    return uw_move(&result);
+}
+
+/****************************************************************
+ * Types
+ */
+
+static UwType filter_stage_type;
+static UwType digest_stage_type;
+static UwType link_stage_type;
+static UwType null_sink_type;
+static UwType memory_sink_type;
+static UwType file_sink_type;
+
+void _curl_register_stage_interface()
+/*
+ * Register stage interface once. Called from constructors of all modules
+ * that define stages, because the order of constructors is not defined.
+ */
+{
+    static bool registered = false;
+    if (!registered) {
+        UwInterfaceId_CurlStage = uw_register_interface("CurlStage", UwInterface_CurlStage);
+        registered = true;
+    }
+}
+
+[[ gnu::constructor ]]
+static void init()
+{
+    _curl_register_stage_interface();
+
+    UwTypeId_CurlFilterStage = uw_subtype(
+        &filter_stage_type, "CurlFilterStage",
+        UwTypeId_Struct,
+        CurlFilterStageData,
+        UwInterfaceId_CurlStage, &filter_stage_interface
+    );
+    filter_stage_type.fini = fini_filter_stage;
+
+    UwTypeId_CurlDigestStage = uw_subtype(
+        &digest_stage_type, "CurlDigestStage",
+        UwTypeId_Struct,
+        CurlDigestStageData,
+        UwInterfaceId_CurlStage, &digest_stage_interface
+    );
+    digest_stage_type.fini = fini_digest_stage;
+
+    UwTypeId_CurlLinkExtractStage = uw_subtype(
+        &link_stage_type, "CurlLinkExtractStage",
+        UwTypeId_Struct,
+        CurlLinkExtractStageData,
+        UwInterfaceId_CurlStage, &link_stage_interface
+    );
+    link_stage_type.fini = fini_link_stage;
+
+    UwTypeId_CurlNullSink = uw_subtype(
+        &null_sink_type, "CurlNullSink",
+        UwTypeId_Struct,
+        CurlNullSinkData,
+        UwInterfaceId_CurlStage, &null_sink_interface
+    );
+
+    UwTypeId_CurlMemorySink = uw_subtype(
+        &memory_sink_type, "CurlMemorySink",
+        UwTypeId_Struct,
+        CurlMemorySinkData,
+        UwInterfaceId_CurlStage, &memory_sink_interface
+    );
+    memory_sink_type.fini = fini_memory_sink;
+
+    UwTypeId_CurlFileSink = uw_subtype(
+        &file_sink_type, "CurlFileSink",
+        UwTypeId_Struct,
+        CurlFileSinkData,
+        UwInterfaceId_CurlStage, &file_sink_interface
+    );
+    file_sink_type.fini = fini_file_sink;
+}
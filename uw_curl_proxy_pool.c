@@ -0,0 +1,290 @@
+#include <string.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Proxy pool.
+ *
+ * Admitted proxies are kept in array, so a random one is picked in O(1)
+ * and ejected one is removed by swapping with the last.
+ * Ejection time is the same for all proxies, so ejected ones are kept
+ * in a ring in order of re-admission and only the head is checked.
+ *
+ * The pool is used by the loop thread only.
+ */
+
+#define LATENCY_WEIGHT  0.2  // of new sample in moving average
+
+typedef struct CurlProxy {
+    char* url;
+    CurlProxyStats stats;
+    unsigned consecutive_failures;
+    unsigned admitted_index;  // position in admitted array
+    uint64_t readmit_ns;
+
+} CurlProxy;
+
+struct CurlProxyPool {
+    CurlProxyPolicy policy;
+    unsigned max_failures;
+    uint64_t eject_ns;
+    uint64_t random_state;
+
+    unsigned num_proxies;
+    CurlProxy* proxies;
+
+    unsigned* admitted;
+    unsigned num_admitted;
+
+    unsigned* ejected;  // ring of num_proxies items
+    unsigned ejected_head;
+    unsigned num_ejected;
+
+    size_t memsize;  // the pool, arrays and proxy strings are allocated in one block
+};
+
+bool curl_session_set_proxy_pool(UwValuePtr session, char* proxies[], unsigned num_proxies,
+                                 CurlProxyPolicy policy, unsigned max_failures, unsigned eject_ms)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+
+    if (num_proxies == 0) {
+        fprintf(stderr, "ERROR: %s: empty proxy list\n", __func__);
+        return false;
+    }
+    if (sess->proxy_pool) {
+        // running requests point to proxies of the current pool
+        for (unsigned i = 0; i < sess->proxy_pool->num_proxies; i++) {
+            if (sess->proxy_pool->proxies[i].stats.in_flight) {
+                fprintf(stderr, "ERROR: %s: cannot replace proxy pool while its proxies are in use\n", __func__);
+                return false;
+            }
+        }
+    }
+    size_t memsize = sizeof(CurlProxyPool)
+                   + num_proxies * (sizeof(CurlProxy) + 2 * sizeof(unsigned));
+    for (unsigned i = 0; i < num_proxies; i++) {
+        memsize += strlen(proxies[i]) + 1;
+    }
+    CurlProxyPool* pool = default_allocator.allocate(memsize, true);
+    if (!pool) {
+        fprintf(stderr, "Cannot allocate proxy pool\n");
+        return false;
+    }
+    pool->memsize = memsize;
+    pool->policy = policy;
+    pool->max_failures = max_failures? max_failures : 3;
+    pool->eject_ns = (eject_ms? eject_ms : 30000) * 1000000ULL;
+    pool->random_state = curl_trace_now() | 1;
+
+    pool->num_proxies = num_proxies;
+    pool->proxies  = (CurlProxy*) (pool + 1);
+    pool->admitted = (unsigned*) (pool->proxies + num_proxies);
+    pool->ejected  = pool->admitted + num_proxies;
+
+    char* strings = (char*) (pool->ejected + num_proxies);
+    for (unsigned i = 0; i < num_proxies; i++) {
+        CurlProxy* proxy = &pool->proxies[i];
+        size_t length = strlen(proxies[i]) + 1;
+        memcpy(strings, proxies[i], length);
+        proxy->url = strings;
+        strings += length;
+
+        proxy->admitted_index = i;
+        pool->admitted[i] = i;
+    }
+    pool->num_admitted = num_proxies;
+
+    _curl_proxy_pool_fini(sess);
+    sess->proxy_pool = pool;
+    return true;
+}
+
+void _curl_proxy_pool_fini(CurlSessionData* session)
+{
+    if (session->proxy_pool) {
+        default_allocator.release((void**) &session->proxy_pool, session->proxy_pool->memsize);
+    }
+}
+
+static uint64_t next_random(CurlProxyPool* pool)
+/*
+ * xorshift64*
+ */
+{
+    uint64_t x = pool->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    pool->random_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void admit(CurlProxyPool* pool, unsigned index)
+{
+    CurlProxy* proxy = &pool->proxies[index];
+    proxy->stats.ejected = false;
+    proxy->consecutive_failures = 0;
+    proxy->admitted_index = pool->num_admitted;
+    pool->admitted[pool->num_admitted++] = index;
+}
+
+static void eject(CurlProxyPool* pool, CurlProxy* proxy)
+{
+    // swap with the last admitted
+    unsigned last = pool->admitted[--pool->num_admitted];
+    pool->admitted[proxy->admitted_index] = last;
+    pool->proxies[last].admitted_index = proxy->admitted_index;
+
+    proxy->stats.ejected = true;
+    proxy->stats.ejections++;
+    proxy->readmit_ns = curl_trace_now() + pool->eject_ns;
+
+    unsigned tail = (pool->ejected_head + pool->num_ejected) % pool->num_proxies;
+    pool->ejected[tail] = proxy - pool->proxies;
+    pool->num_ejected++;
+}
+
+static void readmit(CurlProxyPool* pool)
+{
+    uint64_t now = curl_trace_now();
+    while (pool->num_ejected) {
+        unsigned index = pool->ejected[pool->ejected_head];
+        if (pool->proxies[index].readmit_ns > now && pool->num_admitted) {
+            break;
+        }
+        // the time has come, or no proxy is left
+        pool->ejected_head = (pool->ejected_head + 1) % pool->num_proxies;
+        pool->num_ejected--;
+        admit(pool, index);
+    }
+}
+
+static bool better(CurlProxyPool* pool, CurlProxy* a, CurlProxy* b)
+{
+    if (pool->policy == CURL_PROXY_FASTEST) {
+        // unknown latency is zero, so new proxies get tried first
+        double score_a = a->stats.latency_ms * (a->stats.in_flight + 1);
+        double score_b = b->stats.latency_ms * (b->stats.in_flight + 1);
+        return score_a < score_b;
+    }
+    if (a->stats.in_flight != b->stats.in_flight) {
+        return a->stats.in_flight < b->stats.in_flight;
+    }
+    return a->stats.latency_ms < b->stats.latency_ms;
+}
+
+void _curl_proxy_pool_assign(CurlSessionData* session, CurlRequestData* req)
+{
+    CurlProxyPool* pool = session->proxy_pool;
+
+    readmit(pool);
+
+    // power of two choices
+    uint64_t r = next_random(pool);
+    CurlProxy* proxy = &pool->proxies[pool->admitted[(r & 0xFFFFFFFF) % pool->num_admitted]];
+    CurlProxy* other = &pool->proxies[pool->admitted[(r >> 32) % pool->num_admitted]];
+    if (better(pool, other, proxy)) {
+        proxy = other;
+    }
+
+    curl_easy_setopt(req->easy_handle, CURLOPT_PROXY, proxy->url);
+    req->pool_proxy = proxy;
+    proxy->stats.in_flight++;
+    proxy->stats.requests++;
+}
+
+static bool is_connect_failure(CurlRequestData* req, CURLcode result)
+{
+    switch (result) {
+        case CURLE_COULDNT_RESOLVE_PROXY:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_SSL_CONNECT_ERROR:
+#if LIBCURL_VERSION_NUM >= 0x074900
+        case CURLE_PROXY:
+#endif
+            return true;
+
+        case CURLE_OPERATION_TIMEDOUT: {
+            // timed out before connection was established
+            curl_off_t connect_time = 0;
+            curl_easy_getinfo(req->easy_handle, CURLINFO_CONNECT_TIME_T, &connect_time);
+            return connect_time == 0;
+        }
+        default:
+            return false;
+    }
+}
+
+void _curl_proxy_pool_done(CurlSessionData* session, CurlRequestData* req, CURLcode result)
+{
+    CurlProxy* proxy = req->pool_proxy;
+    if (!proxy) {
+        return;
+    }
+    req->pool_proxy = nullptr;
+    proxy->stats.in_flight--;
+
+    if (req->cancelled) {
+        return;
+    }
+    if (is_connect_failure(req, result)) {
+        proxy->stats.failures++;
+        proxy->consecutive_failures++;
+        if (proxy->consecutive_failures >= session->proxy_pool->max_failures && !proxy->stats.ejected) {
+            eject(session->proxy_pool, proxy);
+        }
+        return;
+    }
+    proxy->consecutive_failures = 0;
+
+    curl_off_t ttfb;
+    if (curl_easy_getinfo(req->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb) == CURLE_OK && ttfb > 0) {
+        double latency_ms = ttfb / 1000.0;
+        if (proxy->stats.latency_ms == 0.0) {
+            proxy->stats.latency_ms = latency_ms;
+        } else {
+            proxy->stats.latency_ms += LATENCY_WEIGHT * (latency_ms - proxy->stats.latency_ms);
+        }
+    }
+}
+
+unsigned curl_session_num_proxies(UwValuePtr session)
+{
+    CurlProxyPool* pool = uw_curl_session_data_ptr(session)->proxy_pool;
+    return pool? pool->num_proxies : 0;
+}
+
+bool curl_session_proxy_stats(UwValuePtr session, unsigned index, char** proxy, CurlProxyStats* stats)
+{
+    CurlProxyPool* pool = uw_curl_session_data_ptr(session)->proxy_pool;
+    if (!pool || index >= pool->num_proxies) {
+        return false;
+    }
+    if (proxy) {
+        *proxy = pool->proxies[index].url;
+    }
+    *stats = pool->proxies[index].stats;
+    return true;
+}
+
+void curl_session_print_proxy_stats(UwValuePtr session, FILE* fp)
+{
+    CurlProxyPool* pool = uw_curl_session_data_ptr(session)->proxy_pool;
+    if (!pool) {
+        return;
+    }
+    for (unsigned i = 0; i < pool->num_proxies; i++) {
+        CurlProxy* proxy = &pool->proxies[i];
+        fprintf(fp, "Proxy %s: %llu requests, %llu failures, %llu ejections, %u in flight, latency %.1fms%s\n",
+                proxy->url,
+                (unsigned long long) proxy->stats.requests,
+                (unsigned long long) proxy->stats.failures,
+                (unsigned long long) proxy->stats.ejections,
+                proxy->stats.in_flight,
+                proxy->stats.latency_ms,
+                proxy->stats.ejected? " (ejected)" : "");
+    }
+}
@@ -0,0 +1,664 @@
+#define _GNU_SOURCE  // copy_file_range
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Content-addressed store.
+ *
+ * Layout of root directory:
+ *
+ *   objects/xx/<rest of digest>  content named by hex digest, read-only
+ *   tmp/                         staging files
+ *   index                        lines "<digest> <url> <name>"
+ *
+ * The sink stages content to a temporary file while it is hashed.
+ * When the request is complete, the staging file is linked to the object path.
+ * link() never replaces existing file, so EEXIST means the same content
+ * is already stored, and the staging file is simply removed.
+ *
+ * Names are hardlinks or reflinks of objects. Hardlinked names share the inode
+ * with the object, that's why objects are read-only.
+ *
+ * The store is opened on first use: directories are created and the index
+ * is loaded into a map, the last line for a URL wins. New lines are appended
+ * with single write() calls to the file opened with O_APPEND.
+ */
+
+typedef struct {
+    _UwValue root;
+    CurlDigestAlgorithm algorithm;
+    CurlStoreLinkMode link_mode;
+
+    pthread_mutex_t lock;  // protects fields below
+    bool opened;
+    bool open_failed;
+    int index_fd;
+    _UwValue index;  // url -> "<digest> <name>"
+    CurlStoreStats stats;
+
+    _Atomic unsigned next_link;  // makes names of temporary links unique
+
+} CurlStoreData;
+
+#define store_data_ptr(value)  ((CurlStoreData*) _uw_get_data_ptr((value), UwTypeId_CurlStore))
+
+UwTypeId UwTypeId_CurlStore = 0;
+
+// root + "/objects/xx/" + digest
+#define OBJECT_PATH_SIZE(root)  (strlen(root) + sizeof("/objects/xx/") + CURL_DIGEST_MAX_SIZE * 2)
+
+/****************************************************************
+ * Files
+ */
+
+static bool make_dir(char* path)
+{
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static bool write_all(int fd, uint8_t* data, size_t size)
+{
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(__func__);
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void object_path(char* root, char* digest, char* path, size_t size)
+{
+    snprintf(path, size, "%s/objects/%.2s/%s", root, digest, digest + 2);
+}
+
+static bool copy_object(char* object, char* dest)
+/*
+ * Clone object with reflink if the filesystem supports that, copy otherwise.
+ */
+{
+    int src = open(object, O_RDONLY | O_CLOEXEC);
+    if (src == -1) {
+        perror(object);
+        return false;
+    }
+    int dst = open(dest, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst == -1) {
+        perror(dest);
+        close(src);
+        return false;
+    }
+    bool result = true;
+    if (ioctl(dst, FICLONE, src) == -1) {
+        // copy_file_range copies in the kernel, and can make reflinks across mount points
+        struct stat st;
+        off_t remaining = (fstat(src, &st) == 0)? st.st_size : 0;
+        while (remaining > 0) {
+            ssize_t n = copy_file_range(src, nullptr, dst, nullptr, remaining, 0);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                perror(dest);
+                result = false;
+                break;
+            }
+            remaining -= n;
+        }
+    }
+    close(src);
+    close(dst);
+    return result;
+}
+
+static bool link_object(CurlStoreData* store, char* object, char* name)
+/*
+ * Make name refer to the object. Existing name is replaced atomically:
+ * the link is made next to it and renamed over.
+ */
+{
+    struct stat object_st;
+    struct stat name_st;
+    if (stat(object, &object_st) == -1) {
+        perror(object);
+        return false;
+    }
+    if (stat(name, &name_st) == 0 && name_st.st_dev == object_st.st_dev && name_st.st_ino == object_st.st_ino) {
+        // already linked, rename would do nothing
+        return true;
+    }
+
+    char tmp_name[strlen(name) + 32];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%u.link", name, atomic_fetch_add(&store->next_link, 1));
+
+    bool linked = false;
+    if (store->link_mode == CURL_STORE_HARDLINK) {
+        linked = link(object, tmp_name) == 0;
+        if (!linked && errno != EXDEV && errno != EPERM && errno != EMLINK) {
+            perror(tmp_name);
+            return false;
+        }
+        // other filesystem or no hardlinks, fall back to copy
+    }
+    if (!linked && !copy_object(object, tmp_name)) {
+        unlink(tmp_name);
+        return false;
+    }
+    if (rename(tmp_name, name) == -1) {
+        perror(name);
+        unlink(tmp_name);
+        return false;
+    }
+    return true;
+}
+
+/****************************************************************
+ * Index
+ */
+
+static bool index_put(CurlStoreData* store, char* url, char* digest, char* name)
+/*
+ * Update index map, must be called with store lock held.
+ */
+{
+    UwValue key = uw_create_string(url);
+    if (uw_error(&key)) {
+        return false;
+    }
+
+    char entry_cstr[strlen(digest) + strlen(name) + 2];
+    snprintf(entry_cstr, sizeof(entry_cstr), "%s %s", digest, name);
+
+    UwValue entry = uw_create_string(entry_cstr);
+    if (uw_error(&entry)) {
+        return false;
+    }
+    UwValue status = uw_map_update(&store->index, &key, &entry);
+    return !uw_error(&status);
+}
+
+static bool load_index(CurlStoreData* store, char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        perror(path);
+        return false;
+    }
+    bool result = true;
+    char* line = nullptr;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, fp)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[--length] = 0;
+        }
+        // <digest> <url> <name>
+        char* url = strchr(line, ' ');
+        if (!url) {
+            continue;
+        }
+        *url++ = 0;
+        char* name = strchr(url, ' ');
+        if (!name) {
+            continue;
+        }
+        *name++ = 0;
+        if (strlen(line) != curl_digest_size(store->algorithm) * 2) {
+            // made with other algorithm
+            continue;
+        }
+        if (!index_put(store, url, line, name)) {
+            result = false;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return result;
+}
+
+static bool append_index(CurlStoreData* store, char* url, char* digest, char* name)
+/*
+ * Add URL to the index, must be called with store lock held.
+ */
+{
+    if (strchr(url, ' ') || strchr(url, '\n') || strchr(name, '\n')) {
+        // cannot be parsed back
+        return true;
+    }
+    if (!index_put(store, url, digest, name)) {
+        return false;
+    }
+    size_t size = strlen(digest) + strlen(url) + strlen(name) + 4;
+    char line[size];
+    snprintf(line, size, "%s %s %s\n", digest, url, name);
+    return write_all(store->index_fd, (uint8_t*) line, size - 1);
+}
+
+static bool open_store(CurlStoreData* store)
+/*
+ * Create directories and load index on first use, must be called with store lock held.
+ */
+{
+    if (store->opened) {
+        return true;
+    }
+    if (store->open_failed) {
+        return false;
+    }
+    store->open_failed = true;
+
+    UW_CSTRING_LOCAL(root_cstr, &store->root);
+    char path[strlen(root_cstr) + 16];
+
+    strcpy(path, root_cstr);
+    if (!make_dir(path)) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "%s/objects", root_cstr);
+    if (!make_dir(path)) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "%s/tmp", root_cstr);
+    if (!make_dir(path)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/index", root_cstr);
+    if (!load_index(store, path)) {
+        fprintf(stderr, "ERROR: cannot load store index %s\n", path);
+        return false;
+    }
+    store->index_fd = open(path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+    if (store->index_fd == -1) {
+        perror(path);
+        return false;
+    }
+    store->open_failed = false;
+    store->opened = true;
+    return true;
+}
+
+static bool lock_store(CurlStoreData* store)
+/*
+ * Lock the store and open it if necessary. Return false with the lock released on failure.
+ */
+{
+    pthread_mutex_lock(&store->lock);
+    if (!open_store(store)) {
+        pthread_mutex_unlock(&store->lock);
+        return false;
+    }
+    return true;
+}
+
+/****************************************************************
+ * Store type
+ */
+
+static void fini_store(UwValuePtr self)
+{
+    CurlStoreData* store = store_data_ptr(self);
+
+    if (store->index_fd >= 0) {
+        close(store->index_fd);
+    }
+    pthread_mutex_destroy(&store->lock);
+    uw_destroy(&store->index);
+    uw_destroy(&store->root);
+
+    uw_ancestor_of(UwTypeId_CurlStore)->fini(self);
+}
+
+static UwResult init_store(UwValuePtr self, void* ctor_args)
+{
+    UwValue status = uw_ancestor_of(UwTypeId_CurlStore)->init(self, ctor_args);
+    uw_return_if_error(&status);
+
+    CurlStoreData* store = store_data_ptr(self);
+    pthread_mutex_init(&store->lock, nullptr);
+    store->index_fd = -1;
+    return UwOK();
+}
+
+UwResult curl_store(UwValuePtr root, CurlDigestAlgorithm algorithm, CurlStoreLinkMode link_mode)
+{
+    UwValue result = uw_create(UwTypeId_CurlStore);
+    uw_return_if_error(&result);
+
+    CurlStoreData* store = store_data_ptr(&result);
+    store->index = UwMap();
+    uw_return_if_error(&store->index);
+
+    store->root = uw_clone(root);
+    store->algorithm = algorithm;
+    store->link_mode = link_mode;
+    return uw_move(&result);
+}
+
+bool curl_store_lookup(UwValuePtr self, UwValuePtr url, UwValuePtr digest, UwValuePtr name)
+{
+    CurlStoreData* store = store_data_ptr(self);
+
+    if (!lock_store(store)) {
+        return false;
+    }
+    {
+        // make new strings, values of the map must not be shared with other threads
+        UwValue entry = uw_map_get(&store->index, url);
+        if (uw_is_string(&entry)) {
+            UW_CSTRING_LOCAL(entry_cstr, &entry);
+            char* name_cstr = strchr(entry_cstr, ' ');
+            *name_cstr++ = 0;
+            *digest = uw_create_string(entry_cstr);
+            *name = uw_create_string(name_cstr);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (!uw_is_string(digest) || !uw_is_string(name)) {
+        return false;
+    }
+    UW_CSTRING_LOCAL(root_cstr, &store->root);
+    UW_CSTRING_LOCAL(digest_cstr, digest);
+    char path[OBJECT_PATH_SIZE(root_cstr)];
+    object_path(root_cstr, digest_cstr, path, sizeof(path));
+    if (access(path, F_OK) == -1) {
+        // removed from the store
+        return false;
+    }
+    pthread_mutex_lock(&store->lock);
+    store->stats.index_hits++;
+    pthread_mutex_unlock(&store->lock);
+    return true;
+}
+
+bool curl_store_link(UwValuePtr self, UwValuePtr digest, UwValuePtr name)
+{
+    CurlStoreData* store = store_data_ptr(self);
+
+    UW_CSTRING_LOCAL(root_cstr, &store->root);
+    UW_CSTRING_LOCAL(digest_cstr, digest);
+    UW_CSTRING_LOCAL(name_cstr, name);
+
+    char path[OBJECT_PATH_SIZE(root_cstr)];
+    object_path(root_cstr, digest_cstr, path, sizeof(path));
+    if (!link_object(store, path, name_cstr)) {
+        return false;
+    }
+    pthread_mutex_lock(&store->lock);
+    store->stats.names_linked++;
+    pthread_mutex_unlock(&store->lock);
+    return true;
+}
+
+void curl_store_stats(UwValuePtr self, CurlStoreStats* stats)
+{
+    CurlStoreData* store = store_data_ptr(self);
+
+    pthread_mutex_lock(&store->lock);
+    *stats = store->stats;
+    pthread_mutex_unlock(&store->lock);
+}
+
+static bool commit_object(CurlStoreData* store, char* staging_path, char* digest, uint64_t size)
+/*
+ * Link staging file to the object path unless the content is already stored.
+ */
+{
+    UW_CSTRING_LOCAL(root_cstr, &store->root);
+    char path[OBJECT_PATH_SIZE(root_cstr)];
+    object_path(root_cstr, digest, path, sizeof(path));
+
+    // fan-out directory
+    char* slash = strrchr(path, '/');
+    *slash = 0;
+    bool dir_ok = make_dir(path);
+    *slash = '/';
+    if (!dir_ok) {
+        return false;
+    }
+
+    bool stored = true;
+    if (link(staging_path, path) == -1) {
+        if (errno != EEXIST) {
+            perror(path);
+            return false;
+        }
+        stored = false;
+    }
+    pthread_mutex_lock(&store->lock);
+    if (stored) {
+        store->stats.objects_stored++;
+        store->stats.bytes_stored += size;
+    } else {
+        store->stats.objects_reused++;
+        store->stats.bytes_reused += size;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return true;
+}
+
+/****************************************************************
+ * Sink stage
+ */
+
+typedef struct {
+    _UwValue store;
+    _UwValue name;          // null if content is not linked to a name
+    _UwValue staging_path;  // null if staging file is not created
+    int fd;
+    bool own_digest;        // request digest does not include the algorithm of the store
+    CurlDigest digest;
+
+} CurlStoreSinkData;
+
+#define store_sink_data_ptr(value)  ((CurlStoreSinkData*) _uw_get_data_ptr((value), UwTypeId_CurlStoreSink))
+
+UwTypeId UwTypeId_CurlStoreSink = 0;
+
+static void fini_store_sink(UwValuePtr self)
+{
+    CurlStoreSinkData* sink = store_sink_data_ptr(self);
+
+    if (sink->fd >= 0) {
+        close(sink->fd);
+        sink->fd = -1;
+    }
+    if (uw_is_string(&sink->staging_path)) {
+        // not committed
+        UW_CSTRING_LOCAL(path_cstr, &sink->staging_path);
+        unlink(path_cstr);
+    }
+    if (sink->own_digest) {
+        curl_digest_fini(&sink->digest);
+    }
+    uw_destroy(&sink->staging_path);
+    uw_destroy(&sink->name);
+    uw_destroy(&sink->store);
+
+    uw_ancestor_of(UwTypeId_CurlStoreSink)->fini(self);
+}
+
+static bool start_staging(CurlStoreSinkData* sink, CurlRequestData* req)
+{
+    CurlStoreData* store = store_data_ptr(&sink->store);
+
+    if (!lock_store(store)) {
+        return false;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    UW_CSTRING_LOCAL(root_cstr, &store->root);
+    char path[strlen(root_cstr) + sizeof("/tmp/XXXXXX")];
+    snprintf(path, sizeof(path), "%s/tmp/XXXXXX", root_cstr);
+
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        perror(path);
+        return false;
+    }
+    sink->staging_path = uw_create_string(path);
+    if (uw_error(&sink->staging_path)) {
+        close(fd);
+        unlink(path);
+        return false;
+    }
+    sink->fd = fd;
+
+    // hash once if the request computes the same digest
+    if (!(req->digest && (req->digest->algorithms & store->algorithm))) {
+        if (!curl_digest_init(&sink->digest, store->algorithm)) {
+            return false;
+        }
+        sink->own_digest = true;
+    }
+    return true;
+}
+
+static CurlStageResult store_sink_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    CurlStoreSinkData* sink = store_sink_data_ptr(self);
+
+    if (sink->fd < 0 && !start_staging(sink, uw_curl_request_data_ptr(request))) {
+        return CURL_STAGE_ABORT;
+    }
+    if (!write_all(sink->fd, data, size)) {
+        return CURL_STAGE_ABORT;
+    }
+    if (sink->own_digest) {
+        curl_digest_update(&sink->digest, data, size);
+    }
+    return CURL_STAGE_CONSUMED;
+}
+
+static void store_sink_complete(UwValuePtr self, UwValuePtr request)
+{
+    CurlStoreSinkData* sink = store_sink_data_ptr(self);
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+    CurlStoreData* store = store_data_ptr(&sink->store);
+
+    if (sink->fd < 0 && !start_staging(sink, req)) {
+        // empty content is stored too
+        return;
+    }
+    UW_CSTRING_LOCAL(url_cstr, &req->url);
+
+    CurlDigest* digest = sink->own_digest? &sink->digest : req->digest;
+    curl_digest_final(digest);
+    if (digest->mismatch || (req->digest && req->digest->mismatch)) {
+        fprintf(stderr, "ERROR: not storing %s, digest or size mismatch\n", url_cstr);
+        return;
+    }
+
+    // objects must not be modified through hardlinked names
+    fchmod(sink->fd, 0444);
+    close(sink->fd);
+    sink->fd = -1;
+
+    UwValue hex = curl_digest_hex(digest, store->algorithm);
+    if (!uw_is_string(&hex)) {
+        return;
+    }
+    UW_CSTRING_LOCAL(digest_cstr, &hex);
+    UW_CSTRING_LOCAL(staging_cstr, &sink->staging_path);
+
+    bool committed = commit_object(store, staging_cstr, digest_cstr, digest->size);
+    unlink(staging_cstr);
+    uw_destroy(&sink->staging_path);
+    if (!committed) {
+        fprintf(stderr, "ERROR: cannot store %s\n", url_cstr);
+        return;
+    }
+
+    if (uw_is_string(&sink->name) && !curl_store_link(&sink->store, &hex, &sink->name)) {
+        return;
+    }
+    UwValue name = uw_is_string(&sink->name)? uw_clone(&sink->name) : UwString();
+    UW_CSTRING_LOCAL(name_cstr, &name);
+
+    pthread_mutex_lock(&store->lock);
+    if (!append_index(store, url_cstr, digest_cstr, name_cstr)) {
+        fprintf(stderr, "ERROR: cannot update store index for %s\n", url_cstr);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+static UwInterface_CurlStage store_sink_interface = {
+    .process  = store_sink_process,
+    .complete = store_sink_complete
+};
+
+UwResult curl_store_sink(UwValuePtr store)
+{
+    UwValue result = uw_create(UwTypeId_CurlStoreSink);
+    uw_return_if_error(&result);
+
+    CurlStoreSinkData* sink = store_sink_data_ptr(&result);
+    sink->store = uw_clone(store);
+    sink->fd = -1;
+    return uw_move(&result);
+}
+
+void curl_store_sink_set_name(UwValuePtr stage, UwValuePtr name)
+{
+    CurlStoreSinkData* sink = store_sink_data_ptr(stage);
+
+    uw_destroy(&sink->name);
+    sink->name = uw_clone(name);
+}
+
+/****************************************************************
+ * Types
+ */
+
+static UwType store_type;
+static UwType store_sink_type;
+
+[[ gnu::constructor ]]
+static void init()
+{
+    _curl_register_stage_interface();
+
+    UwTypeId_CurlStore = uw_subtype(
+        &store_type, "CurlStore",
+        UwTypeId_Struct,
+        CurlStoreData
+    );
+    store_type.init = init_store;
+    store_type.fini = fini_store;
+
+    UwTypeId_CurlStoreSink = uw_subtype(
+        &store_sink_type, "CurlStoreSink",
+        UwTypeId_Struct,
+        CurlStoreSinkData,
+        UwInterfaceId_CurlStage, &store_sink_interface
+    );
+    store_sink_type.fini = fini_store_sink;
+}
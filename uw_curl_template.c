@@ -0,0 +1,191 @@
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Request templates.
+ *
+ * Options are set once on the prototype handle, requests get them with
+ * curl_easy_duphandle. Header lists are not copied by duphandle, so stamped
+ * requests point to the list of template and hold a reference to it.
+ */
+
+UwTypeId UwTypeId_CurlRequestTemplate = 0;
+
+static void fini_curl_template(UwValuePtr self)
+{
+    CurlTemplateData* tmpl = uw_curl_template_data_ptr(self);
+
+    if (tmpl->easy_handle) {
+        curl_easy_cleanup(tmpl->easy_handle);
+        tmpl->easy_handle = nullptr;
+    }
+    if (tmpl->headers) {
+        curl_slist_free_all(tmpl->headers);
+        tmpl->headers = nullptr;
+    }
+    uw_destroy(&tmpl->proxy);
+
+    uw_ancestor_of(UwTypeId_CurlRequestTemplate)->fini(self);
+}
+
+static UwResult init_curl_template(UwValuePtr self, void* ctor_args)
+{
+    UwValue status = uw_ancestor_of(UwTypeId_CurlRequestTemplate)->init(self, ctor_args);
+    uw_return_if_error(&status);
+
+    CurlTemplateData* tmpl = uw_curl_template_data_ptr(self);
+
+    tmpl->proxy = UwString();
+    tmpl->follow_location = true;  // as set by _curl_setup_easy_handle
+
+    tmpl->easy_handle = curl_easy_init();
+    if (!tmpl->easy_handle) {
+        fprintf(stderr, "Cannot make CURL handle\n");
+        fini_curl_template(self);
+        return UwOOM();  // XXX use Curl error
+    }
+    if (!_curl_setup_easy_handle(tmpl->easy_handle)) {
+        fini_curl_template(self);
+        return UwOOM();
+    }
+    return UwOK();
+}
+
+UwResult curl_request_template()
+{
+    return uw_create(UwTypeId_CurlRequestTemplate);
+}
+
+static CurlTemplateData* mutable_template(UwValuePtr self)
+{
+    CurlTemplateData* tmpl = uw_curl_template_data_ptr(self);
+    if (tmpl->frozen) {
+        fprintf(stderr, "ERROR: request template is immutable once used\n");
+        return nullptr;
+    }
+    return tmpl;
+}
+
+bool curl_template_set_proxy(UwValuePtr self, UwValuePtr proxy)
+{
+    if (!uw_is_string(proxy)) {
+        return true;
+    }
+    CurlTemplateData* tmpl = mutable_template(self);
+    if (!tmpl) {
+        return false;
+    }
+    UW_CSTRING_LOCAL(proxy_cstr, proxy);
+    curl_easy_setopt(tmpl->easy_handle, CURLOPT_PROXY, proxy_cstr);
+    uw_destroy(&tmpl->proxy);
+    tmpl->proxy = uw_clone(proxy);
+    return true;
+}
+
+bool curl_template_set_cookie(UwValuePtr self, UwValuePtr cookie)
+{
+    if (!uw_is_string(cookie)) {
+        return true;
+    }
+    CurlTemplateData* tmpl = mutable_template(self);
+    if (!tmpl) {
+        return false;
+    }
+    UW_CSTRING_LOCAL(cookie_cstr, cookie);
+    curl_easy_setopt(tmpl->easy_handle, CURLOPT_COOKIE, cookie_cstr);
+    return true;
+}
+
+bool curl_template_set_headers(UwValuePtr self, char* http_headers[], unsigned num_headers)
+{
+    CurlTemplateData* tmpl = mutable_template(self);
+    if (!tmpl) {
+        return false;
+    }
+    if (!tmpl->headers && !_curl_copy_headers(&tmpl->headers, _curl_default_headers())) {
+        return false;
+    }
+    for (size_t i = 0; i < num_headers; i++) {
+        struct curl_slist* temp = curl_slist_append(tmpl->headers, http_headers[i]);
+        if (!temp) {
+            fprintf(stderr, "Cannot make headers\n");
+            return false;
+        }
+        tmpl->headers = temp;
+    }
+    curl_easy_setopt(tmpl->easy_handle, CURLOPT_HTTPHEADER, tmpl->headers);
+    return true;
+}
+
+bool curl_template_verbose(UwValuePtr self, bool verbose)
+{
+    CurlTemplateData* tmpl = mutable_template(self);
+    if (!tmpl) {
+        return false;
+    }
+    curl_easy_setopt(tmpl->easy_handle, CURLOPT_VERBOSE, (long) verbose);
+    return true;
+}
+
+bool curl_template_follow_location(UwValuePtr self, bool follow)
+{
+    CurlTemplateData* tmpl = mutable_template(self);
+    if (!tmpl) {
+        return false;
+    }
+    curl_easy_setopt(tmpl->easy_handle, CURLOPT_FOLLOWLOCATION, (long) follow);
+    tmpl->follow_location = follow;
+    return true;
+}
+
+bool curl_template_set_decode_mode(UwValuePtr self, CurlDecodeMode mode)
+{
+    CurlTemplateData* tmpl = mutable_template(self);
+    if (!tmpl) {
+        return false;
+    }
+    curl_easy_setopt(tmpl->easy_handle, CURLOPT_HTTP_CONTENT_DECODING, (long) (mode == CURL_DECODE_INLINE));
+    tmpl->decode_mode = mode;
+    return true;
+}
+
+CURL* curl_template_easy_handle(UwValuePtr self)
+{
+    CurlTemplateData* tmpl = mutable_template(self);
+    return tmpl? tmpl->easy_handle : nullptr;
+}
+
+UwResult curl_request_from_template(UwValuePtr self, UwTypeId type_id, UwValuePtr url)
+{
+    CurlTemplateData* tmpl = uw_curl_template_data_ptr(self);
+
+    // no more changes, stamped requests share the header list
+    tmpl->frozen = true;
+
+    // init method of CurlRequest duplicates the handle of template
+    _curl_stamping_template = tmpl;
+    UwValue request = uw_create(type_id);
+    _curl_stamping_template = nullptr;
+    uw_return_if_error(&request);
+
+    CurlRequestData* req = uw_curl_request_data_ptr(&request);
+    req->request_template = uw_clone(self);
+
+    curl_request_set_url(&request, url);
+    return uw_move(&request);
+}
+
+static UwType curl_template_type;
+
+[[ gnu::constructor ]]
+static void init()
+{
+    UwTypeId_CurlRequestTemplate = uw_subtype(
+        &curl_template_type, "CurlRequestTemplate",
+        UwTypeId_Struct,
+        CurlTemplateData
+    );
+    curl_template_type.init = init_curl_template;
+    curl_template_type.fini = fini_curl_template;
+}
@@ -0,0 +1,164 @@
+#include <stdatomic.h>
+#include <time.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Tracing.
+ *
+ * Each thread writes spans to its own ring buffer, so recording needs no locks.
+ * The mutex protects only the list of buffers, which is updated once per thread.
+ * When the ring is full, oldest spans are overwritten.
+ */
+
+#define TRACE_RING_SIZE  65536  // must be power of two
+
+typedef struct {
+    char* name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t request_id;
+    int64_t  arg;
+
+} TraceEvent;
+
+typedef struct _TraceBuffer {
+    struct _TraceBuffer* next;
+    unsigned thread_index;
+    _Atomic uint64_t head;  // total number of events written
+    TraceEvent events[TRACE_RING_SIZE];
+
+} TraceBuffer;
+
+bool curl_trace_enabled = false;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer* trace_buffers = nullptr;
+static unsigned num_trace_buffers = 0;
+static _Atomic uint64_t trace_request_id = 0;
+static uint64_t trace_epoch_ns = 0;
+
+static _Thread_local TraceBuffer* thread_buffer = nullptr;
+
+uint64_t curl_trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void curl_trace_enable(bool enable)
+{
+    if (enable && trace_epoch_ns == 0) {
+        trace_epoch_ns = curl_trace_now();
+    }
+    curl_trace_enabled = enable;
+}
+
+uint64_t _curl_trace_request_id()
+{
+    return atomic_fetch_add_explicit(&trace_request_id, 1, memory_order_relaxed) + 1;
+}
+
+static TraceBuffer* get_thread_buffer()
+{
+    if (thread_buffer) {
+        return thread_buffer;
+    }
+    TraceBuffer* buffer = default_allocator.allocate(sizeof(TraceBuffer), true);
+    if (!buffer) {
+        return nullptr;
+    }
+    pthread_mutex_lock(&trace_lock);
+    buffer->thread_index = ++num_trace_buffers;
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_lock);
+
+    thread_buffer = buffer;
+    return buffer;
+}
+
+void _curl_trace_span(char* name, uint64_t start_ns, uint64_t end_ns, uint64_t request_id, int64_t arg)
+{
+    TraceBuffer* buffer = get_thread_buffer();
+    if (!buffer) {
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    TraceEvent* event = &buffer->events[head & (TRACE_RING_SIZE - 1)];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->duration_ns = (end_ns > start_ns)? end_ns - start_ns : 0;
+    event->request_id = request_id;
+    event->arg = arg;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+void _curl_trace_transfer_phases(CurlRequestData* req)
+/*
+ * Make spans from transfer timings.
+ * Timings are in microseconds since transfer start, which is close to the time
+ * the request was added to multi handle.
+ */
+{
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_NAMELOOKUP_TIME_T,    &namelookup);
+    curl_easy_getinfo(req->easy_handle, CURLINFO_CONNECT_TIME_T,       &connect);
+    curl_easy_getinfo(req->easy_handle, CURLINFO_APPCONNECT_TIME_T,    &appconnect);
+    curl_easy_getinfo(req->easy_handle, CURLINFO_PRETRANSFER_TIME_T,   &pretransfer);
+    curl_easy_getinfo(req->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(req->easy_handle, CURLINFO_TOTAL_TIME_T,         &total);
+
+    uint64_t base = req->trace_start_ns;
+    uint64_t id = req->trace_id;
+
+    _curl_trace_span("dns", base, base + namelookup * 1000, id, 0);
+    if (connect) {
+        _curl_trace_span("connect", base + namelookup * 1000, base + connect * 1000, id, 0);
+    }
+    if (appconnect) {
+        _curl_trace_span("tls", base + connect * 1000, base + appconnect * 1000, id, 0);
+    }
+    if (starttransfer) {
+        _curl_trace_span("first byte", base + pretransfer * 1000, base + starttransfer * 1000, id, 0);
+        _curl_trace_span("transfer", base + starttransfer * 1000, base + total * 1000, id, 0);
+    }
+}
+
+bool curl_trace_dump(FILE* fp)
+/*
+ * Write collected spans in Chrome trace event format.
+ * Spans of transfer phases are placed in separate process with request id as thread id.
+ * Should be called when other threads do not record spans.
+ */
+{
+    fputs("{\"traceEvents\":[\n", fp);
+    fputs("{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"threads\"}},\n", fp);
+    fputs("{\"ph\":\"M\",\"pid\":2,\"name\":\"process_name\",\"args\":{\"name\":\"requests\"}}", fp);
+
+    pthread_mutex_lock(&trace_lock);
+    for (TraceBuffer* buffer = trace_buffers; buffer; buffer = buffer->next) {
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t start = (head > TRACE_RING_SIZE)? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = start; i < head; i++) {
+            TraceEvent* event = &buffer->events[i & (TRACE_RING_SIZE - 1)];
+            uint64_t ts = (event->start_ns > trace_epoch_ns)? event->start_ns - trace_epoch_ns : 0;
+            fprintf(fp, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%llu,"
+                        "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"args\":{\"arg\":%lld}}",
+                    event->name,
+                    event->request_id? 2 : 1,
+                    (unsigned long long) (event->request_id? event->request_id : buffer->thread_index),
+                    (unsigned long long) (ts / 1000), (unsigned long long) (ts % 1000),
+                    (unsigned long long) (event->duration_ns / 1000),
+                    (unsigned long long) (event->duration_ns % 1000),
+                    (long long) event->arg);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    fputs("\n]}\n", fp);
+    return !ferror(fp);
+}
@@ -0,0 +1,658 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#if __has_include(<zstd.h>)
+#   include <zstd.h>
+#   define UW_CURL_HAVE_ZSTD
+#endif
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * WARC/1.1 archiving.
+ *
+ * The sink stage keeps response body in CurlBuffer because WARC record header
+ * needs the length of the block. When request is complete, request and response
+ * records are written to the segment of the current thread, so completions
+ * running in worker threads do not contend for a file.
+ *
+ * Each record is a separate gzip member or zstd frame.
+ *
+ * Response block is rebuilt from the status and header index of CURL.
+ * CURL decodes content, so Content-Encoding and Transfer-Encoding headers
+ * are dropped and Content-Length is set to the size of stored body.
+ * If decoding is turned off with curl_request_set_decode_mode, the body
+ * is stored as received and Content-Encoding is kept.
+ */
+
+#define OUT_BUFFER_SIZE  (64 * 1024)
+
+typedef struct {
+    pthread_t owner;
+    int fd;
+    uint64_t size;
+    uint8_t* out;  // compressed output
+    z_stream zs;
+    bool zs_initialized;
+#ifdef UW_CURL_HAVE_ZSTD
+    ZSTD_CCtx* cctx;
+#endif
+
+} WarcSegment;
+
+typedef struct {
+    _UwValue prefix;
+    CurlWarcCompression compression;
+    uint64_t max_segment_size;
+
+    pthread_mutex_t lock;  // serializes adding segments
+    _Atomic unsigned num_segments;
+    _Atomic unsigned next_number;
+    WarcSegment segments[CURL_WARC_MAX_SEGMENTS];
+
+} CurlWarcWriterData;
+
+#define warc_writer_data_ptr(value)  ((CurlWarcWriterData*) _uw_get_data_ptr((value), UwTypeId_CurlWarcWriter))
+
+UwTypeId UwTypeId_CurlWarcWriter = 0;
+
+/****************************************************************
+ * Segments
+ */
+
+static bool write_all(int fd, uint8_t* data, size_t size)
+{
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(__func__);
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void close_segment(WarcSegment* segment)
+{
+    if (segment->fd >= 0) {
+        close(segment->fd);
+        segment->fd = -1;
+    }
+    segment->size = 0;
+}
+
+static void fini_segment(WarcSegment* segment)
+{
+    close_segment(segment);
+    if (segment->zs_initialized) {
+        deflateEnd(&segment->zs);
+        segment->zs_initialized = false;
+    }
+#ifdef UW_CURL_HAVE_ZSTD
+    if (segment->cctx) {
+        ZSTD_freeCCtx(segment->cctx);
+        segment->cctx = nullptr;
+    }
+#endif
+    if (segment->out) {
+        default_allocator.release((void**) &segment->out, OUT_BUFFER_SIZE);
+    }
+}
+
+static WarcSegment* get_segment(CurlWarcWriterData* writer)
+/*
+ * Find segment of the current thread or add new one.
+ */
+{
+    pthread_t self = pthread_self();
+
+    unsigned n = atomic_load_explicit(&writer->num_segments, memory_order_acquire);
+    for (unsigned i = 0; i < n; i++) {
+        if (pthread_equal(writer->segments[i].owner, self)) {
+            return &writer->segments[i];
+        }
+    }
+
+    WarcSegment* segment = nullptr;
+    pthread_mutex_lock(&writer->lock);
+    n = atomic_load_explicit(&writer->num_segments, memory_order_relaxed);
+    if (n < CURL_WARC_MAX_SEGMENTS) {
+        segment = &writer->segments[n];
+        segment->owner = self;
+        segment->fd = -1;
+        // publish after initialization
+        atomic_store_explicit(&writer->num_segments, n + 1, memory_order_release);
+    } else {
+        fprintf(stderr, "ERROR: too many threads write WARC records\n");
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return segment;
+}
+
+static bool write_record_raw(CurlWarcWriterData* writer, WarcSegment* segment, void* data, size_t size)
+{
+    if (!write_all(segment->fd, data, size)) {
+        return false;
+    }
+    segment->size += size;
+    return true;
+}
+
+static bool write_record_data(CurlWarcWriterData* writer, WarcSegment* segment,
+                              void* data, size_t size, bool end)
+/*
+ * Compress and write part of record. The last part must be written with end = true.
+ */
+{
+    switch (writer->compression) {
+        case CURL_WARC_GZIP: {
+            z_stream* zs = &segment->zs;
+            uint8_t* p = data;
+            do {
+                // avail_in is 32-bit
+                size_t n = (size > (1 << 30))? (1 << 30) : size;
+                bool last = (n == size);
+                zs->next_in = p;
+                zs->avail_in = n;
+                int rc;
+                do {
+                    zs->next_out = segment->out;
+                    zs->avail_out = OUT_BUFFER_SIZE;
+                    rc = deflate(zs, (end && last)? Z_FINISH : Z_NO_FLUSH);
+                    if (rc == Z_STREAM_ERROR) {
+                        fprintf(stderr, "ERROR: deflate failed\n");
+                        return false;
+                    }
+                    if (!write_record_raw(writer, segment, segment->out, OUT_BUFFER_SIZE - zs->avail_out)) {
+                        return false;
+                    }
+                } while (zs->avail_out == 0 || (end && last && rc != Z_STREAM_END));
+                p += n;
+                size -= n;
+            } while (size);
+            return true;
+        }
+#ifdef UW_CURL_HAVE_ZSTD
+        case CURL_WARC_ZSTD: {
+            ZSTD_inBuffer in = { .src = data, .size = size, .pos = 0 };
+            ZSTD_EndDirective mode = end? ZSTD_e_end : ZSTD_e_continue;
+            for (;;) {
+                ZSTD_outBuffer out = { .dst = segment->out, .size = OUT_BUFFER_SIZE, .pos = 0 };
+                size_t remaining = ZSTD_compressStream2(segment->cctx, &out, &in, mode);
+                if (ZSTD_isError(remaining)) {
+                    fprintf(stderr, "ERROR: %s\n", ZSTD_getErrorName(remaining));
+                    return false;
+                }
+                if (!write_record_raw(writer, segment, segment->out, out.pos)) {
+                    return false;
+                }
+                if (end? remaining == 0 : in.pos == in.size) {
+                    return true;
+                }
+            }
+        }
+#endif
+        default:
+            return write_record_raw(writer, segment, data, size);
+    }
+}
+
+static bool begin_record(CurlWarcWriterData* writer, WarcSegment* segment)
+{
+    switch (writer->compression) {
+        case CURL_WARC_GZIP:
+            return deflateReset(&segment->zs) == Z_OK;
+#ifdef UW_CURL_HAVE_ZSTD
+        case CURL_WARC_ZSTD:
+            return !ZSTD_isError(ZSTD_CCtx_reset(segment->cctx, ZSTD_reset_session_only));
+#endif
+        default:
+            return true;
+    }
+}
+
+static bool init_compressor(CurlWarcWriterData* writer, WarcSegment* segment)
+{
+    if (writer->compression == CURL_WARC_PLAIN) {
+        return true;
+    }
+    if (!segment->out) {
+        segment->out = default_allocator.allocate(OUT_BUFFER_SIZE, false);
+        if (!segment->out) {
+            return false;
+        }
+    }
+    if (writer->compression == CURL_WARC_GZIP && !segment->zs_initialized) {
+        // 16 added to window bits makes gzip format
+        if (deflateInit2(&segment->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        segment->zs_initialized = true;
+    }
+#ifdef UW_CURL_HAVE_ZSTD
+    if (writer->compression == CURL_WARC_ZSTD && !segment->cctx) {
+        segment->cctx = ZSTD_createCCtx();
+        if (!segment->cctx) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+static void make_uuid(char* buffer)
+/*
+ * Make random UUID, buffer must have room for 37 chars.
+ */
+{
+    uint8_t b[16];
+    if (getrandom(b, sizeof(b), 0) != sizeof(b)) {
+        // unlikely, but the ID must be unique anyway
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t t = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        uint64_t s = (uint64_t) (uintptr_t) buffer ^ (uint64_t) pthread_self();
+        memcpy(b, &t, 8);
+        memcpy(b + 8, &s, 8);
+    }
+    b[6] = (b[6] & 0x0F) | 0x40;  // version 4
+    b[8] = (b[8] & 0x3F) | 0x80;  // variant
+    snprintf(buffer, 37,
+             "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+             b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+}
+
+static void make_date(char* buffer, size_t size)
+{
+    time_t now = time(nullptr);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static bool write_record(CurlWarcWriterData* writer, WarcSegment* segment, char* warc_headers,
+                         void* block1, size_t size1, void* block2, size_t size2)
+/*
+ * Write record made of WARC headers and block which consists of two parts.
+ */
+{
+    return begin_record(writer, segment)
+        && write_record_data(writer, segment, warc_headers, strlen(warc_headers), false)
+        && write_record_data(writer, segment, block1, size1, false)
+        && write_record_data(writer, segment, block2, size2, false)
+        && write_record_data(writer, segment, "\r\n\r\n", 4, true);
+}
+
+static bool open_segment(CurlWarcWriterData* writer, WarcSegment* segment)
+/*
+ * Open new segment file and write warcinfo record.
+ */
+{
+    static char* extensions[] = { "", ".gz", ".zst" };
+
+    if (!init_compressor(writer, segment)) {
+        fprintf(stderr, "ERROR: cannot initialize WARC compression\n");
+        return false;
+    }
+
+    unsigned number = atomic_fetch_add(&writer->next_number, 1);
+
+    UW_CSTRING_LOCAL(prefix_cstr, &writer->prefix);
+    char filename[strlen(prefix_cstr) + 32];
+    snprintf(filename, sizeof(filename), "%s-%05u.warc%s",
+             prefix_cstr, number, extensions[writer->compression]);
+
+    segment->fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (segment->fd < 0) {
+        perror(filename);
+        return false;
+    }
+    segment->size = 0;
+
+    char* info = "software: uw-curl\r\nformat: WARC File Format 1.1\r\n";
+    char uuid[37];
+    char date[32];
+    make_uuid(uuid);
+    make_date(date, sizeof(date));
+    char* basename = strrchr(filename, '/');
+    basename = basename? basename + 1 : filename;
+
+    char headers[sizeof(filename) + 256];
+    snprintf(headers, sizeof(headers),
+             "WARC/1.1\r\n"
+             "WARC-Type: warcinfo\r\n"
+             "WARC-Record-ID: <urn:uuid:%s>\r\n"
+             "WARC-Date: %s\r\n"
+             "WARC-Filename: %s\r\n"
+             "Content-Type: application/warc-fields\r\n"
+             "Content-Length: %zu\r\n"
+             "\r\n",
+             uuid, date, basename, strlen(info));
+
+    return write_record(writer, segment, headers, info, strlen(info), nullptr, 0);
+}
+
+/****************************************************************
+ * HTTP messages
+ */
+
+static bool append_cstr(CurlBuffer* buffer, char* str)
+{
+    return curl_buffer_append(buffer, str, strlen(str));
+}
+
+static bool append_slice(CurlBuffer* buffer, CurlSlice slice)
+{
+    return curl_buffer_append(buffer, slice.ptr, slice.length);
+}
+
+static bool make_request_block(CurlRequestData* req, char* url, CurlBuffer* block)
+{
+    CurlUrlView view;
+    curl_url_view(url, strlen(url), &view);
+
+    char* method = nullptr;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_EFFECTIVE_METHOD, &method);
+
+    bool ok = append_cstr(block, method? method : "GET")
+        && append_cstr(block, " ")
+        && (view.path.length? append_slice(block, view.path) : append_cstr(block, "/"));
+    if (ok && view.query.length) {
+        ok = append_cstr(block, "?") && append_slice(block, view.query);
+    }
+    ok = ok && append_cstr(block, " HTTP/1.1\r\nHost: ")
+        && append_slice(block, view.host);
+    if (ok && view.port.length) {
+        ok = append_cstr(block, ":") && append_slice(block, view.port);
+    }
+    ok = ok && append_cstr(block, "\r\n");
+
+    struct curl_slist* headers = req->headers? req->headers : req->base_headers;
+    for (; ok && headers; headers = headers->next) {
+        ok = append_cstr(block, headers->data) && append_cstr(block, "\r\n");
+    }
+    return ok && append_cstr(block, "\r\n");
+}
+
+static bool make_response_headers(CurlRequestData* req, size_t content_length, CurlBuffer* block)
+{
+    long http_version = 0;
+    curl_easy_getinfo(req->easy_handle, CURLINFO_HTTP_VERSION, &http_version);
+    char* version;
+    switch (http_version) {
+        case CURL_HTTP_VERSION_1_0: version = "1.0"; break;
+        case CURL_HTTP_VERSION_2_0: version = "2";   break;
+        case CURL_HTTP_VERSION_3:   version = "3";   break;
+        default:                    version = "1.1"; break;
+    }
+    char line[64];
+    snprintf(line, sizeof(line), "HTTP/%s %u \r\n", version, req->status);
+    if (!append_cstr(block, line)) {
+        return false;
+    }
+
+    // headers of the last response
+    struct curl_header* h = nullptr;
+    while ((h = curl_easy_nextheader(req->easy_handle, CURLH_HEADER, -1, h))) {
+        if ((strcasecmp(h->name, "Content-Encoding") == 0 && req->decode_mode == CURL_DECODE_INLINE)
+            || strcasecmp(h->name, "Transfer-Encoding") == 0
+            || strcasecmp(h->name, "Content-Length") == 0) {
+            continue;
+        }
+        if (!(append_cstr(block, h->name)
+              && append_cstr(block, ": ")
+              && append_cstr(block, h->value)
+              && append_cstr(block, "\r\n"))) {
+            return false;
+        }
+    }
+    snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", content_length);
+    return append_cstr(block, line);
+}
+
+static bool write_exchange(CurlWarcWriterData* writer, CurlRequestData* req, uint8_t* body, size_t body_size)
+{
+    WarcSegment* segment = get_segment(writer);
+    if (!segment) {
+        return false;
+    }
+    if (segment->fd >= 0 && segment->size >= writer->max_segment_size) {
+        close_segment(segment);
+    }
+    if (segment->fd < 0 && !open_segment(writer, segment)) {
+        return false;
+    }
+
+    UW_CSTRING_LOCAL(url_cstr, &req->real_url);
+
+    // blocks are small, keep them in memory
+    CurlBuffer request_block;
+    CurlBuffer response_headers;
+    curl_buffer_init(&request_block, SIZE_MAX);
+    curl_buffer_init(&response_headers, SIZE_MAX);
+
+    bool ok = make_request_block(req, url_cstr, &request_block)
+        && make_response_headers(req, body_size, &response_headers);
+
+    if (ok) {
+        char response_id[37];
+        char request_id[37];
+        char date[32];
+        make_uuid(response_id);
+        make_uuid(request_id);
+        make_date(date, sizeof(date));
+
+        char payload_digest[CURL_DIGEST_MAX_SIZE * 2 + 64] = "";
+        if (req->digest && (req->digest->algorithms & CURL_DIGEST_SHA256)) {
+            UwValue hex = curl_digest_hex(req->digest, CURL_DIGEST_SHA256);
+            if (uw_is_string(&hex)) {
+                UW_CSTRING_LOCAL(hex_cstr, &hex);
+                snprintf(payload_digest, sizeof(payload_digest), "WARC-Payload-Digest: sha256:%s\r\n", hex_cstr);
+            }
+        }
+
+        size_t headers_size = strlen(url_cstr) + sizeof(payload_digest) + 512;
+        char headers[headers_size];
+
+        snprintf(headers, headers_size,
+                 "WARC/1.1\r\n"
+                 "WARC-Type: response\r\n"
+                 "WARC-Record-ID: <urn:uuid:%s>\r\n"
+                 "WARC-Date: %s\r\n"
+                 "WARC-Target-URI: %s\r\n"
+                 "%s"
+                 "Content-Type: application/http;msgtype=response\r\n"
+                 "Content-Length: %zu\r\n"
+                 "\r\n",
+                 response_id, date, url_cstr, payload_digest, response_headers.size + body_size);
+        ok = write_record(writer, segment, headers, response_headers.data, response_headers.size, body, body_size);
+
+        if (ok) {
+            snprintf(headers, headers_size,
+                     "WARC/1.1\r\n"
+                     "WARC-Type: request\r\n"
+                     "WARC-Record-ID: <urn:uuid:%s>\r\n"
+                     "WARC-Date: %s\r\n"
+                     "WARC-Target-URI: %s\r\n"
+                     "WARC-Concurrent-To: <urn:uuid:%s>\r\n"
+                     "Content-Type: application/http;msgtype=request\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n",
+                     request_id, date, url_cstr, response_id, request_block.size);
+            ok = write_record(writer, segment, headers, request_block.data, request_block.size, nullptr, 0);
+        }
+    }
+    curl_buffer_fini(&request_block);
+    curl_buffer_fini(&response_headers);
+    return ok;
+}
+
+/****************************************************************
+ * Writer type
+ */
+
+static void fini_warc_writer(UwValuePtr self)
+{
+    CurlWarcWriterData* writer = warc_writer_data_ptr(self);
+
+    unsigned n = atomic_load(&writer->num_segments);
+    for (unsigned i = 0; i < n; i++) {
+        fini_segment(&writer->segments[i]);
+    }
+    atomic_store(&writer->num_segments, 0);
+    pthread_mutex_destroy(&writer->lock);
+    uw_destroy(&writer->prefix);
+
+    uw_ancestor_of(UwTypeId_CurlWarcWriter)->fini(self);
+}
+
+static UwResult init_warc_writer(UwValuePtr self, void* ctor_args)
+{
+    UwValue status = uw_ancestor_of(UwTypeId_CurlWarcWriter)->init(self, ctor_args);
+    uw_return_if_error(&status);
+
+    CurlWarcWriterData* writer = warc_writer_data_ptr(self);
+    pthread_mutex_init(&writer->lock, nullptr);
+    return UwOK();
+}
+
+UwResult curl_warc_writer(UwValuePtr prefix, CurlWarcCompression compression, uint64_t max_segment_size)
+{
+#ifndef UW_CURL_HAVE_ZSTD
+    if (compression == CURL_WARC_ZSTD) {
+        fprintf(stderr, "WARNING: built without zstd, using gzip for WARC\n");
+        compression = CURL_WARC_GZIP;
+    }
+#endif
+    UwValue result = uw_create(UwTypeId_CurlWarcWriter);
+    uw_return_if_error(&result);
+
+    CurlWarcWriterData* writer = warc_writer_data_ptr(&result);
+    writer->prefix = uw_clone(prefix);
+    writer->compression = compression;
+    writer->max_segment_size = max_segment_size? max_segment_size : CURL_WARC_SEGMENT_SIZE;
+    return uw_move(&result);
+}
+
+void curl_warc_writer_close(UwValuePtr self)
+{
+    CurlWarcWriterData* writer = warc_writer_data_ptr(self);
+
+    unsigned n = atomic_load(&writer->num_segments);
+    for (unsigned i = 0; i < n; i++) {
+        close_segment(&writer->segments[i]);
+    }
+}
+
+/****************************************************************
+ * Sink stage
+ */
+
+typedef struct {
+    _UwValue writer;
+    CurlBuffer body;
+
+} CurlWarcSinkData;
+
+#define warc_sink_data_ptr(value)  ((CurlWarcSinkData*) _uw_get_data_ptr((value), UwTypeId_CurlWarcSink))
+
+UwTypeId UwTypeId_CurlWarcSink = 0;
+
+static void fini_warc_sink(UwValuePtr self)
+{
+    CurlWarcSinkData* sink = warc_sink_data_ptr(self);
+
+    curl_buffer_fini(&sink->body);
+    uw_destroy(&sink->writer);
+
+    uw_ancestor_of(UwTypeId_CurlWarcSink)->fini(self);
+}
+
+static CurlStageResult warc_sink_process(UwValuePtr self, UwValuePtr request, uint8_t* data, size_t size)
+{
+    CurlWarcSinkData* sink = warc_sink_data_ptr(self);
+
+    if (!curl_buffer_append(&sink->body, data, size)) {
+        return CURL_STAGE_ABORT;
+    }
+    return CURL_STAGE_CONTINUE;
+}
+
+static void warc_sink_complete(UwValuePtr self, UwValuePtr request)
+{
+    CurlWarcSinkData* sink = warc_sink_data_ptr(self);
+    CurlRequestData* req = uw_curl_request_data_ptr(request);
+
+    uint8_t* body;
+    size_t body_size;
+    if (!curl_buffer_view(&sink->body, &body, &body_size)) {
+        return;
+    }
+    if (!write_exchange(warc_writer_data_ptr(&sink->writer), req, body, body_size)) {
+        UW_CSTRING_LOCAL(url_cstr, &req->real_url);
+        fprintf(stderr, "ERROR: cannot write WARC records for %s\n", url_cstr);
+    }
+    curl_buffer_fini(&sink->body);
+}
+
+static UwInterface_CurlStage warc_sink_interface = {
+    .process  = warc_sink_process,
+    .complete = warc_sink_complete
+};
+
+UwResult curl_warc_sink(UwValuePtr writer)
+{
+    UwValue result = uw_create(UwTypeId_CurlWarcSink);
+    uw_return_if_error(&result);
+
+    CurlWarcSinkData* sink = warc_sink_data_ptr(&result);
+    sink->writer = uw_clone(writer);
+    curl_buffer_init(&sink->body, 0);
+    return uw_move(&result);
+}
+
+/****************************************************************
+ * Types
+ */
+
+static UwType warc_writer_type;
+static UwType warc_sink_type;
+
+[[ gnu::constructor ]]
+static void init()
+{
+    _curl_register_stage_interface();
+
+    UwTypeId_CurlWarcWriter = uw_subtype(
+        &warc_writer_type, "CurlWarcWriter",
+        UwTypeId_Struct,
+        CurlWarcWriterData
+    );
+    warc_writer_type.init = init_warc_writer;
+    warc_writer_type.fini = fini_warc_writer;
+
+    UwTypeId_CurlWarcSink = uw_subtype(
+        &warc_sink_type, "CurlWarcSink",
+        UwTypeId_Struct,
+        CurlWarcSinkData,
+        UwInterfaceId_CurlStage, &warc_sink_interface
+    );
+    warc_sink_type.fini = fini_warc_sink;
+}
@@ -0,0 +1,278 @@
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <uw.h>
+
+#include "uw_curl_internal.h"
+
+/*
+ * Completion workers.
+ *
+ * Completed requests are passed from the event loop thread to worker threads
+ * through a bounded lock-free ring buffer (Dmitry Vyukov's MPMC queue).
+ * The semaphore is used only to put idle workers to sleep.
+ *
+ * Ownership: the queue takes over the private clone of request created in init_curl_request,
+ * i.e. heap-allocated UwValuePtr. The worker calls complete and puts the request
+ * to the list of completed ones. Easy handle is removed from multi handle before
+ * the request is queued, so the loop thread does not touch the request until
+ * it takes it from that list to destroy and release it.
+ * Destroying is left to the loop thread because values held by the request
+ * can be shared with requests it is creating, and UW reference counts are not atomic.
+ * The allocator used by requests must be thread-safe, workers are not started otherwise.
+ */
+
+typedef struct {
+    _Atomic size_t sequence;
+    UwValuePtr request;
+
+} QueueCell;
+
+struct CurlWorkers {
+    QueueCell* cells;
+    size_t capacity;
+    size_t mask;
+
+    // keep producer and consumer positions in separate cache lines,
+    // allocator does not guarantee alignment, so simply use padding
+    char pad1[64];
+    _Atomic size_t enqueue_pos;
+    char pad2[64];
+    _Atomic size_t dequeue_pos;
+    char pad3[64];
+
+    sem_t items;
+
+    // completed requests to be released by the loop thread
+    pthread_mutex_t completed_lock;
+    UwValuePtr completed_head;
+
+    CurlSessionData* session;
+    unsigned num_threads;
+    unsigned max_threads;
+    pthread_t* threads;
+};
+
+static bool enqueue(CurlWorkers* workers, UwValuePtr request)
+{
+    QueueCell* cell;
+    size_t pos = atomic_load_explicit(&workers->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = &workers->cells[pos & workers->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&workers->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&workers->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->request = request;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    sem_post(&workers->items);
+    return true;
+}
+
+static bool dequeue(CurlWorkers* workers, UwValuePtr* request)
+{
+    QueueCell* cell;
+    size_t pos = atomic_load_explicit(&workers->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = &workers->cells[pos & workers->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&workers->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // empty
+            return false;
+        } else {
+            pos = atomic_load_explicit(&workers->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    *request = cell->request;
+    atomic_store_explicit(&cell->sequence, pos + workers->mask + 1, memory_order_release);
+    return true;
+}
+
+static void* worker_thread(void* arg)
+{
+    CurlWorkers* workers = arg;
+
+    for (;;) {
+        while (sem_wait(&workers->items) != 0) {
+            // interrupted by signal
+        }
+        UwValuePtr request;
+        if (!dequeue(workers, &request)) {
+            // cannot happen: semaphore counts queued items
+            continue;
+        }
+        if (!request) {
+            // stop marker
+            break;
+        }
+        _curl_complete_request(request);
+
+        pthread_mutex_lock(&workers->completed_lock);
+        uw_curl_request_data_ptr(request)->next_completed = workers->completed_head;
+        workers->completed_head = request;
+        pthread_mutex_unlock(&workers->completed_lock);
+
+        if (atomic_fetch_sub(&workers->session->pending_completions, 1) == 1) {
+            // the loop may be waiting for the last completion
+            curl_multi_wakeup(workers->session->multi_handle);
+        }
+    }
+    return nullptr;
+}
+
+bool curl_session_start_workers(UwValuePtr session, unsigned num_workers, unsigned queue_capacity)
+{
+    CurlSessionData* sess = uw_curl_session_data_ptr(session);
+
+    if (sess->workers) {
+        fprintf(stderr, "ERROR %s: workers already started\n", __func__);
+        return false;
+    }
+    if (num_workers == 0) {
+        return false;
+    }
+    if (!curl_alloc_thread_safe()) {
+        fprintf(stderr, "ERROR %s: allocator is not thread-safe, see curl_alloc_serialize\n", __func__);
+        return false;
+    }
+    // round capacity up to power of two, leaving room for stop markers
+    size_t capacity = 2;
+    while (capacity < (size_t) queue_capacity + num_workers) {
+        capacity <<= 1;
+    }
+
+    CurlWorkers* workers = default_allocator.allocate(sizeof(CurlWorkers), true);
+    if (!workers) {
+        return false;
+    }
+    workers->cells = default_allocator.allocate(capacity * sizeof(QueueCell), true);
+    workers->threads = default_allocator.allocate(num_workers * sizeof(pthread_t), true);
+    if (!workers->cells || !workers->threads) {
+        goto error;
+    }
+    workers->capacity = capacity;
+    workers->max_threads = num_workers;
+    workers->session = sess;
+    workers->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&workers->cells[i].sequence, i);
+    }
+    atomic_init(&workers->enqueue_pos, 0);
+    atomic_init(&workers->dequeue_pos, 0);
+    if (sem_init(&workers->items, 0, 0) != 0) {
+        goto error;
+    }
+    pthread_mutex_init(&workers->completed_lock, nullptr);
+    for (unsigned i = 0; i < num_workers; i++) {
+        int err = pthread_create(&workers->threads[i], nullptr, worker_thread, workers);
+        if (err) {
+            fprintf(stderr, "ERROR %s: cannot start worker thread: %s\n", __func__, strerror(err));
+            break;
+        }
+        workers->num_threads++;
+    }
+    sess->workers = workers;
+    if (workers->num_threads == 0) {
+        curl_session_stop_workers(session);
+        return false;
+    }
+    return true;
+
+error:
+    if (workers->cells) {
+        default_allocator.release((void**) &workers->cells, capacity * sizeof(QueueCell));
+    }
+    if (workers->threads) {
+        default_allocator.release((void**) &workers->threads, num_workers * sizeof(pthread_t));
+    }
+    default_allocator.release((void**) &workers, sizeof(CurlWorkers));
+    return false;
+}
+
+void curl_session_stop_workers(UwValuePtr session)
+/*
+ * Wait for queued completions and stop worker threads.
+ */
+{
+    _curl_stop_workers(uw_curl_session_data_ptr(session));
+}
+
+void _curl_stop_workers(CurlSessionData* session)
+{
+    CurlWorkers* workers = session->workers;
+    if (!workers) {
+        return;
+    }
+    for (unsigned i = 0; i < workers->num_threads; i++) {
+        while (!enqueue(workers, nullptr)) {
+            sched_yield();
+        }
+    }
+    for (unsigned i = 0; i < workers->num_threads; i++) {
+        pthread_join(workers->threads[i], nullptr);
+    }
+    sem_destroy(&workers->items);
+
+    _curl_release_completed(session);
+    pthread_mutex_destroy(&workers->completed_lock);
+
+    default_allocator.release((void**) &workers->cells, workers->capacity * sizeof(QueueCell));
+    default_allocator.release((void**) &workers->threads, workers->max_threads * sizeof(pthread_t));
+    default_allocator.release((void**) &session->workers, sizeof(CurlWorkers));
+}
+
+bool _curl_queue_completion(CurlSessionData* session, UwValuePtr request)
+/*
+ * Pass request to workers. Return false if the queue is full.
+ */
+{
+    atomic_fetch_add(&session->pending_completions, 1);
+    if (enqueue(session->workers, request)) {
+        session->stats.completions_queued++;
+        return true;
+    } else {
+        atomic_fetch_sub(&session->pending_completions, 1);
+        session->stats.completions_inline++;
+        return false;
+    }
+}
+
+void _curl_release_completed(CurlSessionData* session)
+/*
+ * Destroy and release requests completed by workers, called by loop thread.
+ */
+{
+    CurlWorkers* workers = session->workers;
+    if (!workers) {
+        return;
+    }
+    pthread_mutex_lock(&workers->completed_lock);
+    UwValuePtr request = workers->completed_head;
+    workers->completed_head = nullptr;
+    pthread_mutex_unlock(&workers->completed_lock);
+
+    while (request) {
+        UwValuePtr next = uw_curl_request_data_ptr(request)->next_completed;
+        _curl_release_request(request);
+        request = next;
+    }
+}
@@ -583,31 +583,168 @@ UwResult curl_request_get_filename(CurlRequestData* req)
         }
     }
 
-    UwValue parts = UwNull();
+    char* url;
+    unsigned url_length;
+    UW_CSTRING_LOCAL(url_cstr, &req->url);
 
     char* last_location = get_response_header(req->easy_handle, "Location");
     if (last_location) {
-        UwValue location = uw_create_string(last_location);
-        uw_return_if_error(&location);
-
-        parts = uw_string_split_chr(&location, '/', 0);
+        url = last_location;
     } else {
-        parts = uw_string_split_chr(&req->url, '/', 0);
+        url = url_cstr;
     }
-    uw_return_if_error(&parts);
+    url_length = strlen(url);
 
-    UwValue filename = uw_array_item(&parts, -1);
-    if (uw_strlen(&filename) == 0) {
-        if (!uw_string_append(&filename, "index.html")) {
-            return UwOOM();
-        }
+    CurlUrlView view;
+    curl_url_view(url, url_length, &view);
+
+    UwValue filename = UwNull();
+    if (view.basename.length == 0) {
+        filename = uw_create_string("index.html");
+    } else {
+        char decoded[view.basename.length + 1];
+        curl_percent_decode(view.basename, decoded, sizeof(decoded));
+        filename = uw_create_string(decoded);
     }
+    uw_return_if_error(&filename);
+
     return UwMap(
         UwCharPtr("filename"), uw_move(&filename),
         UwCharPtr("charset"),  UwString()
     );
 }
 
+/****************************************************************
+ * URL views
+ */
+
+static inline CurlSlice make_slice(char* start, char* end)
+{
+    return (CurlSlice) { .ptr = start, .length = end - start };
+}
+
+static char* find_any(char* start, char* end, char* chars)
+/*
+ * Return pointer to the first character from chars, or end.
+ */
+{
+    for (char* p = start; p < end; p++) {
+        if (strchr(chars, *p)) {
+            return p;
+        }
+    }
+    return end;
+}
+
+void curl_url_view(char* url, unsigned length, CurlUrlView* view)
+/*
+ * Split URL as in RFC 3986, Appendix B:
+ *
+ *   scheme ":" "//" authority path "?" query "#" fragment
+ */
+{
+    memset(view, 0, sizeof(CurlUrlView));
+
+    char* p = url;
+    char* end = url + length;
+
+    // scheme
+    char* delim = find_any(p, end, ":/?#");
+    if (delim < end && *delim == ':' && delim > p) {
+        view->scheme = make_slice(p, delim);
+        p = delim + 1;
+    }
+
+    // authority
+    if (end - p >= 2 && p[0] == '/' && p[1] == '/') {
+        p += 2;
+        char* authority_end = find_any(p, end, "/?#");
+
+        // userinfo ends with the last @
+        for (char* q = authority_end; q > p; q--) {
+            if (q[-1] == '@') {
+                view->userinfo = make_slice(p, q - 1);
+                p = q;
+                break;
+            }
+        }
+        // port follows the last colon that is not a part of IPv6 address
+        char* host_end = authority_end;
+        for (char* q = authority_end; q > p; q--) {
+            if (q[-1] == ']') {
+                break;
+            }
+            if (q[-1] == ':') {
+                view->port = make_slice(q, authority_end);
+                host_end = q - 1;
+                break;
+            }
+        }
+        view->host = make_slice(p, host_end);
+        p = authority_end;
+    }
+
+    // path
+    char* path_end = find_any(p, end, "?#");
+    view->path = make_slice(p, path_end);
+    char* basename = path_end;
+    while (basename > p && basename[-1] != '/') {
+        basename--;
+    }
+    view->basename = make_slice(basename, path_end);
+    p = path_end;
+
+    // query
+    if (p < end && *p == '?') {
+        p++;
+        char* query_end = find_any(p, end, "#");
+        view->query = make_slice(p, query_end);
+        p = query_end;
+    }
+
+    // fragment
+    if (p < end && *p == '#') {
+        p++;
+        view->fragment = make_slice(p, end);
+    }
+}
+
+static inline int hex_value(char c)
+{
+    if ('0' <= c && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if ('a' <= c && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+unsigned curl_percent_decode(CurlSlice src, char* dest, unsigned dest_size)
+{
+    if (dest_size == 0) {
+        return 0;
+    }
+    unsigned n = 0;
+    char* p = src.ptr;
+    char* end = src.ptr + src.length;
+    while (p < end && n < dest_size - 1) {
+        char c = *p++;
+        if (c == '%' && end - p >= 2) {
+            int hi = hex_value(p[0]);
+            int lo = hex_value(p[1]);
+            if (hi >= 0 && lo >= 0) {
+                c = (char) ((hi << 4) | lo);
+                p += 2;
+            }
+        }
+        dest[n++] = c;
+    }
+    dest[n] = 0;
+    return n;
+}
+
 UwResult urljoin_cstr(char* base_url, char* other_url)
 {
     CURLU* handle = curl_url();
@@ -647,3 +784,43 @@ UwResult urljoin(UwValuePtr base_url, UwValuePtr other_url)
     UW_CSTRING_LOCAL(cstr_other_url, other_url);
     return urljoin_cstr(cstr_base_url, cstr_other_url);
 }
+
+UwResult urlorigin(UwValuePtr url)
+/*
+ * Return scheme, host and port of url, with root path.
+ * Scheme and host are lowercased.
+ */
+{
+    UW_CSTRING_LOCAL(url_cstr, url);
+
+    CurlUrlView view;
+    curl_url_view(url_cstr, strlen(url_cstr), &view);
+
+    UwValue result = uw_create_empty_string(
+        view.scheme.length + view.host.length + view.port.length + 5, 1
+    );
+    uw_return_if_error(&result);
+
+    if (!uw_string_append_substring(&result, view.scheme.ptr, 0, view.scheme.length)) {
+        return UwOOM();
+    }
+    if (!uw_string_append(&result, "://")) {
+        return UwOOM();
+    }
+    if (!uw_string_append_substring(&result, view.host.ptr, 0, view.host.length)) {
+        return UwOOM();
+    }
+    uw_string_lower(&result);
+    if (view.port.length) {
+        if (!uw_string_append(&result, ":")) {
+            return UwOOM();
+        }
+        if (!uw_string_append_substring(&result, view.port.ptr, 0, view.port.length)) {
+            return UwOOM();
+        }
+    }
+    if (!uw_string_append(&result, "/")) {
+        return UwOOM();
+    }
+    return uw_move(&result);
+}